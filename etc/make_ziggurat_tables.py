@@ -0,0 +1,119 @@
+#!/usr/bin/python
+#
+#   Libottery by Nick Mathewson.
+#
+#   This software has been dedicated to the public domain under the CC0
+#   public domain dedication.
+#
+#   To the extent possible under law, the person who associated CC0 with
+#   libottery has waived all copyright and related or neighboring rights
+#   to libottery.
+#
+#   You should have received a copy of the CC0 legalcode along with this
+#   work in doc/cc0.txt.  If not, see
+#      <http://creativecommons.org/publicdomain/zero/1.0/>.
+#
+# Generate src/ottery_ziggurat_tables.h, the layer tables for the ziggurat
+# samplers in ottery.c.
+#
+# A ziggurat for a decreasing density f on [0, inf) is a stack of N layers
+# of equal area V.  Layer 0 is the rectangle [0, R) x [0, f(R)) plus the
+# tail beyond R; we give it a notional width x[0] = V / f(R).  For i >= 1,
+# layer i is the rectangle [0, x[i]) x [f(x[i]), f(x[i+1])), and x[N] = 0.
+# We pick R so that the layers come out even, working with 50 digits so
+# that the doubles we print are right.
+#
+# Usage: make_ziggurat_tables.py > src/ottery_ziggurat_tables.h
+
+from __future__ import print_function
+from decimal import Decimal, getcontext
+
+getcontext().prec = 50
+
+def normal_f(x):
+    return (-(x * x) / 2).exp()
+
+def normal_finv(y):
+    return (-2 * y.ln()).sqrt()
+
+def normal_tail(r):
+    # Integral of exp(-t^2/2) from r to infinity, by the continued
+    # fraction exp(-r^2/2) / (r + 1/(r + 2/(r + 3/(r + ...)))).
+    d = r
+    for k in range(400, 0, -1):
+        d = r + k / d
+    return normal_f(r) / d
+
+def exp_f(x):
+    return (-x).exp()
+
+def exp_finv(y):
+    return -y.ln()
+
+def exp_tail(r):
+    return exp_f(r)
+
+def layers(n, f, finv, tail, r):
+    """Return (x, v) for an n-layer ziggurat with base layer edge r, or
+       (None, v) if the layers reach the top too soon."""
+    v = r * f(r) + tail(r)
+    x = [v / f(r), r]
+    for i in range(1, n - 1):
+        y = v / x[i] + f(x[i])
+        if y >= 1:
+            return None, v
+        x.append(finv(y))
+    x.append(Decimal(0))
+    return x, v
+
+def solve(n, f, finv, tail, lo, hi):
+    lo, hi = Decimal(lo), Decimal(hi)
+    for _ in range(200):
+        r = (lo + hi) / 2
+        x, v = layers(n, f, finv, tail, r)
+        if x is None:
+            # The layers are too big: move the base out.
+            lo = r
+        elif x[n - 1] * (1 - f(x[n - 1])) > v:
+            # The top layer is too big: the others are too small.
+            hi = r
+        else:
+            lo = r
+    x, v = layers(n, f, finv, tail, lo)
+    return lo, v, x
+
+def dump(name, n, f, r, v, x):
+    print("/** Number of layers in the %s ziggurat. */" % name)
+    print("#define ZIGGURAT_%s_N %d" % (name.upper(), n))
+    print("/** Right edge of the base layer of the %s ziggurat. */" % name)
+    print("#define ZIGGURAT_%s_R %.17g" % (name.upper(), r))
+    print("/** Area of each layer of the %s ziggurat. */" % name)
+    print("#define ZIGGURAT_%s_V %.17g" % (name.upper(), v))
+    print()
+    print("/** Right edges of the layers of the %s ziggurat. */" % name)
+    print("static const double ottery_zig_%s_x_[%d] = {" % (name, n + 1))
+    for i in range(0, n + 1, 3):
+        print("  " + " ".join("%.17g," % x[j]
+                              for j in range(i, min(i + 3, n + 1))))
+    print("};")
+    print("/** The density at each entry of ottery_zig_%s_x_. */" % name)
+    print("static const double ottery_zig_%s_f_[%d] = {" % (name, n + 1))
+    for i in range(0, n + 1, 3):
+        print("  " + " ".join("%.17g," % f(x[j])
+                              for j in range(i, min(i + 3, n + 1))))
+    print("};")
+    print()
+
+def main():
+    print("/* Generated by etc/make_ziggurat_tables.py.  Do not edit. */")
+    print("#ifndef OTTERY_ZIGGURAT_TABLES_H_HEADER_INCLUDED_")
+    print("#define OTTERY_ZIGGURAT_TABLES_H_HEADER_INCLUDED_")
+    print()
+    r, v, x = solve(128, normal_f, normal_finv, normal_tail, 3, 4)
+    dump("normal", 128, normal_f, r, v, x)
+    r, v, x = solve(256, exp_f, exp_finv, exp_tail, 7, 8)
+    dump("exp", 256, exp_f, r, v, x)
+    print("#endif")
+
+if __name__ == '__main__':
+    main()
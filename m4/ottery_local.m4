@@ -104,6 +104,31 @@ AC_DEFUN([_OTTERY_CHECK_SIMD_SSSE3],
             _mm_set_epi8(14,13,12,15,10,9,8,11,6,5,4,7,2,1,0,3));
 ]])])
 
+AC_DEFUN([_OTTERY_CHECK_SIMD_AVX2],
+[_OTTERY_CHECK_SIMD_SPECIFIC([AVX2 intrinsics],
+  [x86_avx2_intrinsics], [SIMD_AVX2_CFLAGS], [-mavx2], [[
+#if !__AVX2__
+#error "AVX2 test macro should be defined"
+#endif
+#include <immintrin.h>
+]], [[
+ extern __m256i x, y;
+ y = _mm256_shuffle_epi8(_mm256_add_epi32(x, y),
+            _mm256_permute2x128_si256(x, y, 0x20));
+]])])
+
+AC_DEFUN([_OTTERY_CHECK_SIMD_AVX512],
+[_OTTERY_CHECK_SIMD_SPECIFIC([AVX-512F intrinsics],
+  [x86_avx512f_intrinsics], [SIMD_AVX512_CFLAGS], [-mavx512f], [[
+#if !__AVX512F__
+#error "AVX-512F test macro should be defined"
+#endif
+#include <immintrin.h>
+]], [[
+ extern __m512i x, y;
+ y = _mm512_rol_epi32(_mm512_shuffle_i32x4(x, y, 0x44), 7);
+]])])
+
 # ARM
 
 AC_DEFUN([_OTTERY_CHECK_SIMD_NEON],
@@ -140,11 +165,15 @@ AC_DEFUN([OTTERY_USE_SIMD],
 [AC_REQUIRE([AC_CANONICAL_HOST])
 SIMD1_CFLAGS=
 SIMD2_CFLAGS=
+SIMD_AVX2_CFLAGS=
+SIMD_AVX512_CFLAGS=
 AS_IF([test $enable_simd = yes],
   [AS_CASE([$host_cpu],
   [i?86 | x86_64], [
     _OTTERY_CHECK_SIMD_SSE2
     _OTTERY_CHECK_SIMD_SSSE3
+    _OTTERY_CHECK_SIMD_AVX2
+    _OTTERY_CHECK_SIMD_AVX512
   ],
   [arm*], [
     _OTTERY_CHECK_SIMD_NEON
@@ -159,6 +188,8 @@ AS_IF([test x"$SIMD1_CFLAGS" = x && x"$SIMD2_CFLAGS" != x],
   SIMD2_CFLAGS=])
 AC_SUBST(SIMD1_CFLAGS)dnl
 AC_SUBST(SIMD2_CFLAGS)dnl
+AC_SUBST(SIMD_AVX2_CFLAGS)dnl
+AC_SUBST(SIMD_AVX512_CFLAGS)dnl
 AM_CONDITIONAL(SIMD_CHACHA_1, [test x"$SIMD1_CFLAGS" != x])
 AS_IF([test x"$SIMD1_CFLAGS" != x],
   [AC_DEFINE([HAVE_SIMD_CHACHA], [1],
@@ -168,4 +199,13 @@ AS_IF([test x"$SIMD2_CFLAGS" != x],
   [AC_DEFINE([HAVE_SIMD_CHACHA_2], [1],
     [Define to 1 if a second SIMD-optimized ChaCha implementation is
      available.])])
+AM_CONDITIONAL(SIMD_CHACHA_AVX2, [test x"$SIMD_AVX2_CFLAGS" != x])
+AS_IF([test x"$SIMD_AVX2_CFLAGS" != x],
+  [AC_DEFINE([HAVE_SIMD_CHACHA_AVX2], [1],
+    [Define to 1 if an AVX2-optimized ChaCha implementation is available.])])
+AM_CONDITIONAL(SIMD_CHACHA_AVX512, [test x"$SIMD_AVX512_CFLAGS" != x])
+AS_IF([test x"$SIMD_AVX512_CFLAGS" != x],
+  [AC_DEFINE([HAVE_SIMD_CHACHA_AVX512], [1],
+    [Define to 1 if an AVX-512-optimized ChaCha implementation is
+     available.])])
 ])
@@ -0,0 +1,198 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * ChaCha implementation for 32-byte AVX2 vectors.
+ *
+ * This follows the same plan as Ted Krovetz's code in chacha_krovetz.c: each
+ * vector register holds one row of the 4x4 ChaCha state, and a double-round
+ * is done by rotating the rows against each other.  The difference is that
+ * an AVX2 register holds two 128-bit lanes, so every vector operation here
+ * advances two blocks at once: the low lane holds block N, and the high lane
+ * holds block N+1.  With four sets of vectors in flight, we compute 8 blocks
+ * per pass.
+ *
+ * This file has to be built with -mavx2, and must only be called when
+ * ottery_get_cpu_capabilities_() reports OTTERY_CPUCAP_AVX2.
+ */
+#include <string.h>
+#include <immintrin.h>
+#include "ottery-internal.h"
+
+#ifndef __AVX2__
+#error "chacha_avx2.c must be built with AVX2 support enabled."
+#endif
+
+typedef __m256i vec;
+
+#define ADD(a,b)   _mm256_add_epi32((a),(b))
+#define XOR(a,b)   _mm256_xor_si256((a),(b))
+#define ROTV1(x)   _mm256_shuffle_epi32((x),_MM_SHUFFLE(0,3,2,1))
+#define ROTV2(x)   _mm256_shuffle_epi32((x),_MM_SHUFFLE(1,0,3,2))
+#define ROTV3(x)   _mm256_shuffle_epi32((x),_MM_SHUFFLE(2,1,0,3))
+#define ROTW7(x)   XOR(_mm256_slli_epi32((x), 7),_mm256_srli_epi32((x),25))
+#define ROTW12(x)  XOR(_mm256_slli_epi32((x),12),_mm256_srli_epi32((x),20))
+#define ROTW8(x)   _mm256_shuffle_epi8((x),rot8)
+#define ROTW16(x)  _mm256_shuffle_epi8((x),rot16)
+
+#define DQROUND_VECTORS(a,b,c,d)                                \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW16(d);                  \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW12(b);                  \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW8(d);                   \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW7(b);                   \
+    b = ROTV1(b); c = ROTV2(c); d = ROTV3(d);                   \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW16(d);                  \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW12(b);                  \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW8(d);                   \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW7(b);                   \
+    b = ROTV3(b); c = ROTV2(c); d = ROTV1(d);
+
+/* Store the two blocks held in the rows v0..v3: first the block in the low
+ * lanes, then the block in the high lanes. */
+#define WRITE2(op, v0, v1, v2, v3) do {                                 \
+    _mm256_storeu_si256((vec *)((op) +  0),                            \
+                        _mm256_permute2x128_si256((v0),(v1),0x20));    \
+    _mm256_storeu_si256((vec *)((op) + 32),                            \
+                        _mm256_permute2x128_si256((v2),(v3),0x20));    \
+    _mm256_storeu_si256((vec *)((op) + 64),                            \
+                        _mm256_permute2x128_si256((v0),(v1),0x31));    \
+    _mm256_storeu_si256((vec *)((op) + 96),                            \
+                        _mm256_permute2x128_si256((v2),(v3),0x31));    \
+  } while (0)
+
+struct chacha_state_avx2 {
+  __attribute__ ((aligned (16))) uint8_t key[32];
+  __attribute__ ((aligned (16))) uint8_t nonce[8];
+};
+
+/** Number of blocks computed per pass. */
+#define BPI             8
+#define LOOP_ITERATIONS 2
+
+static inline void
+ottery_blocks_chacha_avx2(
+        const int chacha_rounds,
+        uint8_t *out,
+        uint32_t block_idx,
+        const struct chacha_state_avx2 *st)
+  __attribute__((always_inline));
+
+/** Generates 64 * BPI * LOOP_ITERATIONS bytes of output using the key and
+ * nonce in st and the counter in block_idx, and store them in out.  The
+ * output need not be aligned.
+ */
+static inline void
+ottery_blocks_chacha_avx2(
+        const int chacha_rounds,
+        uint8_t *out,
+        uint32_t block_idx,
+        const struct chacha_state_avx2 *st)
+{
+  const vec rot16 = _mm256_set_epi8(13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2,
+                                    13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2);
+  const vec rot8  = _mm256_set_epi8(14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3,
+                                    14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3);
+  const vec two = _mm256_set_epi32(0,0,0,2, 0,0,0,2);
+  const vec s0 = _mm256_set_epi32(0x6B206574,0x79622D32,0x3320646E,0x61707865,
+                                  0x6B206574,0x79622D32,0x3320646E,0x61707865);
+  const vec s1 = _mm256_broadcastsi128_si256(
+                                 _mm_load_si128((const __m128i *)st->key));
+  const vec s2 = _mm256_broadcastsi128_si256(
+                                 _mm_load_si128((const __m128i *)(st->key+16)));
+  uint32_t n0, n1;
+  vec s3;
+  unsigned i, j;
+
+  memcpy(&n0, st->nonce, 4);
+  memcpy(&n1, st->nonce+4, 4);
+  /* The low lane is block_idx; the high lane is block_idx+1. */
+  s3 = _mm256_set_epi32(n1, n0, 0, block_idx + 1, n1, n0, 0, block_idx);
+
+  for (j = 0; j < LOOP_ITERATIONS; ++j) {
+    vec v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12,v13,v14,v15;
+    const vec s3_1 = ADD(s3, two);
+    const vec s3_2 = ADD(s3_1, two);
+    const vec s3_3 = ADD(s3_2, two);
+    v0 = v4 = v8  = v12 = s0;
+    v1 = v5 = v9  = v13 = s1;
+    v2 = v6 = v10 = v14 = s2;
+    v3 = s3; v7 = s3_1; v11 = s3_2; v15 = s3_3;
+
+    for (i = chacha_rounds/2; i; i--) {
+      DQROUND_VECTORS(v0,v1,v2,v3)
+      DQROUND_VECTORS(v4,v5,v6,v7)
+      DQROUND_VECTORS(v8,v9,v10,v11)
+      DQROUND_VECTORS(v12,v13,v14,v15)
+    }
+
+    WRITE2(out +   0, ADD(v0,s0),  ADD(v1,s1),  ADD(v2,s2),  ADD(v3,s3));
+    WRITE2(out + 128, ADD(v4,s0),  ADD(v5,s1),  ADD(v6,s2),  ADD(v7,s3_1));
+    WRITE2(out + 256, ADD(v8,s0),  ADD(v9,s1),  ADD(v10,s2), ADD(v11,s3_2));
+    WRITE2(out + 384, ADD(v12,s0), ADD(v13,s1), ADD(v14,s2), ADD(v15,s3_3));
+
+    s3 = ADD(s3_3, two);
+    out += 64 * BPI;
+  }
+}
+
+#define STATE_LEN   (sizeof(struct chacha_state_avx2))
+#define STATE_BYTES 40
+#define IDX_STEP    (BPI * LOOP_ITERATIONS)
+#define OUTPUT_LEN  (IDX_STEP * 64)
+
+static void
+chacha_avx2_state_setup(void *state, const uint8_t *bytes)
+{
+  struct chacha_state_avx2 *st = state;
+  memcpy(st->key, bytes, 32);
+  memcpy(st->nonce, bytes+32, 8);
+}
+
+static void
+chacha8_avx2_generate(void *state, uint8_t *output, uint32_t idx)
+{
+  const struct chacha_state_avx2 *st = state;
+  ottery_blocks_chacha_avx2(8, output, idx * IDX_STEP, st);
+}
+
+static void
+chacha12_avx2_generate(void *state, uint8_t *output, uint32_t idx)
+{
+  const struct chacha_state_avx2 *st = state;
+  ottery_blocks_chacha_avx2(12, output, idx * IDX_STEP, st);
+}
+
+static void
+chacha20_avx2_generate(void *state, uint8_t *output, uint32_t idx)
+{
+  const struct chacha_state_avx2 *st = state;
+  ottery_blocks_chacha_avx2(20, output, idx * IDX_STEP, st);
+}
+
+#define PRF_CHACHA(r) {                         \
+  "CHACHA" #r,                                  \
+  "CHACHA" #r "-SIMD",                          \
+  "CHACHA" #r "-SIMD-AVX2",                     \
+  STATE_LEN,                                    \
+  STATE_BYTES,                                  \
+  OUTPUT_LEN,                                   \
+  OTTERY_CPUCAP_AVX2|OTTERY_CPUCAP_SIMD,        \
+  chacha_avx2_state_setup,                      \
+  chacha ## r ## _avx2_generate,                \
+  OTTERY_PRF_FL_UNALIGNED_OUTPUT                \
+}
+
+const struct ottery_prf ottery_prf_chacha8_avx2_ = PRF_CHACHA(8);
+const struct ottery_prf ottery_prf_chacha12_avx2_ = PRF_CHACHA(12);
+const struct ottery_prf ottery_prf_chacha20_avx2_ = PRF_CHACHA(20);
@@ -0,0 +1,200 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * ChaCha implementation for 64-byte AVX-512 vectors.
+ *
+ * This is the same row-per-register plan as chacha_avx2.c, widened again: a
+ * zmm register holds four 128-bit lanes, so each vector operation advances
+ * four blocks, and with four sets of vectors in flight we compute 16 blocks
+ * per pass.  AVX-512F also gives us a real rotate instruction (vprold), so
+ * we don't need shift-shift-xor or byte shuffles for the word rotations.
+ *
+ * This file has to be built with -mavx512f, and must only be called when
+ * ottery_get_cpu_capabilities_() reports OTTERY_CPUCAP_AVX512.
+ */
+#include <string.h>
+#include <immintrin.h>
+#include "ottery-internal.h"
+
+#ifndef __AVX512F__
+#error "chacha_avx512.c must be built with AVX-512F support enabled."
+#endif
+
+typedef __m512i vec;
+
+#define ADD(a,b)   _mm512_add_epi32((a),(b))
+#define XOR(a,b)   _mm512_xor_si512((a),(b))
+#define ROTV1(x)   _mm512_shuffle_epi32((x),(_MM_PERM_ENUM)_MM_SHUFFLE(0,3,2,1))
+#define ROTV2(x)   _mm512_shuffle_epi32((x),(_MM_PERM_ENUM)_MM_SHUFFLE(1,0,3,2))
+#define ROTV3(x)   _mm512_shuffle_epi32((x),(_MM_PERM_ENUM)_MM_SHUFFLE(2,1,0,3))
+#define ROTW7(x)   _mm512_rol_epi32((x), 7)
+#define ROTW8(x)   _mm512_rol_epi32((x), 8)
+#define ROTW12(x)  _mm512_rol_epi32((x),12)
+#define ROTW16(x)  _mm512_rol_epi32((x),16)
+
+#define DQROUND_VECTORS(a,b,c,d)                                \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW16(d);                  \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW12(b);                  \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW8(d);                   \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW7(b);                   \
+    b = ROTV1(b); c = ROTV2(c); d = ROTV3(d);                   \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW16(d);                  \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW12(b);                  \
+    a = ADD(a,b); d = XOR(d,a); d = ROTW8(d);                   \
+    c = ADD(c,d); b = XOR(b,c); b = ROTW7(b);                   \
+    b = ROTV3(b); c = ROTV2(c); d = ROTV1(d);
+
+/* Store the four blocks held in the rows v0..v3.  Lane i of each row belongs
+ * to block i, so this is a 4x4 transpose of 128-bit lanes. */
+#define WRITE4(op, v0, v1, v2, v3) do {                                 \
+    const vec t0_ = _mm512_shuffle_i32x4((v0),(v1),0x44);              \
+    const vec t1_ = _mm512_shuffle_i32x4((v2),(v3),0x44);              \
+    const vec t2_ = _mm512_shuffle_i32x4((v0),(v1),0xee);              \
+    const vec t3_ = _mm512_shuffle_i32x4((v2),(v3),0xee);              \
+    _mm512_storeu_si512((void *)((op) +   0),                          \
+                        _mm512_shuffle_i32x4(t0_,t1_,0x88));           \
+    _mm512_storeu_si512((void *)((op) +  64),                          \
+                        _mm512_shuffle_i32x4(t0_,t1_,0xdd));           \
+    _mm512_storeu_si512((void *)((op) + 128),                          \
+                        _mm512_shuffle_i32x4(t2_,t3_,0x88));           \
+    _mm512_storeu_si512((void *)((op) + 192),                          \
+                        _mm512_shuffle_i32x4(t2_,t3_,0xdd));           \
+  } while (0)
+
+struct chacha_state_avx512 {
+  __attribute__ ((aligned (16))) uint8_t key[32];
+  __attribute__ ((aligned (16))) uint8_t nonce[8];
+};
+
+/** Number of blocks computed per pass. */
+#define BPI             16
+/** Number of passes per call.  One pass already fills MAX_OUTPUT_LEN. */
+#define LOOP_ITERATIONS 1
+
+static inline void
+ottery_blocks_chacha_avx512(
+        const int chacha_rounds,
+        uint8_t *out,
+        uint32_t block_idx,
+        const struct chacha_state_avx512 *st)
+  __attribute__((always_inline));
+
+/** Generates 64 * BPI * LOOP_ITERATIONS bytes of output using the key and
+ * nonce in st and the counter in block_idx, and store them in out.  The
+ * output need not be aligned.
+ */
+static inline void
+ottery_blocks_chacha_avx512(
+        const int chacha_rounds,
+        uint8_t *out,
+        uint32_t block_idx,
+        const struct chacha_state_avx512 *st)
+{
+  const vec four = _mm512_set_epi32(0,0,0,4, 0,0,0,4, 0,0,0,4, 0,0,0,4);
+  const vec s0 = _mm512_broadcast_i32x4(
+                    _mm_set_epi32(0x6B206574,0x79622D32,0x3320646E,0x61707865));
+  const vec s1 = _mm512_broadcast_i32x4(
+                    _mm_load_si128((const __m128i *)st->key));
+  const vec s2 = _mm512_broadcast_i32x4(
+                    _mm_load_si128((const __m128i *)(st->key+16)));
+  uint32_t n0, n1;
+  vec s3;
+  unsigned i, j;
+
+  memcpy(&n0, st->nonce, 4);
+  memcpy(&n1, st->nonce+4, 4);
+  /* Lane i holds block block_idx+i. */
+  s3 = _mm512_set_epi32(n1, n0, 0, block_idx + 3,
+                        n1, n0, 0, block_idx + 2,
+                        n1, n0, 0, block_idx + 1,
+                        n1, n0, 0, block_idx);
+
+  for (j = 0; j < LOOP_ITERATIONS; ++j) {
+    vec v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12,v13,v14,v15;
+    const vec s3_1 = ADD(s3, four);
+    const vec s3_2 = ADD(s3_1, four);
+    const vec s3_3 = ADD(s3_2, four);
+    v0 = v4 = v8  = v12 = s0;
+    v1 = v5 = v9  = v13 = s1;
+    v2 = v6 = v10 = v14 = s2;
+    v3 = s3; v7 = s3_1; v11 = s3_2; v15 = s3_3;
+
+    for (i = chacha_rounds/2; i; i--) {
+      DQROUND_VECTORS(v0,v1,v2,v3)
+      DQROUND_VECTORS(v4,v5,v6,v7)
+      DQROUND_VECTORS(v8,v9,v10,v11)
+      DQROUND_VECTORS(v12,v13,v14,v15)
+    }
+
+    WRITE4(out +   0, ADD(v0,s0),  ADD(v1,s1),  ADD(v2,s2),  ADD(v3,s3));
+    WRITE4(out + 256, ADD(v4,s0),  ADD(v5,s1),  ADD(v6,s2),  ADD(v7,s3_1));
+    WRITE4(out + 512, ADD(v8,s0),  ADD(v9,s1),  ADD(v10,s2), ADD(v11,s3_2));
+    WRITE4(out + 768, ADD(v12,s0), ADD(v13,s1), ADD(v14,s2), ADD(v15,s3_3));
+
+    s3 = ADD(s3_3, four);
+    out += 64 * BPI;
+  }
+}
+
+#define STATE_LEN   (sizeof(struct chacha_state_avx512))
+#define STATE_BYTES 40
+#define IDX_STEP    (BPI * LOOP_ITERATIONS)
+#define OUTPUT_LEN  (IDX_STEP * 64)
+
+static void
+chacha_avx512_state_setup(void *state, const uint8_t *bytes)
+{
+  struct chacha_state_avx512 *st = state;
+  memcpy(st->key, bytes, 32);
+  memcpy(st->nonce, bytes+32, 8);
+}
+
+static void
+chacha8_avx512_generate(void *state, uint8_t *output, uint32_t idx)
+{
+  const struct chacha_state_avx512 *st = state;
+  ottery_blocks_chacha_avx512(8, output, idx * IDX_STEP, st);
+}
+
+static void
+chacha12_avx512_generate(void *state, uint8_t *output, uint32_t idx)
+{
+  const struct chacha_state_avx512 *st = state;
+  ottery_blocks_chacha_avx512(12, output, idx * IDX_STEP, st);
+}
+
+static void
+chacha20_avx512_generate(void *state, uint8_t *output, uint32_t idx)
+{
+  const struct chacha_state_avx512 *st = state;
+  ottery_blocks_chacha_avx512(20, output, idx * IDX_STEP, st);
+}
+
+#define PRF_CHACHA(r) {                         \
+  "CHACHA" #r,                                  \
+  "CHACHA" #r "-SIMD",                          \
+  "CHACHA" #r "-SIMD-AVX512",                   \
+  STATE_LEN,                                    \
+  STATE_BYTES,                                  \
+  OUTPUT_LEN,                                   \
+  OTTERY_CPUCAP_AVX512|OTTERY_CPUCAP_SIMD,      \
+  chacha_avx512_state_setup,                    \
+  chacha ## r ## _avx512_generate,              \
+  OTTERY_PRF_FL_UNALIGNED_OUTPUT                \
+}
+
+const struct ottery_prf ottery_prf_chacha8_avx512_ = PRF_CHACHA(8);
+const struct ottery_prf ottery_prf_chacha12_avx512_ = PRF_CHACHA(12);
+const struct ottery_prf ottery_prf_chacha20_avx512_ = PRF_CHACHA(20);
@@ -304,7 +304,8 @@ chacha20_krovetz_generate(void *state, uint8_t *output, uint32_t idx)
   OUTPUT_LEN,                                   \
   NEED_CPUCAP,                                  \
   chacha_krovetz_state_setup,                   \
-  chacha ## r ## _krovetz_generate              \
+  chacha ## r ## _krovetz_generate,             \
+  0                                             \
 }
 
 #if defined OTTERY_BUILDING_SIMD1
@@ -68,12 +68,17 @@ static void ECRYPT_ivsetup(ECRYPT_ctx *x,const u8 *iv)
 #define IDX_STEP    16
 #define OUTPUT_LEN  (IDX_STEP * 64)
 
-static inline void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c) __attribute__((always_inline));
+/* Ottery: the small flavor makes fewer blocks per call, for states that
+ * want a short buffer.  Its output is the same keystream, cut finer. */
+#define IDX_STEP_SMALL    4
+#define OUTPUT_LEN_SMALL  (IDX_STEP_SMALL * 64)
 
-/** Generate OUTPUT_LEN bytes of output using the key, nonce, and counter in x,
- * and store them in c.
+static inline void chacha_merged_getblocks(const int chacha_rounds, const unsigned n_blocks, ECRYPT_ctx *x,u8 *c) __attribute__((always_inline));
+
+/** Generate 64 * n_blocks bytes of output using the key, nonce, and counter
+ * in x, and store them in c.
  */
-static void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c)
+static void chacha_merged_getblocks(const int chacha_rounds, const unsigned n_blocks, ECRYPT_ctx *x,u8 *c)
 {
   u32 x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
   u32 j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -96,7 +101,7 @@ static void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c
   j14 = x->input[14];
   j15 = x->input[15];
 
-  for (block = 0; block < IDX_STEP; ++block) {
+  for (block = 0; block < n_blocks; ++block) {
     x0 = j0;
     x1 = j1;
     x2 = j2;
@@ -181,7 +186,15 @@ chacha8_merged_generate(void *state_, uint8_t *output, uint32_t idx)
 {
   ECRYPT_ctx *x = state_;
   x->input[12] = idx * IDX_STEP;
-  chacha_merged_getblocks(8, x, output);
+  chacha_merged_getblocks(8, IDX_STEP, x, output);
+}
+
+static void
+chacha8_merged_small_generate(void *state_, uint8_t *output, uint32_t idx)
+{
+  ECRYPT_ctx *x = state_;
+  x->input[12] = idx * IDX_STEP_SMALL;
+  chacha_merged_getblocks(8, IDX_STEP_SMALL, x, output);
 }
 
 static void
@@ -189,7 +202,15 @@ chacha12_merged_generate(void *state_, uint8_t *output, uint32_t idx)
 {
   ECRYPT_ctx *x = state_;
   x->input[12] = idx * IDX_STEP;
-  chacha_merged_getblocks(12, x, output);
+  chacha_merged_getblocks(12, IDX_STEP, x, output);
+}
+
+static void
+chacha12_merged_small_generate(void *state_, uint8_t *output, uint32_t idx)
+{
+  ECRYPT_ctx *x = state_;
+  x->input[12] = idx * IDX_STEP_SMALL;
+  chacha_merged_getblocks(12, IDX_STEP_SMALL, x, output);
 }
 
 static void
@@ -197,7 +218,15 @@ chacha20_merged_generate(void *state_, uint8_t *output, uint32_t idx)
 {
   ECRYPT_ctx *x = state_;
   x->input[12] = idx * IDX_STEP;
-  chacha_merged_getblocks(20, x, output);
+  chacha_merged_getblocks(20, IDX_STEP, x, output);
+}
+
+static void
+chacha20_merged_small_generate(void *state_, uint8_t *output, uint32_t idx)
+{
+  ECRYPT_ctx *x = state_;
+  x->input[12] = idx * IDX_STEP_SMALL;
+  chacha_merged_getblocks(20, IDX_STEP_SMALL, x, output);
 }
 
 #define PRF_CHACHA(r) {                         \
@@ -209,10 +238,31 @@ chacha20_merged_generate(void *state_, uint8_t *output, uint32_t idx)
   OUTPUT_LEN,                                   \
   0,                                            \
   chacha_merged_state_setup,                    \
-  chacha ## r ## _merged_generate               \
+  chacha ## r ## _merged_generate,              \
+  OTTERY_PRF_FL_UNALIGNED_OUTPUT                \
 }
 
 const struct ottery_prf ottery_prf_chacha8_merged_ = PRF_CHACHA(8);
 const struct ottery_prf ottery_prf_chacha12_merged_ = PRF_CHACHA(12);
 const struct ottery_prf ottery_prf_chacha20_merged_ = PRF_CHACHA(20);
 
+#define PRF_CHACHA_SMALL(r) {                   \
+  "CHACHA" #r,                                  \
+  "CHACHA" #r "-NOSIMD",                        \
+  "CHACHA" #r "-NOSIMD-SMALL",                  \
+  STATE_LEN,                                    \
+  STATE_BYTES,                                  \
+  OUTPUT_LEN_SMALL,                             \
+  0,                                            \
+  chacha_merged_state_setup,                    \
+  chacha ## r ## _merged_small_generate,        \
+  OTTERY_PRF_FL_UNALIGNED_OUTPUT                \
+}
+
+const struct ottery_prf ottery_prf_chacha8_merged_small_ =
+  PRF_CHACHA_SMALL(8);
+const struct ottery_prf ottery_prf_chacha12_merged_small_ =
+  PRF_CHACHA_SMALL(12);
+const struct ottery_prf ottery_prf_chacha20_merged_small_ =
+  PRF_CHACHA_SMALL(20);
+
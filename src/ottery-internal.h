@@ -13,9 +13,11 @@
  */
 #ifndef OTTERY_INTERNAL_H_HEADER_INCLUDED_
 #define OTTERY_INTERNAL_H_HEADER_INCLUDED_
+/* ottery-config.h comes first, so that its feature macros are set before
+ * any system header gets included. */
+#include "ottery-config.h"
 #include <stdint.h>
 #include <sys/types.h>
-#include "ottery-config.h"
 #include "ottery-threading.h"
 
 /** Largest possible state_bytes value. */
@@ -24,34 +26,33 @@
 #define MAX_STATE_LEN 256
 /** Largest possible output_len value. */
 #define MAX_OUTPUT_LEN 1024
+/** Size of a cache line, or a little more: structures that different CPUs
+ * write to should be at least this far apart. */
+#define OTTERY_CACHE_LINE 64
 
-/**
- * @brief Flags for external entropy sources.
- *
- * @{ */
-/** An RNG that probably provides strong entropy. */
-#define OTTERY_ENTROPY_FL_STRONG          0x000001
-/** An RNG that runs very quickly. */
-#define OTTERY_ENTROPY_FL_FAST            0x000002
-/** @} */
-
-/**
- * @brief Identifying external entropy domains.
- */
-/** An RNG provided by the operating system. */
-#define OTTERY_ENTROPY_DOM_OS             0x000100
-/** An RNG provided by the CPU. */
-#define OTTERY_ENTROPY_DOM_CPU            0x000200
-/** An EGD-style entropy source */
-#define OTTERY_ENTROPY_DOM_EGD            0x000400
-/** @} */
-
+/* The OTTERY_ENTROPY_FL_* and OTTERY_ENTROPY_DOM_* flags are in
+ * ottery_common.h, since users need them to add entropy sources. */
 #define OTTERY_ENTROPY_FLAG_MASK          0x000000ff
 #define OTTERY_ENTROPY_DOM_MASK           0x0000ff00
 #define OTTERY_ENTROPY_ALL_SOURCES        0x0fff0000
 
 struct sockaddr;
 
+/** The most entropy sources that ottery_config_add_entropy_source() will
+ * add to one configuration. */
+#define OTTERY_MAX_USER_ENTROPY_SOURCES 4
+
+/** An entropy source added with ottery_config_add_entropy_source(). */
+struct ottery_user_entropy_source_ {
+  /** The function to call to get entropy. */
+  int (*fn)(void *arg, uint8_t *out, size_t n);
+  /** The first argument to pass to fn. */
+  void *arg;
+  /** OTTERY_ENTROPY_FL_* and OTTERY_ENTROPY_DOM_* flags for this source,
+   * plus OTTERY_ENTROPY_SRC_USER. */
+  uint32_t flags;
+};
+
 /** Configuration for the strong RNG the we use for entropy. */
 struct ottery_entropy_config {
   /** The filename to use as /dev/urandom. Ignored if this
@@ -76,14 +77,44 @@ struct ottery_entropy_config {
    * This is for testing, and is not exposed to user code.
    */
   unsigned allow_nondev_urandom;
+  /** If true, we keep the urandom device open between uses, rather than
+   * opening it every time we need entropy. */
+  unsigned urandom_keep_open;
+  /** The number of entries in user_sources that are in use. */
+  unsigned n_user_sources;
+  /** Entropy sources that the user added; we try these before our own. */
+  struct ottery_user_entropy_source_
+    user_sources[OTTERY_MAX_USER_ENTROPY_SOURCES];
 };
 
 struct ottery_entropy_state {
   /* Cached value for the inode of the urandom device.  If this value changes,
    * we assume that somebody messed with the fd by accident. */
   uint64_t urandom_fd_inode;
+  /** An fd that we opened for the urandom device and kept around, if
+   * urandom_fd_is_cached is set. */
+  int urandom_cached_fd;
+  /** True iff urandom_cached_fd is open, and we must close it. */
+  unsigned urandom_fd_is_cached;
+  /** True while some thread is using or replacing urandom_cached_fd. */
+  unsigned urandom_fd_busy;
+  /** A connection to the EGD socket that we kept around, if
+   * egd_fd_is_cached is set. */
+  int egd_cached_fd;
+  /** True iff egd_cached_fd is open, and we must close it. */
+  unsigned egd_fd_is_cached;
+  /** The process that opened egd_cached_fd. */
+  pid_t egd_fd_pid;
+  /** True while some thread is talking over egd_cached_fd. */
+  unsigned egd_fd_busy;
 };
 
+/**
+ * Release any resources held by an ottery_entropy_state, such as a cached
+ * urandom fd.  The state may be used again afterwards.
+ */
+void ottery_release_entropy_state_(struct ottery_entropy_state *state);
+
 /**
  * Return the buffer size to allocate when getting at least n bytes from each
  * entropy source.  We might not actually need so many. */
@@ -167,12 +198,25 @@ struct ottery_prf {
    * @param state A state object previously initialized by the setup
    *     function.
    * @param output An array of (output_len) bytes in which to store the
-   *     result of the function
+   *     result of the function.  It must be aligned to a 16-byte boundary,
+   *     unless OTTERY_PRF_FL_UNALIGNED_OUTPUT is set in flags.
    * @param idx A counter value for the function.
    */
   void (*generate)(void *state, uint8_t *output, uint32_t idx);
+  /** Bitmask of OTTERY_PRF_FL_* flags describing this PRF. */
+  uint32_t flags;
 };
 
+/**
+ * @brief Flags for ottery_prf.
+ *
+ * @{ */
+/** Set if the generate function can write to an output buffer at any
+ * alignment.  If it is not set, the output must be aligned to a 16-byte
+ * boundary. */
+#define OTTERY_PRF_FL_UNALIGNED_OUTPUT    0x000001
+/** @} */
+
 #ifdef OTTERY_INTERNAL
 struct ottery_config {
   /** The PRF that we should use.  If NULL, we use the default. */
@@ -180,19 +224,100 @@ struct ottery_config {
 
   /** Configuration for how we will set up our entropy sources. */
   struct ottery_entropy_config entropy_config;
+
+  /** How the global API should map onto states: one of the
+   * OTTERY_GLOBAL_STATE_* values.  Ignored by ottery_st_init(). */
+  int global_state_mode;
+
+  /** True iff states should keep a spare block of output; see
+   * ottery_config_enable_prefill(). */
+  int prefill;
+
+  /** If nonzero, the largest output_len we should accept in a PRF; see
+   * ottery_config_set_max_buffer_len(). */
+  unsigned max_output_len;
+
+  /** If nonzero, states reseed themselves from the OS after generating
+   * about this many bytes; see ottery_config_set_reseed_interval(). */
+  uint64_t reseed_after_bytes;
+
+  /** If nonzero, states reseed themselves from the OS when they have gone
+   * this many seconds without it; see ottery_config_set_reseed_interval(). */
+  unsigned reseed_after_seconds;
 };
 
 #define ottery_state_nolock ottery_state
 
+/** Entropy that a helper thread has read for ottery_st_request_reseed_async();
+ * defined in ottery.c. */
+struct ottery_async_seed_;
+
+/*
+ * The fields of an ottery_state are ordered by how often we touch them.
+ * Everything that ottery_st_rand_unsigned() and friends look at on their
+ * fast path -- the magic number, the fork generation, the lock, the buffer
+ * position and length, the bit reservoir -- comes first, and should fit in
+ * one cache line.
+ * Then comes the buffer itself, and then everything that we only need when
+ * we generate a new block, or less often than that.  That way, taking a
+ * small value from the buffer touches the header and one line of the
+ * buffer, and nothing else.
+ */
 struct __attribute__((aligned(16))) ottery_state {
   /**
-   * Holds up to prf.output_len bytes that have been generated by the
+   * Magic number; used to tell whether this state is initialized.
+   */
+  uint32_t magic;
+  /**
+   * The fork generation in which this PRF was most recently seeded from the
+   * OS.  We use this to avoid use-after-fork problems; see
+   * ottery_st_rand_check_pid().  Zero means "reseed before next use". */
+  uint32_t fork_generation;
+  /**
+   * Index of the next byte in (buffer) to yield to the user.
+   *
+   * Invariant: this is no more than output_len.  It is equal to output_len
+   * only in a state created with ottery_st_init_from_parent() that has not
+   * yet generated its first block. */
+  uint16_t pos;
+  /**
+   * The number of bytes in each block of output: a copy of
+   * prf.output_len, kept here so that the fast path doesn't need to look
+   * at prf. */
+  uint16_t output_len;
+  /**
+   * Whether spare_alloc holds a block we can use: one of the SPARE_*
+   * values in ottery.c. */
+  uint8_t spare_status;
+  /**
+   * Whether we owe ourselves a reseed from the OS: one of the RESEED_*
+   * values in ottery.c. */
+  uint8_t reseed_status;
+  /**
+   * True iff this state has a lock: that is, it was set up with
+   * ottery_st_init() and not ottery_st_init_nolock(). */
+  uint8_t locked;
+  /**
+   * Random bits for ottery_st_rand_bit() and friends, not yet used, with a
+   * 1 bit above them to mark where they end.  0 or 1 means "empty". */
+  uint64_t bit_reservoir;
+  /**
+   * @brief Locks for this structure.
+   *
+   * This lock will not necessarily be recursive.  It's probably a
+   * spinlock.
+   *
+   * @{
+   */
+DECL_LOCK(mutex);
+  /**@}*/
+  /**
+   * Holds up to output_len bytes that have been generated by the
    * pseudorandom function. */
   __attribute__ ((aligned (16))) uint8_t buffer[MAX_OUTPUT_LEN];
   /**
    * Holds the state information (typically nonces and keys) used by the
    * pseudorandom function. */
-
   __attribute__ ((aligned (16))) uint8_t state[MAX_STATE_LEN];
   /**
    * Parameters and function pointers for the cryptographic pseudorandom
@@ -200,22 +325,23 @@ struct __attribute__((aligned(16))) ottery_state {
   struct ottery_prf prf;
   /**
    * Index of the *next* block counter to use when generating random bytes
-   * with prf.  When this equals or exceeds prf.stir_after, we should stir
-   * the PRNG. */
+   * with prf. */
   uint32_t block_counter;
   /**
-   * Magic number; used to tell whether this state is initialized.
-   */
-  uint32_t magic;
+   * If prefill is enabled, a heap allocation large enough to hold one
+   * 16-byte-aligned block of PRF output; otherwise NULL.  When
+   * spare_status says so, it holds the block that the PRF will produce
+   * for block_counter == spare_counter under the current key, so that
+   * ottery_st_nextblock_nolock() doesn't need to generate it.  See
+   * ottery_st_prefill(). */
+  uint8_t *spare_alloc;
   /**
-   * Index of the next byte in (buffer) to yield to the user.
-   *
-   * Invariant: this is less than prf.output_len. */
-  uint16_t pos;
+   * The block counter that was used to generate the spare block.
+   */
+  uint32_t spare_counter;
   /**
    * The pid of the process in which this PRF was most recently seeded
-   * from the OS. We use this to avoid use-after-fork problems; see
-   * ottery_st_rand_lock_and_check(). */
+   * from the OS. */
   pid_t pid;
   /**
    * Combined flags_out results from all calls to the entropy source that
@@ -234,18 +360,116 @@ struct __attribute__((aligned(16))) ottery_state {
    */
   struct ottery_entropy_state entropy_state;
   /**
-   * @brief Locks for this structure.
-   *
-   * This lock will not necessarily be recursive.  It's probably a
-   * spinlock.
-   *
-   * @{
+   * Reseed from the OS after generating this many bytes; 0 for never.
    */
-DECL_LOCK(mutex);
-  /**@}*/
+  uint64_t reseed_after_bytes;
+  /**
+   * Reseed from the OS after this many seconds; 0 for never.
+   */
+  unsigned reseed_after_seconds;
+  /**
+   * Number of bytes of PRF output we have generated (rounded up to whole
+   * blocks) since we last reseeded from the OS.
+   */
+  uint64_t bytes_since_reseed;
+  /**
+   * The time, in seconds, when we last reseeded from the OS; see
+   * ottery_seconds_now_().
+   */
+  uint64_t last_reseed_time;
+  /**
+   * Whether a helper thread is reseeding us: one of the ASYNC_* values in
+   * ottery.c.
+   */
+  uint32_t async_status;
+  /**
+   * When async_status is ASYNC_READY, the entropy that the helper thread
+   * left for us to mix in at the next block.  Otherwise NULL.
+   */
+  struct ottery_async_seed_ *async_seed;
+};
+
+/** The state for a deterministic stream.  See ottery_stream.h. */
+struct __attribute__((aligned(16))) ottery_stream {
+  /**
+   * Holds the most recently generated block of PRF output, if any. */
+  __attribute__ ((aligned (16))) uint8_t buffer[MAX_OUTPUT_LEN];
+  /**
+   * Holds the state information (typically nonces and keys) used by the
+   * pseudorandom function.  This never changes after initialization. */
+  __attribute__ ((aligned (16))) uint8_t state[MAX_STATE_LEN];
+  /**
+   * Parameters and function pointers for the cryptographic pseudorandom
+   * function that we're using. */
+  struct ottery_prf prf;
+  /**
+   * Offset in the stream of the next byte to yield to the user. */
+  uint64_t pos;
+  /**
+   * Offset in the stream of the first byte in buffer. */
+  uint64_t buffer_start;
+  /**
+   * Number of bytes of the stream in buffer: zero if the buffer is empty,
+   * and less than prf.output_len if the PRF output runs past the end of the
+   * stream. */
+  uint32_t buffer_len;
+  /**
+   * Magic number; used to tell whether this stream is initialized.
+   */
+  uint32_t magic;
+};
+
+/** One column of an alias table. */
+struct ottery_alias_entry_ {
+  /** We return this column's own index when a random 32-bit value is less
+   * than threshold, and alias otherwise. */
+  uint32_t threshold;
+  /** The index that shares this column. */
+  uint32_t alias;
+};
+
+/** A table for sampling from a discrete distribution.  See
+ * ottery_alias_table_new(). */
+struct ottery_alias_table {
+  /** The number of columns (and of possible results). */
+  uint32_t n;
+  /** The columns themselves. */
+  struct ottery_alias_entry_ entries[];
 };
 #endif
 
+/**
+ * Return true iff the PRF in st can generate a block directly into the
+ * memory at p.
+ */
+#define PRF_CAN_GENERATE_INTO(st, p)                                \
+  (((st)->prf.flags & OTTERY_PRF_FL_UNALIGNED_OUTPUT) ||            \
+   (((uintptr_t)(p)) & 0xf) == 0)
+
+/**
+ * Multiply two 64-bit numbers; return the high 64 bits of the product, and
+ * store the low 64 bits in *lo.
+ */
+static inline uint64_t
+ottery_mul64_(uint64_t a, uint64_t b, uint64_t *lo)
+{
+#ifdef __SIZEOF_INT128__
+  const unsigned __int128 p = (unsigned __int128)a * b;
+  *lo = (uint64_t)p;
+  return (uint64_t)(p >> 64);
+#else
+  const uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  const uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  const uint64_t p0 = a_lo * b_lo;
+  const uint64_t p1 = a_lo * b_hi;
+  const uint64_t p2 = a_hi * b_lo;
+  const uint64_t p3 = a_hi * b_hi;
+  const uint64_t mid = (p0 >> 32) + (uint32_t)p1 + (uint32_t)p2;
+  *lo = (mid << 32) | (uint32_t)p0;
+  return p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+#endif
+}
+
 struct ottery_config;
 /**
  * For testing: manually supply a PRF.
@@ -258,10 +482,19 @@ void ottery_config_set_manual_prf_(struct ottery_config *cfg,
  * ottery_fatal_handler. */
 void ottery_fatal_error_(int error);
 
+/**
+ * Return the best PRF this CPU supports whose name, implementation name,
+ * or flavor is impl; or the best PRF of all if impl is NULL.  Return NULL
+ * if there is no such PRF. */
+const struct ottery_prf *ottery_get_impl_(const char *impl);
+
 #define OTTERY_CPUCAP_SIMD (1<<0)
 #define OTTERY_CPUCAP_SSSE3 (1<<1)
 #define OTTERY_CPUCAP_AES  (1<<2)
 #define OTTERY_CPUCAP_RAND (1<<3)
+#define OTTERY_CPUCAP_AVX2 (1<<4)
+#define OTTERY_CPUCAP_AVX512 (1<<5)
+#define OTTERY_CPUCAP_RDSEED (1<<6)
 
 /** Return a mask of OTTERY_CPUCAP_* for what the CPU will offer us. */
 uint32_t ottery_get_cpu_capabilities_(void);
@@ -278,6 +511,9 @@ void ottery_disable_cpu_capabilities_(uint32_t disable);
 extern const struct ottery_prf ottery_prf_chacha8_merged_;
 extern const struct ottery_prf ottery_prf_chacha12_merged_;
 extern const struct ottery_prf ottery_prf_chacha20_merged_;
+extern const struct ottery_prf ottery_prf_chacha8_merged_small_;
+extern const struct ottery_prf ottery_prf_chacha12_merged_small_;
+extern const struct ottery_prf ottery_prf_chacha20_merged_small_;
 /**@}*/
 
 /**
@@ -297,6 +533,18 @@ extern const struct ottery_prf ottery_prf_chacha8_krovetz_2_;
 extern const struct ottery_prf ottery_prf_chacha12_krovetz_2_;
 extern const struct ottery_prf ottery_prf_chacha20_krovetz_2_;
 #endif
+
+#ifdef HAVE_SIMD_CHACHA_AVX2
+extern const struct ottery_prf ottery_prf_chacha8_avx2_;
+extern const struct ottery_prf ottery_prf_chacha12_avx2_;
+extern const struct ottery_prf ottery_prf_chacha20_avx2_;
+#endif
+
+#ifdef HAVE_SIMD_CHACHA_AVX512
+extern const struct ottery_prf ottery_prf_chacha8_avx512_;
+extern const struct ottery_prf ottery_prf_chacha12_avx512_;
+extern const struct ottery_prf ottery_prf_chacha20_avx512_;
+#endif
 /** @} */
 
 #endif
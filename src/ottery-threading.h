@@ -88,4 +88,23 @@
 #error How do I lock?
 #endif
 
+/* Thread-local global states.  These need pthread keys (for destruction at
+ * thread exit), but not pthread locks, so they work even with
+ * OTTERY_NO_LOCKS. */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define OTTERY_THREAD_STATES
+#endif
+
+/* Asynchronous reseeding reads the entropy source on a detached helper
+ * thread. */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define OTTERY_ASYNC_RESEED
+#endif
+
+/* Per-CPU global states.  Threads can move between CPUs, so these need
+ * real locks. */
+#if defined(HAVE_SCHED_GETCPU) && !defined(OTTERY_NO_LOCKS)
+#define OTTERY_CPU_STATES
+#endif
+
 #endif
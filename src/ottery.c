@@ -16,11 +16,15 @@
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
+#include "ottery_ziggurat_tables.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
 
 #include <stdio.h>
 
@@ -33,11 +37,27 @@
 #define OTTERY_NO_PID_CHECK
 #endif
 
+#ifndef OTTERY_NO_PID_CHECK
+#include <sys/mman.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#endif
+
+#ifdef OTTERY_ASYNC_RESEED
+#include <pthread.h>
+#endif
+
 /**
  * Evaluate the condition 'x', while hinting to the compiler that it is
  * likely to be false.
  */
 #define UNLIKELY(x) __builtin_expect((x), 0)
+/**
+ * Evaluate the condition 'x', while hinting to the compiler that it is
+ * likely to be true.
+ */
+#define LIKELY(x) __builtin_expect((x), 1)
 
 /** Magic number for deciding whether an ottery_state is initialized. */
 #define MAGIC_BASIS 0x11b07734
@@ -48,6 +68,9 @@
 
 static inline int ottery_st_rand_lock_and_check(struct ottery_state *st)
 __attribute__((always_inline));
+static inline int ottery_st_rand_check_nolock(struct ottery_state_nolock *st)
+__attribute__((always_inline));
+static inline int ottery_st_rand_check_magic(struct ottery_state *st);
 static int ottery_st_reseed(struct ottery_state *state);
 static int ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n, int locking, int check_magic);
 
@@ -171,34 +194,59 @@ ottery_config_init(struct ottery_config *cfg)
   cfg->entropy_config.egd_sockaddr = NULL;
   cfg->entropy_config.egd_socklen = 0;
   cfg->entropy_config.allow_nondev_urandom = 0;
+  cfg->entropy_config.urandom_keep_open = 0;
+  cfg->entropy_config.n_user_sources = 0;
+  cfg->global_state_mode = OTTERY_GLOBAL_STATE_SHARED;
+  cfg->prefill = 0;
+  cfg->max_output_len = 0;
+  cfg->reseed_after_bytes = 0;
+  cfg->reseed_after_seconds = 0;
   return 0;
 }
 
-static const struct ottery_prf *
-ottery_get_impl(const char *impl)
-{
-  int i;
-  const struct ottery_prf *ALL_PRFS[] = {
+/** Every PRF implementation we know about, best first.  For each algorithm,
+ * an implementation comes before any slower implementation. */
+static const struct ottery_prf *const ottery_all_prfs_[] = {
+#ifdef HAVE_SIMD_CHACHA_AVX512
+  &ottery_prf_chacha20_avx512_,
+  &ottery_prf_chacha12_avx512_,
+  &ottery_prf_chacha8_avx512_,
+#endif
+#ifdef HAVE_SIMD_CHACHA_AVX2
+  &ottery_prf_chacha20_avx2_,
+  &ottery_prf_chacha12_avx2_,
+  &ottery_prf_chacha8_avx2_,
+#endif
 #ifdef HAVE_SIMD_CHACHA_2
-    &ottery_prf_chacha20_krovetz_2_,
-    &ottery_prf_chacha12_krovetz_2_,
-    &ottery_prf_chacha8_krovetz_2_,
+  &ottery_prf_chacha20_krovetz_2_,
+  &ottery_prf_chacha12_krovetz_2_,
+  &ottery_prf_chacha8_krovetz_2_,
 #endif
 #ifdef HAVE_SIMD_CHACHA
-    &ottery_prf_chacha20_krovetz_1_,
-    &ottery_prf_chacha12_krovetz_1_,
-    &ottery_prf_chacha8_krovetz_1_,
+  &ottery_prf_chacha20_krovetz_1_,
+  &ottery_prf_chacha12_krovetz_1_,
+  &ottery_prf_chacha8_krovetz_1_,
 #endif
-    &ottery_prf_chacha20_merged_,
-    &ottery_prf_chacha12_merged_,
-    &ottery_prf_chacha8_merged_,
-
-    NULL,
-  };
+  &ottery_prf_chacha20_merged_,
+  &ottery_prf_chacha12_merged_,
+  &ottery_prf_chacha8_merged_,
+  /* Only for states that ask for a small buffer; see
+   * ottery_config_set_max_buffer_len(). */
+  &ottery_prf_chacha20_merged_small_,
+  &ottery_prf_chacha12_merged_small_,
+  &ottery_prf_chacha8_merged_small_,
+
+  NULL,
+};
+
+const struct ottery_prf *
+ottery_get_impl_(const char *impl)
+{
+  int i;
   const uint32_t cap = ottery_get_cpu_capabilities_();
 
-  for (i = 0; ALL_PRFS[i]; ++i) {
-    const struct ottery_prf *prf = ALL_PRFS[i];
+  for (i = 0; ottery_all_prfs_[i]; ++i) {
+    const struct ottery_prf *prf = ottery_all_prfs_[i];
     if ((prf->required_cpucap & cap) != prf->required_cpucap)
       continue;
     if (impl == NULL)
@@ -213,11 +261,34 @@ ottery_get_impl(const char *impl)
   return NULL;
 }
 
+/**
+ * Return the best implementation that this CPU supports of the PRF called
+ * name (or of any PRF, if name is NULL) whose output_len is no more than
+ * max_output_len.  Return NULL if there is none.
+ */
+static const struct ottery_prf *
+ottery_get_impl_fitting_(const char *name, unsigned max_output_len)
+{
+  int i;
+  const uint32_t cap = ottery_get_cpu_capabilities_();
+
+  for (i = 0; ottery_all_prfs_[i]; ++i) {
+    const struct ottery_prf *prf = ottery_all_prfs_[i];
+    if ((prf->required_cpucap & cap) != prf->required_cpucap)
+      continue;
+    if (prf->output_len > max_output_len)
+      continue;
+    if (name == NULL || !strcmp(name, prf->name))
+      return prf;
+  }
+  return NULL;
+}
+
 int
 ottery_config_force_implementation(struct ottery_config *cfg,
                                    const char *impl)
 {
-  const struct ottery_prf *prf = ottery_get_impl(impl);
+  const struct ottery_prf *prf = ottery_get_impl_(impl);
   if (prf) {
     cfg->impl = prf;
     return 0;
@@ -239,6 +310,19 @@ ottery_config_set_urandom_device(struct ottery_config *cfg,
   cfg->entropy_config.urandom_fname = fname;
 }
 
+void
+ottery_config_keep_urandom_open(struct ottery_config *cfg,
+                                int keep_open)
+{
+  cfg->entropy_config.urandom_keep_open = (keep_open != 0);
+}
+
+void
+ottery_config_enable_prefill(struct ottery_config *cfg, int enable)
+{
+  cfg->prefill = (enable != 0);
+}
+
 void
 ottery_config_set_urandom_fd(struct ottery_config *cfg,
                              int fd)
@@ -256,6 +340,28 @@ ottery_config_set_egd_socket(struct ottery_config *cfg,
   cfg->entropy_config.egd_socklen = len;
 }
 
+int
+ottery_config_add_entropy_source(struct ottery_config *cfg,
+                                 int (*fn)(void *arg, uint8_t *out, size_t n),
+                                 void *arg,
+                                 uint32_t flags,
+                                 uint32_t domain)
+{
+  struct ottery_entropy_config *ec = &cfg->entropy_config;
+  struct ottery_user_entropy_source_ *src;
+  if (!fn ||
+      (flags & ~OTTERY_ENTROPY_FLAG_MASK) ||
+      (domain & ~OTTERY_ENTROPY_DOM_MASK) ||
+      domain == 0 || (domain & (domain - 1)) ||
+      ec->n_user_sources == OTTERY_MAX_USER_ENTROPY_SOURCES)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  src = &ec->user_sources[ec->n_user_sources++];
+  src->fn = fn;
+  src->arg = arg;
+  src->flags = flags | domain | OTTERY_ENTROPY_SRC_USER;
+  return 0;
+}
+
 void
 ottery_config_disable_entropy_sources(struct ottery_config *cfg,
                                       uint32_t disabled_sources)
@@ -272,6 +378,65 @@ ottery_config_mark_entropy_sources_weak(struct ottery_config *cfg,
     (disabled_sources & OTTERY_ENTROPY_ALL_SOURCES);
 }
 
+int
+ottery_config_set_max_buffer_len(struct ottery_config *cfg, size_t len)
+{
+  if (len == 0) {
+    cfg->max_output_len = 0;
+    return 0;
+  }
+  if (len > MAX_OUTPUT_LEN)
+    len = MAX_OUTPUT_LEN;
+  if (!ottery_get_impl_fitting_(NULL, (unsigned)len))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  cfg->max_output_len = (unsigned)len;
+  return 0;
+}
+
+void
+ottery_config_set_reseed_interval(struct ottery_config *cfg,
+                                  uint64_t n_bytes,
+                                  unsigned n_seconds)
+{
+  cfg->reseed_after_bytes = n_bytes;
+  cfg->reseed_after_seconds = n_seconds;
+}
+
+int
+ottery_config_set_global_state_mode(struct ottery_config *cfg, int mode)
+{
+  switch (mode) {
+    case OTTERY_GLOBAL_STATE_SHARED:
+      break;
+#ifdef OTTERY_THREAD_STATES
+    case OTTERY_GLOBAL_STATE_PER_THREAD:
+      break;
+#endif
+#ifdef OTTERY_CPU_STATES
+    case OTTERY_GLOBAL_STATE_PER_CPU:
+      break;
+#endif
+    default:
+      return OTTERY_ERR_INVALID_ARGUMENT;
+  }
+  cfg->global_state_mode = mode;
+  return 0;
+}
+
+/**
+ * Generate the next (st->output_len) bytes of PRF output into out,
+ * without rekeying the state.  The caller must make sure that
+ * PRF_CAN_GENERATE_INTO(st, out) is true.
+ */
+static void
+ottery_st_nextblock_nolock_norekey_into(struct ottery_state *st,
+                                        uint8_t *out)
+{
+  st->prf.generate(st->state, out, st->block_counter);
+  ottery_wipe_stack_();
+  ++st->block_counter;
+}
+
 /**
  * As ottery_st_nextblock_nolock(), but fill the entire block with
  * entropy, and don't try to rekey the state.
@@ -279,9 +444,211 @@ ottery_config_mark_entropy_sources_weak(struct ottery_config *cfg,
 static void
 ottery_st_nextblock_nolock_norekey(struct ottery_state *st)
 {
-  st->prf.generate(st->state, st->buffer, st->block_counter);
-  ottery_wipe_stack_();
-  ++st->block_counter;
+  ottery_st_nextblock_nolock_norekey_into(st, st->buffer);
+}
+
+/**
+ * @name Values for spare_status in an ottery_state.
+ *
+ * @{ */
+/** The spare block holds nothing useful. */
+#define SPARE_EMPTY   0
+/** Some thread is generating the spare block without holding the lock. */
+#define SPARE_FILLING 1
+/** The spare block holds PRF output for spare_counter. */
+#define SPARE_READY   2
+/** @} */
+
+/**
+ * @name Values for reseed_status in an ottery_state.
+ *
+ * @{ */
+/** We don't need to reseed yet. */
+#define RESEED_NONE    0
+/** We have used up our reseed interval, and should reseed from the OS. */
+#define RESEED_DUE     1
+/** Some thread is reading from the OS to reseed, without holding the
+ * lock. */
+#define RESEED_RUNNING 2
+/** @} */
+
+/**
+ * @name Values for async_status in an ottery_state.
+ *
+ * @{ */
+/** No helper thread is reseeding the state. */
+#define ASYNC_NONE    0
+/** A helper thread is reading from the OS to reseed the state. */
+#define ASYNC_RUNNING 1
+/** The helper thread is done, and async_seed is waiting to be mixed in. */
+#define ASYNC_READY   2
+/** @} */
+
+/**
+ * Entropy that a helper thread reads for ottery_st_request_reseed_async().
+ * The thread owns it until it sets async_status to ASYNC_READY; after
+ * that, whoever holds the state does.
+ */
+struct ottery_async_seed_ {
+  /** The state that asked for the entropy. */
+  struct ottery_state *st;
+  /** The number of bytes allocated for buf. */
+  size_t buflen;
+  /** The number of bytes of entropy in buf. */
+  size_t len;
+  /** flags_out from the entropy source. */
+  uint32_t flags;
+  /** When we read the entropy; see ottery_seconds_now_(). */
+  uint64_t time;
+  /** The entropy itself. */
+  uint8_t buf[];
+};
+
+#ifdef OTTERY_ASYNC_RESEED
+/**
+ * Helper threads take this lock to finish, and signal ottery_async_cond_ once
+ * they have set async_status; ottery_st_drop_async_seed() waits on it.  One
+ * pair serves every state, since nobody waits for long or often.
+ */
+static pthread_mutex_t ottery_async_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+/** See ottery_async_mutex_. */
+static pthread_cond_t ottery_async_cond_ = PTHREAD_COND_INITIALIZER;
+#endif
+
+/** Return a pointer to the 16-byte-aligned spare block in st. */
+#define SPARE_BLOCK(st) \
+  ((uint8_t *)((((uintptr_t)(st)->spare_alloc) + 15) & ~(uintptr_t)15))
+
+/**
+ * Forget any spare block in st.  We need to call this whenever we change
+ * the PRF key other than by ottery_st_nextblock_nolock().
+ */
+static inline void
+ottery_st_discard_spare(struct ottery_state *st)
+{
+  if (st->spare_status == SPARE_READY)
+    st->spare_status = SPARE_EMPTY;
+}
+
+/**
+ * Return a number of seconds that never goes backwards, for deciding when
+ * it is time to reseed.
+ */
+static uint64_t
+ottery_seconds_now_(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  /* We only want seconds, so the cheap clock is plenty. */
+  if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+    return (uint64_t)ts.tv_sec;
+#else
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (uint64_t)ts.tv_sec;
+#endif
+#endif
+  return (uint64_t)time(NULL);
+}
+
+/**
+ * Called when we are about to rekey st: count the blocks we generated with
+ * the old key towards st's reseed interval, and note if the interval is
+ * used up.  We don't reseed here, since we might be holding the lock:
+ * that's up to ottery_st_rand_check_reseed().
+ */
+static void
+ottery_st_count_output(struct ottery_state *st)
+{
+  st->bytes_since_reseed += (uint64_t)st->block_counter * st->output_len;
+  /* Don't step on a thread that's already reseeding. */
+  if (st->reseed_status != RESEED_NONE)
+    return;
+  if ((st->reseed_after_bytes &&
+       st->bytes_since_reseed >= st->reseed_after_bytes) ||
+      (st->reseed_after_seconds &&
+       ottery_seconds_now_() - st->last_reseed_time >=
+       st->reseed_after_seconds))
+    st->reseed_status = RESEED_DUE;
+}
+
+/**
+ * Mix n bytes of seed into the PRF key of st.  Afterwards, the caller must
+ * call ottery_st_nextblock_nolock() to refill the buffer from the new key.
+ * The caller must hold the lock, if there is one.
+ */
+static void
+ottery_st_mix_seed_nolock(struct ottery_state *st, const uint8_t *seed,
+                          size_t n)
+{
+  /* The algorithm here is really easy. We grab a block of output from the
+   * PRNG, that the first (state_bytes) bytes of that, XOR it with up to
+   * (state_bytes) bytes of our new seed data, and use that to set our new
+   * state. We do this over and over until we have no more seed data to add.
+   */
+  while (n) {
+    unsigned i;
+    size_t m = n > st->prf.state_bytes/2 ? st->prf.state_bytes/2 : n;
+    ottery_st_nextblock_nolock_norekey(st);
+    for (i = 0; i < m; ++i) {
+      st->buffer[i] ^= seed[i];
+    }
+    st->prf.setup(st->state, st->buffer);
+    st->block_counter = 0;
+    n -= m;
+    seed += m;
+  }
+}
+
+/**
+ * Forget any entropy that a helper thread has read for st, waiting for the
+ * thread to finish first if need be.
+ */
+static void
+ottery_st_drop_async_seed(struct ottery_state *st)
+{
+  struct ottery_async_seed_ *seed;
+#ifdef OTTERY_ASYNC_RESEED
+  /* In the child of a fork(), the helper thread doesn't exist, and we would
+   * wait forever. */
+  if (st->async_status == ASYNC_RUNNING && st->pid == getpid()) {
+    pthread_mutex_lock(&ottery_async_mutex_);
+    while (st->async_status == ASYNC_RUNNING)
+      pthread_cond_wait(&ottery_async_cond_, &ottery_async_mutex_);
+    pthread_mutex_unlock(&ottery_async_mutex_);
+  }
+#endif
+  __sync_synchronize();
+  seed = st->async_seed;
+  if (seed && st->async_status == ASYNC_READY) {
+    ottery_memclear_(seed, sizeof(*seed) + seed->buflen);
+    free(seed);
+  }
+  st->async_seed = NULL;
+  st->async_status = ASYNC_NONE;
+}
+
+/**
+ * Mix in the entropy that a helper thread left in st->async_seed, and
+ * count it as a reseed from the OS.  The caller must hold the lock, if
+ * there is one.
+ */
+static void
+ottery_st_mix_async_seed_nolock(struct ottery_state *st)
+{
+  struct ottery_async_seed_ *seed;
+  /* Don't look at the seed before the helper thread is done writing it. */
+  __sync_synchronize();
+  seed = st->async_seed;
+  ottery_st_discard_spare(st);
+  ottery_st_mix_seed_nolock(st, seed->buf, seed->len);
+  st->entropy_src_flags |= seed->flags;
+  st->last_entropy_flags = seed->flags;
+  st->bytes_since_reseed = 0;
+  st->last_reseed_time = seed->time;
+  (void) __sync_bool_compare_and_swap(&st->reseed_status,
+                                      RESEED_DUE, RESEED_NONE);
+  ottery_st_drop_async_seed(st);
 }
 
 /**
@@ -289,6 +656,9 @@ ottery_st_nextblock_nolock_norekey(struct ottery_state *st)
  * (st->buffer).  Use the first st->prf.state_bytes of those bytes to replace
  * the PRF state and advance (st->pos) to point after them.
  *
+ * If the spare block already holds those bytes, use it instead of running
+ * the PRF.  If a helper thread has left us some entropy, mix it in first.
+ *
  * This function does not acquire the lock on the state; use it within
  * another function that does.
  *
@@ -297,13 +667,148 @@ ottery_st_nextblock_nolock_norekey(struct ottery_state *st)
 static void
 ottery_st_nextblock_nolock(struct ottery_state_nolock *st)
 {
-  ottery_st_nextblock_nolock_norekey(st);
+  if (UNLIKELY(st->async_status == ASYNC_READY))
+    ottery_st_mix_async_seed_nolock(st);
+  if (st->spare_status == SPARE_READY &&
+      st->spare_counter == st->block_counter) {
+    uint8_t *spare = SPARE_BLOCK(st);
+    memcpy(st->buffer, spare, st->output_len);
+    /* The spare block must not outlive the buffer it was copied to. */
+    memset(spare, 0, st->output_len);
+    st->spare_status = SPARE_EMPTY;
+    ++st->block_counter;
+  } else {
+    /* We're about to rekey, so a spare block we didn't use here (because
+     * somebody generated its block counter themselves) will never be any
+     * good. */
+    ottery_st_discard_spare(st);
+    ottery_st_nextblock_nolock_norekey(st);
+  }
+  if (UNLIKELY(st->reseed_after_bytes || st->reseed_after_seconds))
+    ottery_st_count_output(st);
   st->prf.setup(st->state, st->buffer);
   CLEARBUF(st->buffer, st->prf.state_bytes);
   st->block_counter = 0;
   st->pos = st->prf.state_bytes;
 }
 
+#ifndef OTTERY_NO_PID_CHECK
+/*
+ * Fork detection.
+ *
+ * Every state remembers the "fork generation" in which it was last seeded,
+ * and reseeds itself when the current generation is different.  We want
+ * reading the current generation to cost no more than a memory load, so
+ * that we don't need to call getpid() on every request:
+ *
+ *   - Where the kernel supports MADV_WIPEONFORK, we keep the generation in
+ *     a page that gets zeroed in the child of a fork.  The first time
+ *     anybody sees a zero there, they install a fresh generation number.
+ *
+ *   - Otherwise, where we have pthreads, a pthread_atfork() child handler
+ *     bumps the generation.  (This misses processes created with a raw
+ *     clone() syscall, which is why we prefer the page.)
+ *
+ *   - Otherwise, the "generation" is just the pid.
+ */
+
+/** The most recently allocated fork generation.  Never zero, except
+ * briefly when wrapping around. */
+static uint32_t ottery_fork_generation_ = 1;
+/** Pointer to the word holding the current fork generation: either a
+ * wipe-on-fork page, or ottery_fork_generation_ itself.  NULL if we have
+ * no way to detect forks other than getpid(). */
+static volatile uint32_t *ottery_fork_generation_ptr_ = NULL;
+
+#ifdef HAVE_PTHREAD
+/** pthread_atfork() child handler: start a new fork generation. */
+static void
+ottery_fork_child_handler_(void)
+{
+  if (++ottery_fork_generation_ == 0)
+    ++ottery_fork_generation_;
+}
+#endif
+
+/** Set up ottery_fork_generation_ptr_ with the best fork-detection
+ * mechanism that we have. */
+static void
+ottery_fork_detect_init_(void)
+{
+#ifdef MADV_WIPEONFORK
+  {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    void *page;
+    if (pagesize <= 0)
+      pagesize = 4096;
+    page = mmap(NULL, (size_t)pagesize, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (page != MAP_FAILED) {
+      if (madvise(page, (size_t)pagesize, MADV_WIPEONFORK) == 0) {
+        *(volatile uint32_t *)page = ottery_fork_generation_;
+        ottery_fork_generation_ptr_ = page;
+        return;
+      }
+      /* Probably an older kernel. */
+      munmap(page, (size_t)pagesize);
+    }
+  }
+#endif
+#ifdef HAVE_PTHREAD
+  if (pthread_atfork(NULL, NULL, ottery_fork_child_handler_) == 0)
+    ottery_fork_generation_ptr_ = &ottery_fork_generation_;
+#endif
+}
+
+/** Make sure that ottery_fork_detect_init_() has been called exactly
+ * once. */
+static void
+ottery_fork_detect_ensure_init_(void)
+{
+#ifdef HAVE_PTHREAD
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, ottery_fork_detect_init_);
+#else
+  static int initialized = 0;
+  if (!initialized) {
+    ottery_fork_detect_init_();
+    initialized = 1;
+  }
+#endif
+}
+
+/** Slow path for ottery_get_fork_generation_(). */
+static uint32_t
+ottery_get_fork_generation_slow_(void)
+{
+  volatile uint32_t *p = ottery_fork_generation_ptr_;
+  uint32_t g;
+  if (p == NULL)
+    return (uint32_t)getpid();
+  /* The wipe-on-fork page was zeroed: we're in a new child process.  Our
+   * copy of ottery_fork_generation_ is at least as large as any generation
+   * that the parent handed out, so its successor is new to every state we
+   * inherited. */
+  g = __sync_add_and_fetch(&ottery_fork_generation_, 1);
+  if (g == 0)
+    g = __sync_add_and_fetch(&ottery_fork_generation_, 1);
+  (void) __sync_val_compare_and_swap(p, 0, g);
+  return *p;
+}
+
+/** Return the current fork generation.  This is nonzero, and differs from
+ * any value returned before the most recent fork(). */
+static inline uint32_t
+ottery_get_fork_generation_(void)
+{
+  volatile uint32_t *p = ottery_fork_generation_ptr_;
+  uint32_t g;
+  if (LIKELY(p != NULL) && LIKELY((g = *p) != 0))
+    return g;
+  return ottery_get_fork_generation_slow_();
+}
+#endif
+
 /**
  * Initialize or reinitialize a PRNG state.
  *
@@ -333,7 +838,14 @@ ottery_st_initialize(struct ottery_state *st,
   prf = config->impl;
 
   if (!prf)
-    prf = ottery_get_impl(NULL);
+    prf = ottery_get_impl_(NULL);
+
+  if (config->max_output_len && prf->output_len > config->max_output_len) {
+    /* Look for a flavor of the same PRF that fills a smaller buffer. */
+    prf = ottery_get_impl_fitting_(prf->name, config->max_output_len);
+    if (!prf)
+      return OTTERY_ERR_INVALID_ARGUMENT;
+  }
 
   memset(st, 0, sizeof(*st));
 
@@ -357,9 +869,17 @@ ottery_st_initialize(struct ottery_state *st,
 
   memcpy(&st->entropy_config, &config->entropy_config,
          sizeof(struct ottery_entropy_config));
+  st->reseed_after_bytes = config->reseed_after_bytes;
+  st->reseed_after_seconds = config->reseed_after_seconds;
+  st->locked = locked ? 1 : 0;
+
+#ifndef OTTERY_NO_PID_CHECK
+  ottery_fork_detect_ensure_init_();
+#endif
 
   /* Copy the PRF into place. */
   memcpy(&st->prf, prf, sizeof(*prf));
+  st->output_len = prf->output_len;
 
   if ((err = ottery_st_reseed(st)))
     return err;
@@ -369,6 +889,20 @@ ottery_st_initialize(struct ottery_state *st,
   st->magic = MAGIC(st);
 
   st->pid = getpid();
+#ifndef OTTERY_NO_PID_CHECK
+  st->fork_generation = ottery_get_fork_generation_();
+#endif
+
+  if (config->prefill) {
+    st->spare_alloc = malloc(st->output_len + 15);
+    if (!st->spare_alloc) {
+      if (locked)
+        ottery_st_wipe(st);
+      else
+        ottery_st_wipe_nolock(st);
+      return OTTERY_ERR_INTERNAL;
+    }
+  }
 
   return 0;
 }
@@ -406,10 +940,23 @@ ottery_st_reseed(struct ottery_state *st)
   st->last_entropy_flags = flags;
   st->entropy_src_flags = flags;
 
+  /* Nobody else can be filling the spare block: we only reseed during
+   * initialization, or in the only thread of a newly forked child.  For
+   * the same reason, no helper thread is reseeding us, and any entropy one
+   * left behind is also in our parent's copy of the state. */
+  st->spare_status = SPARE_EMPTY;
+  st->bit_reservoir = 0;
+  ottery_st_drop_async_seed(st);
+
   /* Generate the first block of output. */
   st->block_counter = 0;
   ottery_st_nextblock_nolock(st);
 
+  /* Start a new reseed interval. */
+  st->bytes_since_reseed = 0;
+  st->last_reseed_time = ottery_seconds_now_();
+  st->reseed_status = RESEED_NONE;
+
   return 0;
 }
 
@@ -441,6 +988,7 @@ ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n,
   uint8_t *tmp_seed = NULL;
   size_t tmp_seed_len = 0;
   uint32_t flags = 0;
+  uint64_t now = 0;
 
   if (!seed || !n) {
     int err;
@@ -457,27 +1005,14 @@ ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n,
     if (n < st->prf.state_bytes)
       return OTTERY_ERR_ACCESS_STRONG_RNG;
     seed = tmp_seed;
+    now = ottery_seconds_now_();
   }
 
   if (locking)
     LOCK(st);
-  /* The algorithm here is really easy. We grab a block of output from the
-   * PRNG, that the first (state_bytes) bytes of that, XOR it with up to
-   * (state_bytes) bytes of our new seed data, and use that to set our new
-   * state. We do this over and over until we have no more seed data to add.
-   */
-  while (n) {
-    unsigned i;
-    size_t m = n > st->prf.state_bytes/2 ? st->prf.state_bytes/2 : n;
-    ottery_st_nextblock_nolock_norekey(st);
-    for (i = 0; i < m; ++i) {
-      st->buffer[i] ^= seed[i];
-    }
-    st->prf.setup(st->state, st->buffer);
-    st->block_counter = 0;
-    n -= m;
-    seed += m;
-  }
+  ottery_st_discard_spare(st);
+  st->bit_reservoir = 0;
+  ottery_st_mix_seed_nolock(st, seed, n);
 
   /* Now make sure that st->buffer is set up with the new state. */
   ottery_st_nextblock_nolock(st);
@@ -485,6 +1020,13 @@ ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n,
   st->entropy_src_flags |= flags;
   st->last_entropy_flags = flags;
 
+  if (tmp_seed) {
+    /* We just reseeded from the OS: start a new reseed interval. */
+    st->bytes_since_reseed = 0;
+    st->last_reseed_time = now;
+    st->reseed_status = RESEED_NONE;
+  }
+
   if (locking)
     UNLOCK(st);
 
@@ -506,23 +1048,148 @@ ottery_st_add_seed_nolock(struct ottery_state_nolock *st, const uint8_t *seed, s
   return ottery_st_add_seed_impl(st, seed, n, 0, 1);
 }
 
+#ifdef OTTERY_ASYNC_RESEED
+/**
+ * Body of the helper thread for ottery_st_request_reseed_async(): read
+ * entropy for the state, and leave it for ottery_st_nextblock_nolock() to
+ * mix in.
+ */
+static void *
+ottery_async_reseed_thread_(void *arg)
+{
+  struct ottery_async_seed_ *seed = arg;
+  struct ottery_state *st = seed->st;
+  struct ottery_entropy_state entropy_state;
+  int r;
+
+  /* The state's own entropy_state belongs to whoever holds the state, so we
+   * use one of our own.  We only borrow the urandom inode, which never
+   * changes once it is set. */
+  memset(&entropy_state, 0, sizeof(entropy_state));
+  entropy_state.urandom_fd_inode = st->entropy_state.urandom_fd_inode;
+
+  seed->len = seed->buflen;
+  seed->flags = 0;
+  r = ottery_get_entropy_(&st->entropy_config, &entropy_state, 0,
+                          seed->buf, st->prf.state_bytes,
+                          &seed->len,
+                          &seed->flags);
+  ottery_release_entropy_state_(&entropy_state);
+
+  pthread_mutex_lock(&ottery_async_mutex_);
+  if (r || seed->len < st->prf.state_bytes) {
+    /* Nobody is waiting to hear about this; the state keeps its key. */
+    ottery_memclear_(seed, sizeof(*seed) + seed->buflen);
+    free(seed);
+    (void) __sync_bool_compare_and_swap(&st->async_status,
+                                        ASYNC_RUNNING, ASYNC_NONE);
+  } else {
+    seed->time = ottery_seconds_now_();
+    st->async_seed = seed;
+    /* This is a full barrier, so the seed is visible before the status. */
+    (void) __sync_bool_compare_and_swap(&st->async_status,
+                                        ASYNC_RUNNING, ASYNC_READY);
+  }
+  /* Once we let go of the lock, st may be wiped; don't touch it again. */
+  pthread_cond_broadcast(&ottery_async_cond_);
+  pthread_mutex_unlock(&ottery_async_mutex_);
+  return NULL;
+}
 
-void
-ottery_st_wipe(struct ottery_state *st)
+/**
+ * Shared implementation for ottery_st_request_reseed_async() and
+ * ottery_st_request_reseed_async_nolock().  It never takes the lock:
+ * async_status is claimed with a compare-and-swap, and the helper thread
+ * hands its seed back the same way.
+ */
+static int
+ottery_st_request_reseed_async_impl(struct ottery_state *st)
 {
-  DESTROY_LOCK(&st->mutex);
+  struct ottery_async_seed_ *seed;
+  size_t buflen;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int r;
 
-  ottery_st_wipe_nolock(st);
+  if (ottery_st_rand_check_magic(st))
+    return OTTERY_ERR_STATE_INIT;
+
+  /* If a reseed is already on its way, this request is answered too. */
+  if (!__sync_bool_compare_and_swap(&st->async_status,
+                                    ASYNC_NONE, ASYNC_RUNNING))
+    return 0;
+
+  buflen = ottery_get_entropy_bufsize_(st->prf.state_bytes);
+  seed = malloc(sizeof(*seed) + buflen);
+  if (!seed) {
+    st->async_status = ASYNC_NONE;
+    return OTTERY_ERR_INTERNAL;
+  }
+  seed->st = st;
+  seed->buflen = buflen;
+
+  if (pthread_attr_init(&attr)) {
+    free(seed);
+    st->async_status = ASYNC_NONE;
+    return OTTERY_ERR_INTERNAL;
+  }
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  r = pthread_create(&thread, &attr, ottery_async_reseed_thread_, seed);
+  pthread_attr_destroy(&attr);
+  if (r) {
+    free(seed);
+    st->async_status = ASYNC_NONE;
+    return OTTERY_ERR_INTERNAL;
+  }
+  return 0;
 }
+#endif
 
-void
-ottery_st_wipe_nolock(struct ottery_state_nolock *st)
+/* Without threads to hand the work to, we do it ourselves. */
+int
+ottery_st_request_reseed_async(struct ottery_state *st)
 {
-  ottery_memclear_(st, sizeof(struct ottery_state));
+#ifdef OTTERY_ASYNC_RESEED
+  return ottery_st_request_reseed_async_impl(st);
+#else
+  return ottery_st_add_seed_impl(st, NULL, 0, 1, 1);
+#endif
 }
 
-void
-ottery_st_prevent_backtracking_nolock(struct ottery_state_nolock *st)
+int
+ottery_st_request_reseed_async_nolock(struct ottery_state_nolock *st)
+{
+#ifdef OTTERY_ASYNC_RESEED
+  return ottery_st_request_reseed_async_impl(st);
+#else
+  return ottery_st_add_seed_impl(st, NULL, 0, 0, 1);
+#endif
+}
+
+
+void
+ottery_st_wipe(struct ottery_state *st)
+{
+  DESTROY_LOCK(&st->mutex);
+
+  ottery_st_wipe_nolock(st);
+}
+
+void
+ottery_st_wipe_nolock(struct ottery_state_nolock *st)
+{
+  /* A helper thread might still be reading entropy for us. */
+  ottery_st_drop_async_seed(st);
+  ottery_release_entropy_state_(&st->entropy_state);
+  if (st->spare_alloc) {
+    ottery_memclear_(st->spare_alloc, st->output_len + 15);
+    free(st->spare_alloc);
+  }
+  ottery_memclear_(st, sizeof(struct ottery_state));
+}
+
+void
+ottery_st_prevent_backtracking_nolock(struct ottery_state_nolock *st)
 {
 #ifdef OTTERY_NO_CLEAR_AFTER_YIELD
   memset(st->buffer, 0, st->pos);
@@ -539,6 +1206,68 @@ ottery_st_prevent_backtracking(struct ottery_state *st)
   UNLOCK(st);
 }
 
+void
+ottery_st_prefill_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  if (!st->spare_alloc || st->spare_status != SPARE_EMPTY)
+    return;
+  st->prf.generate(st->state, SPARE_BLOCK(st), st->block_counter);
+  ottery_wipe_stack_();
+  st->spare_counter = st->block_counter;
+  st->spare_status = SPARE_READY;
+}
+
+/*
+ * For a locked state, we generate the spare block without holding the lock,
+ * from a copy of the key.  When we're done, we only keep the block if the
+ * key and the block counter are still what they were when we started;
+ * otherwise somebody else has moved the state along, and the block is no
+ * good.  Marking the spare as SPARE_FILLING keeps any other thread from
+ * writing to it in the meantime.
+ */
+void
+ottery_st_prefill(struct ottery_state *st)
+{
+  __attribute__ ((aligned (16))) uint8_t prf_state[MAX_STATE_LEN];
+  void (*generate)(void *state, uint8_t *output, uint32_t idx);
+  size_t state_len;
+  uint32_t counter;
+  uint8_t *spare;
+
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  if (!st->spare_alloc || st->spare_status != SPARE_EMPTY) {
+    UNLOCK(st);
+    return;
+  }
+  st->spare_status = SPARE_FILLING;
+  generate = st->prf.generate;
+  state_len = st->prf.state_len;
+  memcpy(prf_state, st->state, state_len);
+  counter = st->block_counter;
+  spare = SPARE_BLOCK(st);
+  UNLOCK(st);
+
+  generate(prf_state, spare, counter);
+
+  LOCK(st);
+  if (st->spare_status == SPARE_FILLING) {
+    if (st->block_counter == counter &&
+        !memcmp(st->state, prf_state, state_len)) {
+      st->spare_counter = counter;
+      st->spare_status = SPARE_READY;
+    } else {
+      st->spare_status = SPARE_EMPTY;
+    }
+  }
+  UNLOCK(st);
+
+  ottery_memclear_(prf_state, sizeof(prf_state));
+  ottery_wipe_stack_();
+}
+
 /** Function that's invoked on a fatal error. See
  * ottery_set_fatal_handler() for more information. */
 static void (*ottery_fatal_handler)(int) = NULL;
@@ -559,11 +1288,10 @@ ottery_set_fatal_handler(void (*fn)(int))
 }
 
 /**
- * Shared prologue for functions generating random bytes from an ottery_state.
  * Make sure that the state is initialized.
  */
 static inline int
-ottery_st_rand_check_init(struct ottery_state *st)
+ottery_st_rand_check_magic(struct ottery_state *st)
 {
 #ifndef OTTERY_NO_INIT_CHECK
   if (UNLIKELY(st->magic != MAGIC(st))) {
@@ -576,18 +1304,62 @@ ottery_st_rand_check_init(struct ottery_state *st)
   return 0;
 }
 
-/* XXXX */
+/**
+ * Reseed st from the OS, because its reseed interval is used up.  If
+ * locking is true, the caller must not hold the lock: we read the entropy
+ * source without it, and ottery_st_add_seed_impl() only takes the lock to
+ * mix in what we read.  Only one thread does this at a time; the others
+ * keep using the old key until it is done.
+ */
+static void
+ottery_st_reseed_when_due(struct ottery_state *st, int locking)
+{
+  if (locking) {
+    if (!__sync_bool_compare_and_swap(&st->reseed_status,
+                                      RESEED_DUE, RESEED_RUNNING))
+      return;
+  } else {
+    st->reseed_status = RESEED_RUNNING;
+  }
+  /* On success, this sets reseed_status back to RESEED_NONE.  On failure,
+   * we do that ourselves, and the next block will make us try again. */
+  if (ottery_st_add_seed_impl(st, NULL, 0, locking, 0))
+    st->reseed_status = RESEED_NONE;
+}
+
+/**
+ * Shared prologue for functions generating random bytes from a locked
+ * ottery_state, before they take the lock.  Make sure that the state is
+ * initialized, and reseed it if it is due.
+ */
+static inline int
+ottery_st_rand_check_init(struct ottery_state *st)
+{
+  if (ottery_st_rand_check_magic(st))
+    return -1;
+  if (UNLIKELY(st->reseed_status == RESEED_DUE))
+    ottery_st_reseed_when_due(st, 1);
+  return 0;
+}
+
+/**
+ * Shared prologue for functions generating random bytes from an ottery_state.
+ * If the process has forked since the state was seeded, reseed it, so that
+ * parent and child don't produce the same stream.
+ */
 static inline int
 ottery_st_rand_check_pid(struct ottery_state *st)
 {
 #ifndef OTTERY_NO_PID_CHECK
-  if (UNLIKELY(st->pid != getpid())) {
+  const uint32_t generation = ottery_get_fork_generation_();
+  if (UNLIKELY(st->fork_generation != generation)) {
     int err;
     if ((err = ottery_st_reseed(st))) {
       ottery_fatal_error_(OTTERY_ERR_FLAG_POSTFORK_RESEED|err);
       return -1;
     }
     st->pid = getpid();
+    st->fork_generation = generation;
   }
 #else
   (void) st;
@@ -611,10 +1383,14 @@ ottery_st_rand_lock_and_check(struct ottery_state *st)
 static inline int
 ottery_st_rand_check_nolock(struct ottery_state_nolock *st)
 {
-  if (ottery_st_rand_check_init(st))
+  if (ottery_st_rand_check_magic(st))
     return -1;
   if (ottery_st_rand_check_pid(st))
     return -1;
+  /* A locked state gets here holding its lock, so it waits for
+   * ottery_st_rand_check_init() to reseed it. */
+  if (UNLIKELY(st->reseed_status == RESEED_DUE) && !st->locked)
+    ottery_st_reseed_when_due(st, 0);
   return 0;
 }
 
@@ -626,18 +1402,18 @@ ottery_st_rand_check_nolock(struct ottery_state_nolock *st)
  * @param st The state to use.
  * @param out A location to write to.
  * @param n The number of bytes to write. Must not be greater than
- *     st->prf.output_len*2 - st->prf.state_bytes - st->pos - 1.
+ *     st->output_len*2 - st->prf.state_bytes - st->pos - 1.
  */
 static inline void
 ottery_st_rand_bytes_from_buf(struct ottery_state *st, uint8_t *out,
                               size_t n)
 {
-  if (n + st->pos < st->prf.output_len) {
+  if (n + st->pos < st->output_len) {
     memcpy(out, st->buffer+st->pos, n);
     CLEARBUF(st->buffer+st->pos, n);
     st->pos += n;
   } else {
-    unsigned cpy = st->prf.output_len - st->pos;
+    unsigned cpy = st->output_len - st->pos;
     memcpy(out, st->buffer+st->pos, cpy);
     n -= cpy;
     out += cpy;
@@ -645,7 +1421,7 @@ ottery_st_rand_bytes_from_buf(struct ottery_state *st, uint8_t *out,
     memcpy(out, st->buffer+st->pos, n);
     CLEARBUF(st->buffer, n);
     st->pos += n;
-    assert(st->pos < st->prf.output_len);
+    assert(st->pos < st->output_len);
   }
 }
 
@@ -656,29 +1432,34 @@ ottery_st_rand_bytes_impl(struct ottery_state *st, void *out_,
   uint8_t *out = out_;
   size_t cpy;
 
-  if (n + st->pos < st->prf.output_len * 2 - st->prf.state_bytes - 1) {
+  if (n + st->pos < st->output_len * 2 - st->prf.state_bytes - 1) {
     /* Fulfill it all from the buffer simply if possible. */
     ottery_st_rand_bytes_from_buf(st, out, n);
     return;
   }
 
   /* Okay. That's not going to happen.  Well, take what we can... */
-  cpy = st->prf.output_len - st->pos;
+  cpy = st->output_len - st->pos;
   memcpy(out, st->buffer + st->pos, cpy);
   out += cpy;
   n -= cpy;
 
-  /* Then take whole blocks so long as we need them, without stirring... */
-  while (n >= st->prf.output_len) {
-    /* (We could save a memcpy here if we generated the block directly at out
-     * rather than doing the memcpy here. First we'd need to make sure that we
-     * had gotten the block aligned to a 16-byte boundary, though, and we'd
-     * have some other tricky bookkeeping to do. Let's call this good enough
-     * for now.) */
+  /* Then take whole blocks so long as we need them, without stirring.
+   * These go straight to the user, so when the PRF can write to wherever
+   * 'out' points, we generate them there and skip the copy through our
+   * buffer. */
+  if (n >= st->output_len && PRF_CAN_GENERATE_INTO(st, out)) {
+    while (n >= st->output_len) {
+      ottery_st_nextblock_nolock_norekey_into(st, out);
+      out += st->output_len;
+      n -= st->output_len;
+    }
+  }
+  while (n >= st->output_len) {
     ottery_st_nextblock_nolock_norekey(st);
-    memcpy(out, st->buffer, st->prf.output_len);
-    out += st->prf.output_len;
-    n -= st->prf.output_len;
+    memcpy(out, st->buffer, st->output_len);
+    out += st->output_len;
+    n -= st->output_len;
   }
 
   /* Then stir for the last part. */
@@ -686,13 +1467,81 @@ ottery_st_rand_bytes_impl(struct ottery_state *st, void *out_,
   ottery_st_rand_bytes_from_buf(st, out, n);
 }
 
+/**
+ * As ottery_st_rand_bytes_impl(), but for a locked state whose lock we hold.
+ * Release the lock before generating the whole blocks of a big request, so
+ * that other threads don't have to wait for us.
+ *
+ * We produce exactly the bytes that ottery_st_rand_bytes_impl() would have.
+ * While holding the lock, we take whatever is left in the buffer, make a
+ * copy of the PRF key, reserve the block counters that the whole blocks
+ * will use, rekey the state from the block after them, and take the final
+ * partial block from the new buffer.  Once the lock is released, nobody
+ * else can use the reserved counters with our copy of the key, so we can
+ * generate the middle of the output at our leisure.
+ */
+static void
+ottery_st_rand_bytes_and_unlock(struct ottery_state *st, void *out_,
+                                size_t n)
+{
+  __attribute__ ((aligned (16))) uint8_t prf_state[MAX_STATE_LEN];
+  __attribute__ ((aligned (16))) uint8_t block[MAX_OUTPUT_LEN];
+  void (*generate)(void *state, uint8_t *output, uint32_t idx);
+  int unaligned_ok;
+  uint8_t *out = out_;
+  size_t cpy, output_len, n_blocks, i;
+  uint32_t counter;
+  int used_block = 0;
+
+  if (n + st->pos < st->output_len * 2 - st->prf.state_bytes - 1) {
+    /* Small enough to fill from the buffer; not worth the trouble. */
+    ottery_st_rand_bytes_from_buf(st, out, n);
+    UNLOCK(st);
+    return;
+  }
+
+  output_len = st->output_len;
+  cpy = output_len - st->pos;
+  memcpy(out, st->buffer + st->pos, cpy);
+  out += cpy;
+  n -= cpy;
+
+  n_blocks = n / output_len;
+  n -= n_blocks * output_len;
+
+  generate = st->prf.generate;
+  unaligned_ok = (st->prf.flags & OTTERY_PRF_FL_UNALIGNED_OUTPUT) != 0;
+  memcpy(prf_state, st->state, st->prf.state_len);
+  counter = st->block_counter;
+  st->block_counter += (uint32_t)n_blocks;
+
+  ottery_st_nextblock_nolock(st);
+  ottery_st_rand_bytes_from_buf(st, out + n_blocks * output_len, n);
+  UNLOCK(st);
+
+  for (i = 0; i < n_blocks; ++i) {
+    if (unaligned_ok || (((uintptr_t)out) & 0xf) == 0) {
+      generate(prf_state, out, counter + (uint32_t)i);
+    } else {
+      generate(prf_state, block, counter + (uint32_t)i);
+      memcpy(out, block, output_len);
+      used_block = 1;
+    }
+    out += output_len;
+  }
+
+  ottery_memclear_(prf_state, sizeof(prf_state));
+  if (used_block)
+    ottery_memclear_(block, output_len);
+  ottery_wipe_stack_();
+}
+
 void
 ottery_st_rand_bytes(struct ottery_state *st, void *out_, size_t n)
 {
   if (ottery_st_rand_lock_and_check(st))
     return;
-  ottery_st_rand_bytes_impl(st, out_, n);
-  UNLOCK(st);
+  ottery_st_rand_bytes_and_unlock(st, out_, n);
 }
 
 void
@@ -703,6 +1552,108 @@ ottery_st_rand_bytes_nolock(struct ottery_state_nolock *st, void *out_, size_t n
   ottery_st_rand_bytes_impl(st, out_, n);
 }
 
+/**
+ * Initialize child as a new state keyed from parent's output.
+ *
+ * The child gets the parent's PRF, entropy configuration, and prefill
+ * setting.  Rather than generating its first block now, we leave the
+ * child's buffer empty (pos == output_len): every function that takes
+ * bytes from the buffer already handles running off its end by calling
+ * ottery_st_nextblock_nolock().  That way, creating a child costs one
+ * small read from the parent and a key setup.
+ *
+ * @param child The state to initialize.
+ * @param parent The state to take the key from.
+ * @param child_locked True iff child is an ottery_state (not _nolock).
+ * @param parent_locked True iff parent is an ottery_state (not _nolock).
+ * @return An OTTERY_ERR_* value (zero on success, nonzero on failure).
+ */
+static int
+ottery_st_init_from_parent_impl(struct ottery_state *child,
+                                struct ottery_state *parent,
+                                int child_locked,
+                                int parent_locked)
+{
+  __attribute__ ((aligned (16))) uint8_t key[MAX_STATE_BYTES];
+  size_t key_len;
+  int want_spare;
+
+  if (((uintptr_t)child) & 0xf)
+    return OTTERY_ERR_STATE_ALIGNMENT;
+  if (child == parent)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+
+  if (parent_locked) {
+    if (ottery_st_rand_lock_and_check(parent))
+      return OTTERY_ERR_STATE_INIT;
+  } else {
+    if (ottery_st_rand_check_nolock(parent))
+      return OTTERY_ERR_STATE_INIT;
+  }
+
+  memset(child, 0, sizeof(*child));
+
+  key_len = parent->prf.state_bytes;
+  ottery_st_rand_bytes_impl(parent, key, key_len);
+  memcpy(&child->prf, &parent->prf, sizeof(child->prf));
+  child->output_len = parent->output_len;
+  memcpy(&child->entropy_config, &parent->entropy_config,
+         sizeof(struct ottery_entropy_config));
+  child->entropy_src_flags = parent->entropy_src_flags;
+  child->last_entropy_flags = parent->last_entropy_flags;
+  child->pid = parent->pid;
+  child->reseed_after_bytes = parent->reseed_after_bytes;
+  child->reseed_after_seconds = parent->reseed_after_seconds;
+  child->last_reseed_time = parent->last_reseed_time;
+  child->locked = child_locked ? 1 : 0;
+#ifndef OTTERY_NO_PID_CHECK
+  child->fork_generation = parent->fork_generation;
+#endif
+  want_spare = parent->spare_alloc != NULL;
+  if (parent_locked)
+    UNLOCK(parent);
+
+  if (want_spare) {
+    child->spare_alloc = malloc(child->output_len + 15);
+    if (!child->spare_alloc) {
+      ottery_memclear_(key, sizeof(key));
+      ottery_memclear_(child, sizeof(*child));
+      return OTTERY_ERR_INTERNAL;
+    }
+  }
+
+  if (child_locked) {
+    if (INIT_LOCK(&child->mutex)) {
+      ottery_memclear_(key, sizeof(key));
+      ottery_st_wipe_nolock(child);
+      return OTTERY_ERR_LOCK_INIT;
+    }
+  }
+
+  child->prf.setup(child->state, key);
+  ottery_memclear_(key, sizeof(key));
+  child->block_counter = 0;
+  child->pos = child->output_len;
+
+  child->magic = MAGIC(child);
+
+  return 0;
+}
+
+int
+ottery_st_init_from_parent(struct ottery_state *child,
+                           struct ottery_state *parent)
+{
+  return ottery_st_init_from_parent_impl(child, parent, 1, 1);
+}
+
+int
+ottery_st_init_from_parent_nolock(struct ottery_state_nolock *child,
+                                  struct ottery_state_nolock *parent)
+{
+  return ottery_st_init_from_parent_impl(child, parent, 0, 0);
+}
+
 /**
  * Assign an integer type from bytes at a possibly unaligned pointer.
  *
@@ -722,11 +1673,11 @@ ottery_st_rand_bytes_nolock(struct ottery_state_nolock *st, void *out_, size_t n
  **/
 #define OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, unlock) do {      \
     inttype result;                                                    \
-    if (sizeof(inttype) + (st)->pos <= (st)->prf.output_len) {         \
+    if (sizeof(inttype) + (st)->pos <= (st)->output_len) {         \
       INT_ASSIGN_PTR(inttype, result, (st)->buffer + (st)->pos);       \
       CLEARBUF((st)->buffer + (st)->pos, sizeof(inttype));             \
       (st)->pos += sizeof(inttype);                                    \
-      if (st->pos == (st)->prf.output_len) {                           \
+      if (st->pos == (st)->output_len) {                           \
         ottery_st_nextblock_nolock(st);                                \
       }                                                                \
     } else {                                                           \
@@ -791,30 +1742,201 @@ ottery_st_rand_uint64_nolock(struct ottery_state_nolock *st)
   OTTERY_RETURN_RAND_INTTYPE_NOLOCK(st, uint64_t);
 }
 
+/** As ottery_st_rand_uint32_nolock(), but without checking the state: the
+ * caller must already have done so. */
+static inline uint32_t
+ottery_st_rand_uint32_nocheck_(struct ottery_state_nolock *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE_IMPL(st, uint32_t, );
+}
+
+/** As ottery_st_rand_uint64_nolock(), but without checking the state: the
+ * caller must already have done so. */
+static inline uint64_t
+ottery_st_rand_uint64_nocheck_(struct ottery_state_nolock *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE_IMPL(st, uint64_t, );
+}
+
+/*
+ * The array fills below are just bulk byte requests: any sequence of bytes
+ * from the PRF is a uniformly random sequence of integers, so we take the
+ * lock once and let ottery_st_rand_bytes_impl() generate whole blocks
+ * directly into the caller's array.
+ */
+
+/** Fail and return from the calling function if n elements of type 'type'
+ * can't all fit in memory, so that n doesn't describe a real array. */
+#define CHECK_ARRAY_LEN(n, type) do {                       \
+    if (UNLIKELY((n) > SIZE_MAX / sizeof(type))) {          \
+      ottery_fatal_error_(OTTERY_ERR_INVALID_ARGUMENT);     \
+      return;                                               \
+    }                                                       \
+  } while (0)
+
+void
+ottery_st_rand_uint32_array(struct ottery_state *st, uint32_t *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, uint32_t);
+  ottery_st_rand_bytes(st, out, n * sizeof(uint32_t));
+}
+
+void
+ottery_st_rand_uint32_array_nolock(struct ottery_state_nolock *st,
+                                   uint32_t *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, uint32_t);
+  ottery_st_rand_bytes_nolock(st, out, n * sizeof(uint32_t));
+}
+
+void
+ottery_st_rand_uint64_array(struct ottery_state *st, uint64_t *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, uint64_t);
+  ottery_st_rand_bytes(st, out, n * sizeof(uint64_t));
+}
+
+void
+ottery_st_rand_uint64_array_nolock(struct ottery_state_nolock *st,
+                                   uint64_t *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, uint64_t);
+  ottery_st_rand_bytes_nolock(st, out, n * sizeof(uint64_t));
+}
+
+/*
+ * Bounded integers.
+ *
+ * We use Lemire's "nearly divisionless" method: to pick a number in
+ * [0, range), multiply a random w-bit x by range, and take the high w bits
+ * of the 2w-bit product.  That result is biased only when the low w bits of
+ * the product fall below (2^w mod range); we reject those draws and try
+ * again.  Since (2^w mod range) < range, we only need the division to
+ * compute it when the low bits are below range, which is rare unless range
+ * is huge.  And unlike the divide-and-reject approach, we reject fewer than
+ * range/2^w of our draws, rather than up to half of them.
+ */
+
+/** Return a random value in [0, range) from st, by Lemire's method.  range
+ * must be at least 1.  The caller must already have checked st. */
+static inline uint32_t
+ottery_st_rand_below32_nocheck_(struct ottery_state_nolock *st,
+                                uint32_t range)
+{
+  uint64_t m = (uint64_t)ottery_st_rand_uint32_nocheck_(st) * range;
+  uint32_t lo = (uint32_t)m;
+  if (UNLIKELY(lo < range)) {
+    const uint32_t threshold = (0u - range) % range;
+    while (lo < threshold) {
+      m = (uint64_t)ottery_st_rand_uint32_nocheck_(st) * range;
+      lo = (uint32_t)m;
+    }
+  }
+  return (uint32_t)(m >> 32);
+}
+
 unsigned
 ottery_st_rand_range_nolock(struct ottery_state_nolock *st, unsigned upper)
 {
-  unsigned lim = upper+1;
-  unsigned divisor = lim ? (UINT_MAX / lim) : 1;
-  unsigned n;
-  do {
-    n = (ottery_st_rand_unsigned_nolock(st) / divisor);
-  } while (n > upper);
-
-  return n;
+#if UINT_MAX > 0xffffffffu
+  return (unsigned) ottery_st_rand_range64_nolock(st, upper);
+#else
+  const uint32_t range = (uint32_t)upper + 1;
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  if (range == 0)
+    return ottery_st_rand_uint32_nocheck_(st);
+  return ottery_st_rand_below32_nocheck_(st, range);
+#endif
 }
 
 uint64_t
 ottery_st_rand_range64_nolock(struct ottery_state_nolock *st, uint64_t upper)
 {
-  uint64_t lim = upper+1;
-  uint64_t divisor = lim ? (UINT64_MAX / lim) : 1;
-  uint64_t n;
-  do {
-    n = (ottery_st_rand_uint64_nolock(st) / divisor);
-  } while (n > upper);
+  const uint64_t range = upper + 1;
+  uint64_t hi, lo;
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  if (range == 0)
+    return ottery_st_rand_uint64_nocheck_(st);
+  hi = ottery_mul64_(ottery_st_rand_uint64_nocheck_(st), range, &lo);
+  if (UNLIKELY(lo < range)) {
+    const uint64_t threshold = (0u - range) % range;
+    while (lo < threshold)
+      hi = ottery_mul64_(ottery_st_rand_uint64_nocheck_(st), range, &lo);
+  }
+  return hi;
+}
 
-  return n;
+/**
+ * Shared implementation for ottery_st_rand_range_array() and
+ * ottery_st_rand_range_array_nolock().
+ *
+ * We fill the array with raw 32-bit values in one bulk request, and then
+ * map them into range in place.  The loops that test for rejection and that
+ * do the mapping have no data-dependent branches, so that the compiler can
+ * turn them into vector multiplies.  Only if some draw is rejected do we go
+ * back and replace the rejected values one at a time.
+ *
+ * @param st The state to use.
+ * @param out The array to fill.
+ * @param n The number of elements in out.
+ * @param upper The largest value to return (inclusive).
+ * @param locking If true, we acquire and release the lock on st.
+ */
+static void
+ottery_st_rand_range_array_impl(struct ottery_state *st, uint32_t *out,
+                                size_t n, uint32_t upper, int locking)
+{
+  const uint32_t range = upper + 1;
+  size_t i;
+
+  CHECK_ARRAY_LEN(n, uint32_t);
+
+  if (locking) {
+    if (ottery_st_rand_lock_and_check(st))
+      return;
+  } else {
+    if (ottery_st_rand_check_nolock(st))
+      return;
+  }
+
+  ottery_st_rand_bytes_impl(st, out, n * sizeof(uint32_t));
+
+  if (range != 0) {
+    const uint32_t threshold = (0u - range) % range;
+    uint32_t any_rejected = 0;
+    for (i = 0; i < n; ++i)
+      any_rejected |= ((uint32_t)(out[i] * range) < threshold);
+    if (UNLIKELY(any_rejected)) {
+      for (i = 0; i < n; ++i) {
+        while ((uint32_t)(out[i] * range) < threshold)
+          out[i] = ottery_st_rand_uint32_nocheck_(st);
+      }
+    }
+  }
+
+  if (locking)
+    UNLOCK(st);
+
+  if (range != 0) {
+    for (i = 0; i < n; ++i)
+      out[i] = (uint32_t)(((uint64_t)out[i] * range) >> 32);
+  }
+}
+
+void
+ottery_st_rand_range_array(struct ottery_state *st, uint32_t *out, size_t n,
+                           uint32_t top)
+{
+  ottery_st_rand_range_array_impl(st, out, n, top, 1);
+}
+
+void
+ottery_st_rand_range_array_nolock(struct ottery_state_nolock *st,
+                                  uint32_t *out, size_t n, uint32_t top)
+{
+  ottery_st_rand_range_array_impl(st, out, n, top, 0);
 }
 
 unsigned
@@ -840,3 +1962,1158 @@ ottery_st_rand_range64(struct ottery_state *state, uint64_t upper)
   UNLOCK(state);
   return n;
 }
+
+/*
+ * Weighted choice, with Vose's alias method.
+ *
+ * We scale the weights so that they average 1, and then split them into n
+ * columns of height 1: column i holds all or part of the weight for i, and
+ * the rest of its height (if any) goes to a single other index, alias[i].
+ * To sample, we pick a column uniformly with ottery_st_rand_range()'s
+ * method, and then use a second random 32-bit value to decide between the
+ * column's own index and its alias.  Full columns have themselves as their
+ * alias, so the second comparison can never go wrong for them.
+ */
+
+int
+ottery_alias_table_new(struct ottery_alias_table **out,
+                       const double *weights, size_t n)
+{
+  struct ottery_alias_table *tbl = NULL;
+  double *p = NULL;
+  uint32_t *work = NULL;
+  double sum = 0.0;
+  size_t i, n_small = 0, n_large = 0;
+  int err = OTTERY_ERR_INVALID_ARGUMENT;
+
+  *out = NULL;
+  if (n == 0 || n > UINT32_MAX)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  for (i = 0; i < n; ++i) {
+    /* This rejects NaNs too. */
+    if (!(weights[i] >= 0.0 && weights[i] <= DBL_MAX))
+      return OTTERY_ERR_INVALID_ARGUMENT;
+    sum += weights[i];
+  }
+  if (!(sum > 0.0 && sum <= DBL_MAX))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+
+  err = OTTERY_ERR_INTERNAL;
+  tbl = malloc(sizeof(*tbl) + n * sizeof(struct ottery_alias_entry_));
+  p = malloc(n * sizeof(double));
+  work = malloc(n * sizeof(uint32_t));
+  if (!tbl || !p || !work)
+    goto done;
+
+  /* Small columns go at the start of work, and large ones at the end. */
+  for (i = 0; i < n; ++i) {
+    p[i] = weights[i] / sum * (double)n;
+    if (p[i] < 1.0)
+      work[n_small++] = (uint32_t)i;
+    else
+      work[n - ++n_large] = (uint32_t)i;
+  }
+  while (n_small && n_large) {
+    const uint32_t s = work[--n_small];
+    const uint32_t l = work[n - n_large];
+    tbl->entries[s].threshold = (uint32_t)(p[s] * 4294967296.0);
+    tbl->entries[s].alias = l;
+    p[l] = (p[l] + p[s]) - 1.0;
+    if (p[l] < 1.0) {
+      --n_large;
+      work[n_small++] = l;
+    }
+  }
+  /* Whatever is left is full, up to rounding error. */
+  while (n_large) {
+    const uint32_t l = work[n - n_large--];
+    tbl->entries[l].threshold = UINT32_MAX;
+    tbl->entries[l].alias = l;
+  }
+  while (n_small) {
+    const uint32_t s = work[--n_small];
+    tbl->entries[s].threshold = UINT32_MAX;
+    tbl->entries[s].alias = s;
+  }
+  tbl->n = (uint32_t)n;
+
+  *out = tbl;
+  tbl = NULL;
+  err = 0;
+ done:
+  free(tbl);
+  free(p);
+  free(work);
+  return err;
+}
+
+void
+ottery_alias_table_free(struct ottery_alias_table *tbl)
+{
+  free(tbl);
+}
+
+/** Return the index chosen by a column and a 32-bit coin from tbl. */
+static inline uint32_t
+ottery_alias_pick_(const struct ottery_alias_table *tbl, uint32_t col,
+                   uint32_t coin)
+{
+  const struct ottery_alias_entry_ *e = &tbl->entries[col];
+  return coin < e->threshold ? col : e->alias;
+}
+
+uint32_t
+ottery_st_rand_weighted_nolock(struct ottery_state_nolock *st,
+                               const struct ottery_alias_table *tbl)
+{
+  uint32_t col;
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  col = ottery_st_rand_below32_nocheck_(st, tbl->n);
+  return ottery_alias_pick_(tbl, col, ottery_st_rand_uint32_nocheck_(st));
+}
+
+uint32_t
+ottery_st_rand_weighted(struct ottery_state *st,
+                        const struct ottery_alias_table *tbl)
+{
+  uint32_t r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_weighted_nolock(st, tbl);
+  UNLOCK(st);
+  return r;
+}
+
+/** Number of coins to take at a time when filling an array of weighted
+ * choices. */
+#define WEIGHTED_BATCH 256
+
+/**
+ * Shared implementation for ottery_st_rand_weighted_array() and
+ * ottery_st_rand_weighted_array_nolock().
+ *
+ * We pick the columns with ottery_st_rand_range_array(), and take the coins
+ * in bulk too, so the locked version takes the lock twice per batch rather
+ * than once per element.
+ *
+ * @param st The state to use.
+ * @param tbl The table to sample from.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param locking True iff st is a locked state.
+ */
+static void
+ottery_st_rand_weighted_array_impl(struct ottery_state *st,
+                                   const struct ottery_alias_table *tbl,
+                                   uint32_t *out, size_t n, int locking)
+{
+  uint32_t coins[WEIGHTED_BATCH];
+  while (n) {
+    const size_t m = n < WEIGHTED_BATCH ? n : WEIGHTED_BATCH;
+    size_t i;
+    if (locking) {
+      ottery_st_rand_range_array(st, out, m, tbl->n - 1);
+      ottery_st_rand_bytes(st, coins, sizeof(uint32_t) * m);
+    } else {
+      ottery_st_rand_range_array_nolock(st, out, m, tbl->n - 1);
+      ottery_st_rand_bytes_nolock(st, coins, sizeof(uint32_t) * m);
+    }
+    for (i = 0; i < m; ++i)
+      out[i] = ottery_alias_pick_(tbl, out[i], coins[i]);
+    out += m;
+    n -= m;
+  }
+  ottery_memclear_(coins, sizeof(coins));
+}
+
+void
+ottery_st_rand_weighted_array(struct ottery_state *st,
+                              const struct ottery_alias_table *tbl,
+                              uint32_t *out, size_t n)
+{
+  ottery_st_rand_weighted_array_impl(st, tbl, out, n, 1);
+}
+
+void
+ottery_st_rand_weighted_array_nolock(struct ottery_state_nolock *st,
+                                     const struct ottery_alias_table *tbl,
+                                     uint32_t *out, size_t n)
+{
+  ottery_st_rand_weighted_array_impl(st, tbl, out, n, 0);
+}
+
+/*
+ * Random bits.
+ *
+ * Taking a whole 32-bit value for every coin flip wastes 31 of its bits, so
+ * we keep a reservoir of up to 63 unused bits in the state, and refill it
+ * from the buffer 64 bits at a time.  Each bit leaves the reservoir as soon
+ * as we use it, so this doesn't weaken backtracking resistance.
+ *
+ * For a Bernoulli trial with probability p, we compare the binary digits
+ * of a uniform random U in [0, 1) with those of p, stopping as soon as they
+ * differ: U < p exactly when U is smaller at the first place they differ.
+ * This is exact for every double p.  We compare 8 digits at a time: that
+ * uses more bits than going one at a time (2 on average), but it almost
+ * always finishes after one step, and so it has only one unpredictable
+ * branch.  For bulk masks, we do the one-digit version in all 64 bit
+ * positions at once.
+ */
+
+/** Return k random bits (1 <= k <= 32) from st's reservoir.  The caller
+ * must already have checked st. */
+static inline uint32_t
+ottery_st_rand_bits_nocheck_(struct ottery_state_nolock *st, unsigned k)
+{
+  uint64_t r = st->bit_reservoir;
+  /* The marker bit is at position (number of bits left). */
+  if (UNLIKELY((r >> k) == 0)) {
+    r = ottery_st_rand_uint64_nocheck_(st);
+    st->bit_reservoir = (r >> k) | (UINT64_C(1) << (64 - k));
+  } else {
+    st->bit_reservoir = r >> k;
+  }
+  return (uint32_t)(r & ((UINT64_C(1) << k) - 1));
+}
+
+/** Remove the first binary digit after the point from *p, which must be in
+ * [0, 1), and return it.  This is exact.  (The mask functions use this; the
+ * single-value ones take 8 digits at a time.) */
+static inline int
+ottery_next_binary_digit_(double *p)
+{
+  *p += *p;
+  if (*p >= 1.0) {
+    *p -= 1.0;
+    return 1;
+  }
+  return 0;
+}
+
+int
+ottery_st_rand_bit_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  return (int)ottery_st_rand_bits_nocheck_(st, 1);
+}
+
+int
+ottery_st_rand_bernoulli_nolock(struct ottery_state_nolock *st, double p)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  if (!(p > 0.0))
+    return 0;
+  if (p >= 1.0)
+    return 1;
+  for (;;) {
+    const double scaled = p * 256.0;
+    const uint32_t d = (uint32_t)scaled;
+    const uint32_t u = ottery_st_rand_bits_nocheck_(st, 8);
+    p = scaled - d;
+    if (u != d)
+      return u < d;
+    /* If the rest of p is zero, U can't be less than p. */
+    if (p == 0.0)
+      return 0;
+  }
+}
+
+void
+ottery_st_rand_bernoulli_mask_nolock(struct ottery_state_nolock *st,
+                                     uint64_t *out, size_t n, double p)
+{
+  size_t i;
+  CHECK_ARRAY_LEN(n, uint64_t);
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  if (!(p > 0.0) || p >= 1.0) {
+    memset(out, p >= 1.0 ? 0xff : 0, n * sizeof(uint64_t));
+    return;
+  }
+  /* Run 64 of the digit-by-digit comparisons at once, one in each bit. */
+  for (i = 0; i < n; ++i) {
+    uint64_t result = 0, undecided = ~(uint64_t)0;
+    double q = p;
+    while (undecided && q != 0.0) {
+      const uint64_t r = ottery_st_rand_uint64_nocheck_(st);
+      if (ottery_next_binary_digit_(&q)) {
+        result |= undecided & ~r;
+        undecided &= r;
+      } else {
+        undecided &= ~r;
+      }
+    }
+    out[i] = result;
+  }
+}
+
+int
+ottery_st_rand_bit(struct ottery_state *st)
+{
+  int r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_bit_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+int
+ottery_st_rand_bernoulli(struct ottery_state *st, double p)
+{
+  int r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_bernoulli_nolock(st, p);
+  UNLOCK(st);
+  return r;
+}
+
+void
+ottery_st_rand_bernoulli_mask(struct ottery_state *st,
+                              uint64_t *out, size_t n, double p)
+{
+  if (ottery_st_rand_check_init(st))
+    return;
+  LOCK(st);
+  ottery_st_rand_bernoulli_mask_nolock(st, out, n, p);
+  UNLOCK(st);
+}
+
+/*
+ * Floating point.
+ *
+ * ottery_st_rand_double() returns k * 2^-53 for a uniformly chosen integer
+ * k in [0, 2^53).  Every result is a double, and every result is equally
+ * likely, so there's no bias at all; but below 0.5, there are doubles
+ * that we never return.  ottery_st_rand_double_full() can return any
+ * double in [0, 1): it acts as if it had picked a real number uniformly
+ * from [0, 1) and rounded it down to the next double.  It picks the
+ * exponent by flipping coins -- the result is in [0.5, 1) half the time,
+ * in [0.25, 0.5) a quarter of the time, and so on -- and then fills the
+ * significand with random bits.  The float functions work the same way,
+ * with 24 bits and 2^-24.
+ *
+ * All of this assumes that double and float are IEEE 754 binary64 and
+ * binary32, with the same byte order as the integers.
+ */
+
+/** Bit pattern of the double 1.0. */
+#define DOUBLE_ONE_BITS  UINT64_C(0x3ff0000000000000)
+/** Bit pattern of the double 2^-53. */
+#define DOUBLE_ULP_BITS  UINT64_C(0x3ca0000000000000)
+/** Bit pattern of the float 1.0. */
+#define FLOAT_ONE_BITS   UINT32_C(0x3f800000)
+/** Bit pattern of the float 2^-24. */
+#define FLOAT_ULP_BITS   UINT32_C(0x33800000)
+
+/**
+ * Return the top 53 bits of x, times 2^-53.
+ *
+ * We avoid converting the integer to floating point, since compilers can't
+ * vectorize that before AVX-512.  Instead, we put the top 52 bits into the
+ * significand of a number in [1, 2) and subtract 1, and then add 2^-53 if
+ * the 53rd bit is set.  Both steps are exact.
+ */
+static inline double
+ottery_u64_to_double_(uint64_t x)
+{
+  const uint64_t hi_bits = DOUBLE_ONE_BITS | (x >> 12);
+  const uint64_t lo_bits = ((x >> 11) & 1) * DOUBLE_ULP_BITS;
+  double hi, lo;
+  memcpy(&hi, &hi_bits, sizeof(hi));
+  memcpy(&lo, &lo_bits, sizeof(lo));
+  return (hi - 1.0) + lo;
+}
+
+/** As ottery_u64_to_double_(), but return the top 24 bits of x, times
+ * 2^-24. */
+static inline float
+ottery_u32_to_float_(uint32_t x)
+{
+  const uint32_t hi_bits = FLOAT_ONE_BITS | (x >> 9);
+  const uint32_t lo_bits = ((x >> 8) & 1) * FLOAT_ULP_BITS;
+  float hi, lo;
+  memcpy(&hi, &hi_bits, sizeof(hi));
+  memcpy(&lo, &lo_bits, sizeof(lo));
+  return (hi - 1.0f) + lo;
+}
+
+double
+ottery_st_rand_double_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0;
+  return ottery_u64_to_double_(ottery_st_rand_uint64_nocheck_(st));
+}
+
+float
+ottery_st_rand_float_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0f;
+  return ottery_u32_to_float_(ottery_st_rand_uint32_nocheck_(st));
+}
+
+double
+ottery_st_rand_double_full_nolock(struct ottery_state_nolock *st)
+{
+  uint64_t r, coins, bits;
+  int exponent = -1, n_coins = 12;
+  double d;
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0;
+  /* The low 12 bits of r are our first coin flips; the other 52 are the
+   * significand. */
+  r = ottery_st_rand_uint64_nocheck_(st);
+  coins = r & 0xfff;
+  while (coins == 0) {
+    exponent -= n_coins;
+    if (exponent < -1075)
+      return 0.0;
+    coins = ottery_st_rand_uint64_nocheck_(st);
+    n_coins = 64;
+  }
+  exponent -= __builtin_ctzll(coins);
+  /* The result is (2^52 + r>>12) * 2^(exponent-52). */
+  if (exponent >= -1022) {
+    bits = ((uint64_t)(exponent + 1023) << 52) | (r >> 12);
+  } else if (exponent >= -1074) {
+    /* Subnormal: shift the significand down, rounding toward zero. */
+    bits = ((UINT64_C(1) << 52) | (r >> 12)) >> (-1022 - exponent);
+  } else {
+    return 0.0;
+  }
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+float
+ottery_st_rand_float_full_nolock(struct ottery_state_nolock *st)
+{
+  uint32_t r, coins, bits;
+  int exponent = -1, n_coins = 9;
+  float f;
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0f;
+  /* The low 9 bits of r are our first coin flips; the other 23 are the
+   * significand. */
+  r = ottery_st_rand_uint32_nocheck_(st);
+  coins = r & 0x1ff;
+  while (coins == 0) {
+    exponent -= n_coins;
+    if (exponent < -150)
+      return 0.0f;
+    coins = ottery_st_rand_uint32_nocheck_(st);
+    n_coins = 32;
+  }
+  exponent -= __builtin_ctz(coins);
+  if (exponent >= -126) {
+    bits = ((uint32_t)(exponent + 127) << 23) | (r >> 9);
+  } else if (exponent >= -149) {
+    bits = ((UINT32_C(1) << 23) | (r >> 9)) >> (-126 - exponent);
+  } else {
+    return 0.0f;
+  }
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+/** Convert n random 64-bit values at out, in place, into doubles as
+ * ottery_st_rand_double() would. */
+static void
+ottery_u64_array_to_double_(double *out, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    uint64_t x;
+    memcpy(&x, &out[i], sizeof(x));
+    out[i] = ottery_u64_to_double_(x);
+  }
+}
+
+/** Convert n random 32-bit values at out, in place, into floats as
+ * ottery_st_rand_float() would. */
+static void
+ottery_u32_array_to_float_(float *out, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    uint32_t x;
+    memcpy(&x, &out[i], sizeof(x));
+    out[i] = ottery_u32_to_float_(x);
+  }
+}
+
+/*
+ * As with the integer arrays, we fill the array with random bytes in one
+ * bulk request.  Then we convert them in place after releasing the lock;
+ * the conversion loops have no branches, so they vectorize.
+ */
+void
+ottery_st_rand_double_array(struct ottery_state *st, double *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, double);
+  ottery_st_rand_bytes(st, out, n * sizeof(double));
+  ottery_u64_array_to_double_(out, n);
+}
+
+void
+ottery_st_rand_double_array_nolock(struct ottery_state_nolock *st,
+                                   double *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, double);
+  ottery_st_rand_bytes_nolock(st, out, n * sizeof(double));
+  ottery_u64_array_to_double_(out, n);
+}
+
+void
+ottery_st_rand_float_array(struct ottery_state *st, float *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, float);
+  ottery_st_rand_bytes(st, out, n * sizeof(float));
+  ottery_u32_array_to_float_(out, n);
+}
+
+void
+ottery_st_rand_float_array_nolock(struct ottery_state_nolock *st,
+                                  float *out, size_t n)
+{
+  CHECK_ARRAY_LEN(n, float);
+  ottery_st_rand_bytes_nolock(st, out, n * sizeof(float));
+  ottery_u32_array_to_float_(out, n);
+}
+
+double
+ottery_st_rand_double(struct ottery_state *st)
+{
+  double r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_double_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+float
+ottery_st_rand_float(struct ottery_state *st)
+{
+  float r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_float_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+double
+ottery_st_rand_double_full(struct ottery_state *st)
+{
+  double r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_double_full_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+float
+ottery_st_rand_float_full(struct ottery_state *st)
+{
+  float r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_float_full_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+/*
+ * Shuffling.
+ *
+ * For small arrays, we use the Fisher-Yates shuffle, with each bounded
+ * index chosen by Lemire's method from a batch of random words that we
+ * fetched in one request.
+ *
+ * Fisher-Yates touches the array at random, so once the array is much
+ * bigger than the cache, it spends nearly all its time waiting for
+ * memory.  For big arrays, we first scatter the elements into 256
+ * buckets, putting each element in a bucket chosen uniformly at random,
+ * and then shuffle each bucket separately, recursing if a bucket is still
+ * big.  Since the bucket choices are independent and each bucket ends up
+ * in uniformly random order, the result is a uniformly random permutation.
+ * The scatter pass only writes to 256 places at a time, and the buckets
+ * soon fit in cache.  It needs a temporary copy of the array, plus one
+ * byte per element; if we can't get the memory, we fall back to plain
+ * Fisher-Yates.
+ */
+
+/** Arrays of no more than this many bytes get a plain Fisher-Yates
+ * shuffle; bigger ones get split into buckets first. */
+#define SHUFFLE_CACHE_BYTES (256*1024)
+/** Number of buckets to split a big array into.  We choose each bucket
+ * with one random byte, so this must be 256. */
+#define SHUFFLE_N_BUCKETS 256
+/** Number of 32-bit words of randomness that we fetch at a time. */
+#define SHUFFLE_BATCH 256
+
+/** Source of random words for shuffling. */
+struct ottery_shuffle_rng_ {
+  /** The state to take random bytes from. */
+  struct ottery_state *st;
+  /** True iff st is a locked state. */
+  int locking;
+  /** Index of the next unused word in buf. */
+  unsigned pos;
+  /** Random words that we have fetched but not yet used. */
+  uint32_t buf[SHUFFLE_BATCH];
+};
+
+/** Fill out with n random bytes from r's state. */
+static void
+ottery_shuffle_rng_bytes_(struct ottery_shuffle_rng_ *r, void *out, size_t n)
+{
+  if (r->locking)
+    ottery_st_rand_bytes(r->st, out, n);
+  else
+    ottery_st_rand_bytes_nolock(r->st, out, n);
+}
+
+/** Return a random 32-bit value from r. */
+static inline uint32_t
+ottery_shuffle_rng_next_(struct ottery_shuffle_rng_ *r)
+{
+  if (UNLIKELY(r->pos == SHUFFLE_BATCH)) {
+    ottery_shuffle_rng_bytes_(r, r->buf, sizeof(r->buf));
+    r->pos = 0;
+  }
+  return r->buf[r->pos++];
+}
+
+/** Return a random value in [0, range), using Lemire's method as in
+ * ottery_st_rand_range64_nolock().  range must be at least 1. */
+static inline uint64_t
+ottery_shuffle_rng_below_(struct ottery_shuffle_rng_ *r, uint64_t range)
+{
+  if (range <= UINT32_MAX) {
+    const uint32_t range32 = (uint32_t)range;
+    uint64_t m = (uint64_t)ottery_shuffle_rng_next_(r) * range32;
+    if (UNLIKELY((uint32_t)m < range32)) {
+      const uint32_t threshold = (0u - range32) % range32;
+      while ((uint32_t)m < threshold)
+        m = (uint64_t)ottery_shuffle_rng_next_(r) * range32;
+    }
+    return m >> 32;
+  } else {
+    uint64_t hi, lo, x;
+    x = ((uint64_t)ottery_shuffle_rng_next_(r) << 32) |
+      ottery_shuffle_rng_next_(r);
+    hi = ottery_mul64_(x, range, &lo);
+    if (UNLIKELY(lo < range)) {
+      const uint64_t threshold = (0u - range) % range;
+      while (lo < threshold) {
+        x = ((uint64_t)ottery_shuffle_rng_next_(r) << 32) |
+          ottery_shuffle_rng_next_(r);
+        hi = ottery_mul64_(x, range, &lo);
+      }
+    }
+    return hi;
+  }
+}
+
+/** Copy one element of size bytes from src to dst.  The common sizes get
+ * a fixed-size copy that the compiler can inline. */
+static inline void
+ottery_copy_elt_(uint8_t *dst, const uint8_t *src, size_t size)
+{
+  switch (size) {
+    case 4: memcpy(dst, src, 4); break;
+    case 8: memcpy(dst, src, 8); break;
+    default: memcpy(dst, src, size); break;
+  }
+}
+
+/** Exchange the elements of size bytes at a and b. */
+static inline void
+ottery_swap_elts_(uint8_t *a, uint8_t *b, size_t size)
+{
+  uint8_t tmp[64];
+  switch (size) {
+    case 4:
+      memcpy(tmp, a, 4); memcpy(a, b, 4); memcpy(b, tmp, 4);
+      break;
+    case 8:
+      memcpy(tmp, a, 8); memcpy(a, b, 8); memcpy(b, tmp, 8);
+      break;
+    default:
+      while (size) {
+        size_t n = size < sizeof(tmp) ? size : sizeof(tmp);
+        memcpy(tmp, a, n); memcpy(a, b, n); memcpy(b, tmp, n);
+        a += n;
+        b += n;
+        size -= n;
+      }
+      break;
+  }
+}
+
+/** Shuffle the n elements of size bytes at base with Fisher-Yates. */
+static void
+ottery_shuffle_fy_(struct ottery_shuffle_rng_ *r, uint8_t *base, size_t n,
+                   size_t size)
+{
+  size_t i, j;
+  for (i = n - 1; i > 0; --i) {
+    j = (size_t)ottery_shuffle_rng_below_(r, (uint64_t)i + 1);
+    if (j != i)
+      ottery_swap_elts_(base + i * size, base + j * size, size);
+  }
+}
+
+/**
+ * Put each of n elements in a random bucket: set ids[i] to the bucket for
+ * element i, count[b] to the number of elements in bucket b, and offset[b]
+ * to the number of elements in all the buckets before b.
+ */
+static void
+ottery_shuffle_pick_buckets_(struct ottery_shuffle_rng_ *r, uint8_t *ids,
+                             size_t n, size_t *count, size_t *offset)
+{
+  size_t i, start;
+  ottery_shuffle_rng_bytes_(r, ids, n);
+  memset(count, 0, SHUFFLE_N_BUCKETS * sizeof(size_t));
+  for (i = 0; i < n; ++i)
+    ++count[ids[i]];
+  for (i = 0, start = 0; i < SHUFFLE_N_BUCKETS; ++i) {
+    offset[i] = start;
+    start += count[i];
+  }
+}
+
+/**
+ * Shuffle the n elements of size bytes at base.  If tmp and ids are not
+ * NULL, they must have room for n elements and n bytes respectively, and we
+ * use them to split big arrays into buckets.
+ */
+static void
+ottery_shuffle_impl_(struct ottery_shuffle_rng_ *r, uint8_t *base,
+                     uint8_t *tmp, uint8_t *ids, size_t n, size_t size)
+{
+  size_t count[SHUFFLE_N_BUCKETS], offset[SHUFFLE_N_BUCKETS];
+  size_t i, start;
+
+  if (n < 2)
+    return;
+  if (n * size <= SHUFFLE_CACHE_BYTES || !tmp) {
+    ottery_shuffle_fy_(r, base, n, size);
+    return;
+  }
+
+  ottery_shuffle_pick_buckets_(r, ids, n, count, offset);
+  for (i = 0; i < n; ++i)
+    ottery_copy_elt_(tmp + (offset[ids[i]]++) * size, base + i * size, size);
+  memcpy(base, tmp, n * size);
+
+  for (i = 0, start = 0; i < SHUFFLE_N_BUCKETS; ++i) {
+    ottery_shuffle_impl_(r, base + start * size, tmp + start * size,
+                         ids + start, count[i], size);
+    start += count[i];
+  }
+}
+
+/**
+ * Allocate scratch space for shuffling n elements of size bytes with
+ * ottery_shuffle_impl_(): set *tmp_out and *ids_out to the temporary array
+ * and the bucket ids, or to NULL if the array is small enough not to need
+ * them, or if we couldn't allocate them.
+ */
+static void
+ottery_shuffle_alloc_(size_t n, size_t size,
+                      uint8_t **tmp_out, uint8_t **ids_out)
+{
+  *tmp_out = *ids_out = NULL;
+  if (n > SIZE_MAX / size || n * size <= SHUFFLE_CACHE_BYTES)
+    return;
+  *tmp_out = malloc(n * size);
+  *ids_out = malloc(n);
+  if (!*tmp_out || !*ids_out) {
+    free(*tmp_out);
+    free(*ids_out);
+    *tmp_out = *ids_out = NULL;
+  }
+}
+
+/** Release and clear the scratch space from ottery_shuffle_alloc_() and the
+ * unused randomness in r. */
+static void
+ottery_shuffle_free_(struct ottery_shuffle_rng_ *r, size_t n, size_t size,
+                     uint8_t *tmp, uint8_t *ids)
+{
+  if (tmp) {
+    ottery_memclear_(tmp, n * size);
+    ottery_memclear_(ids, n);
+    free(tmp);
+    free(ids);
+  }
+  ottery_memclear_(r->buf, sizeof(r->buf));
+}
+
+/** Shared implementation for ottery_st_shuffle() and
+ * ottery_st_shuffle_nolock(). */
+static void
+ottery_st_shuffle_impl(struct ottery_state *st, void *base, size_t nmemb,
+                       size_t size, int locking)
+{
+  struct ottery_shuffle_rng_ r;
+  uint8_t *tmp, *ids;
+
+  if (nmemb < 2 || size == 0)
+    return;
+  r.st = st;
+  r.locking = locking;
+  r.pos = SHUFFLE_BATCH;
+  ottery_shuffle_alloc_(nmemb, size, &tmp, &ids);
+  ottery_shuffle_impl_(&r, base, tmp, ids, nmemb, size);
+  ottery_shuffle_free_(&r, nmemb, size, tmp, ids);
+}
+
+void
+ottery_st_shuffle(struct ottery_state *st, void *base, size_t nmemb,
+                  size_t size)
+{
+  ottery_st_shuffle_impl(st, base, nmemb, size, 1);
+}
+
+void
+ottery_st_shuffle_nolock(struct ottery_state_nolock *st, void *base,
+                         size_t nmemb, size_t size)
+{
+  ottery_st_shuffle_impl(st, base, nmemb, size, 0);
+}
+
+/**
+ * Shared implementation for ottery_st_rand_permutation() and
+ * ottery_st_rand_permutation_nolock().
+ *
+ * This is the same as filling out with 0..n-1 and shuffling it, except
+ * that for big arrays, we don't need to write the numbers in order first:
+ * we can scatter them straight into their buckets.
+ */
+static void
+ottery_st_rand_permutation_impl(struct ottery_state *st, uint32_t *out,
+                                size_t n, int locking)
+{
+  struct ottery_shuffle_rng_ r;
+  size_t count[SHUFFLE_N_BUCKETS], offset[SHUFFLE_N_BUCKETS];
+  uint8_t *tmp, *ids;
+  size_t i, start;
+
+  /* Past this, the numbers we write would wrap and repeat. */
+  if (UNLIKELY((uint64_t)n > (uint64_t)UINT32_MAX + 1)) {
+    ottery_fatal_error_(OTTERY_ERR_INVALID_ARGUMENT);
+    return;
+  }
+
+  r.st = st;
+  r.locking = locking;
+  r.pos = SHUFFLE_BATCH;
+  ottery_shuffle_alloc_(n, sizeof(uint32_t), &tmp, &ids);
+
+  if (!tmp) {
+    for (i = 0; i < n; ++i)
+      out[i] = (uint32_t)i;
+    ottery_shuffle_impl_(&r, (uint8_t *)out, NULL, NULL, n, sizeof(uint32_t));
+  } else {
+    ottery_shuffle_pick_buckets_(&r, ids, n, count, offset);
+    for (i = 0; i < n; ++i)
+      out[offset[ids[i]]++] = (uint32_t)i;
+    for (i = 0, start = 0; i < SHUFFLE_N_BUCKETS; ++i) {
+      ottery_shuffle_impl_(&r, (uint8_t *)(out + start),
+                           tmp + start * sizeof(uint32_t), ids + start,
+                           count[i], sizeof(uint32_t));
+      start += count[i];
+    }
+  }
+
+  ottery_shuffle_free_(&r, n, sizeof(uint32_t), tmp, ids);
+}
+
+void
+ottery_st_rand_permutation(struct ottery_state *st, uint32_t *out, size_t n)
+{
+  ottery_st_rand_permutation_impl(st, out, n, 1);
+}
+
+void
+ottery_st_rand_permutation_nolock(struct ottery_state_nolock *st,
+                                  uint32_t *out, size_t n)
+{
+  ottery_st_rand_permutation_impl(st, out, n, 0);
+}
+
+/*
+ * Normal and exponential variates, by the ziggurat method of Marsaglia and
+ * Tsang.
+ *
+ * We cover the density with a stack of layers of equal area (see
+ * etc/make_ziggurat_tables.py), pick a layer and a point in it with one
+ * 64-bit random value, and keep the point if it lies under the curve.
+ * Nearly always, the point lies in the part of the layer that is entirely
+ * under the curve, and all we need is one multiply and one compare.
+ * Otherwise, we're in the base layer's tail or in a wedge at the edge of a
+ * layer, and we need more random values and a call to exp() or log().
+ *
+ * For the normal ziggurat, the low 7 bits of the random value choose the
+ * layer, and bit 7 chooses the sign.  For the exponential ziggurat, the low
+ * 8 bits choose the layer.  The top 53 bits give the position in the layer.
+ */
+
+/** Number of random values to take at a time when filling an array. */
+#define ZIGGURAT_BATCH 256
+
+/** Return a random double in (0, 1]. */
+static inline double
+ottery_rand_double_nonzero_nocheck_(struct ottery_state_nolock *st)
+{
+  return 1.0 - ottery_u64_to_double_(ottery_st_rand_uint64_nocheck_(st));
+}
+
+/** Return a normal variate, starting with the random value r.  This is
+ * the whole ziggurat algorithm; callers that want speed should try the
+ * fast case themselves first. */
+static double
+ottery_zig_normal_slow_(struct ottery_state_nolock *st, uint64_t r)
+{
+  const double *x = ottery_zig_normal_x_, *f = ottery_zig_normal_f_;
+  for (;;) {
+    const unsigned i = r & (ZIGGURAT_NORMAL_N - 1);
+    const int neg = (r >> 7) & 1;
+    double z = ottery_u64_to_double_(r) * x[i];
+    if (z < x[i+1])
+      return neg ? -z : z;
+    if (i == 0) {
+      /* The tail, beyond R. */
+      double t, y;
+      do {
+        t = -log(ottery_rand_double_nonzero_nocheck_(st)) / ZIGGURAT_NORMAL_R;
+        y = -log(ottery_rand_double_nonzero_nocheck_(st));
+      } while (y + y < t * t);
+      z = ZIGGURAT_NORMAL_R + t;
+      return neg ? -z : z;
+    } else {
+      /* The wedge between x[i+1] and x[i]. */
+      const double u =
+        ottery_u64_to_double_(ottery_st_rand_uint64_nocheck_(st));
+      if (f[i] + u * (f[i+1] - f[i]) < exp(-0.5 * z * z))
+        return neg ? -z : z;
+    }
+    r = ottery_st_rand_uint64_nocheck_(st);
+  }
+}
+
+/** As ottery_zig_normal_slow_(), but for the exponential distribution. */
+static double
+ottery_zig_exp_slow_(struct ottery_state_nolock *st, uint64_t r)
+{
+  const double *x = ottery_zig_exp_x_, *f = ottery_zig_exp_f_;
+  for (;;) {
+    const unsigned i = r & (ZIGGURAT_EXP_N - 1);
+    const double z = ottery_u64_to_double_(r) * x[i];
+    if (z < x[i+1])
+      return z;
+    if (i == 0) {
+      /* The tail beyond R is just R plus another exponential variate. */
+      return ZIGGURAT_EXP_R - log(ottery_rand_double_nonzero_nocheck_(st));
+    } else {
+      const double u =
+        ottery_u64_to_double_(ottery_st_rand_uint64_nocheck_(st));
+      if (f[i] + u * (f[i+1] - f[i]) < exp(-z))
+        return z;
+    }
+    r = ottery_st_rand_uint64_nocheck_(st);
+  }
+}
+
+double
+ottery_st_rand_normal_nolock(struct ottery_state_nolock *st)
+{
+  uint64_t r;
+  unsigned i;
+  double z;
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0;
+  r = ottery_st_rand_uint64_nocheck_(st);
+  i = r & (ZIGGURAT_NORMAL_N - 1);
+  z = ottery_u64_to_double_(r) * ottery_zig_normal_x_[i];
+  if (LIKELY(z < ottery_zig_normal_x_[i+1]))
+    return ((r >> 7) & 1) ? -z : z;
+  return ottery_zig_normal_slow_(st, r);
+}
+
+double
+ottery_st_rand_exponential_nolock(struct ottery_state_nolock *st)
+{
+  uint64_t r;
+  unsigned i;
+  double z;
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0;
+  r = ottery_st_rand_uint64_nocheck_(st);
+  i = r & (ZIGGURAT_EXP_N - 1);
+  z = ottery_u64_to_double_(r) * ottery_zig_exp_x_[i];
+  if (LIKELY(z < ottery_zig_exp_x_[i+1]))
+    return z;
+  return ottery_zig_exp_slow_(st, r);
+}
+
+double
+ottery_st_rand_normal(struct ottery_state *st)
+{
+  double r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_normal_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+double
+ottery_st_rand_exponential(struct ottery_state *st)
+{
+  double r;
+  if (ottery_st_rand_check_init(st))
+    return 0;
+  LOCK(st);
+  r = ottery_st_rand_exponential_nolock(st);
+  UNLOCK(st);
+  return r;
+}
+
+/*
+ * To fill an array, we take a batch of random values in one bulk request,
+ * and make two passes over it.  The first pass tries the fast case for
+ * every value, and writes NAN wherever it fails; it has no branches, so it
+ * vectorizes.  (Keep the table index 64 bits wide: mixing integer widths
+ * stops GCC from vectorizing the loop.)  The second pass finishes the few
+ * values that failed, with the same random value that the first pass used,
+ * so the results are distributed exactly as from the one-at-a-time
+ * functions.
+ */
+
+/** Try the fast case of the normal ziggurat on each of the n values in
+ * raw; write the results, or NAN where the fast case fails, to out. */
+static void
+ottery_zig_normal_fast_array_(const uint64_t *raw, double *out, size_t n)
+{
+  size_t k;
+  for (k = 0; k < n; ++k) {
+    const uint64_t r = raw[k];
+    const uint64_t i = r & (ZIGGURAT_NORMAL_N - 1);
+    const double z = ottery_u64_to_double_(r) * ottery_zig_normal_x_[i];
+    const double s = ((r >> 7) & 1) ? -z : z;
+    out[k] = (z < ottery_zig_normal_x_[i+1]) ? s : NAN;
+  }
+}
+
+/** As ottery_zig_normal_fast_array_(), for the exponential ziggurat. */
+static void
+ottery_zig_exp_fast_array_(const uint64_t *raw, double *out, size_t n)
+{
+  size_t k;
+  for (k = 0; k < n; ++k) {
+    const uint64_t r = raw[k];
+    const uint64_t i = r & (ZIGGURAT_EXP_N - 1);
+    const double z = ottery_u64_to_double_(r) * ottery_zig_exp_x_[i];
+    out[k] = (z < ottery_zig_exp_x_[i+1]) ? z : NAN;
+  }
+}
+
+/**
+ * Fill out with n variates from a ziggurat.
+ *
+ * @param st The state to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param exponential True for the exponential distribution, false for the
+ *   normal distribution.
+ * @param locking True iff st is a locked state.
+ */
+static void
+ottery_st_rand_zig_array_impl(struct ottery_state *st, double *out, size_t n,
+                              int exponential, int locking)
+{
+  uint64_t raw[ZIGGURAT_BATCH];
+  if (locking) {
+    if (ottery_st_rand_check_init(st))
+      return;
+  } else {
+    if (ottery_st_rand_check_nolock(st))
+      return;
+  }
+
+  while (n) {
+    const size_t m = n < ZIGGURAT_BATCH ? n : ZIGGURAT_BATCH;
+    size_t k;
+    if (locking)
+      ottery_st_rand_bytes(st, raw, m * sizeof(uint64_t));
+    else
+      ottery_st_rand_bytes_nolock(st, raw, m * sizeof(uint64_t));
+
+    if (exponential)
+      ottery_zig_exp_fast_array_(raw, out, m);
+    else
+      ottery_zig_normal_fast_array_(raw, out, m);
+
+    if (locking)
+      LOCK(st);
+    for (k = 0; k < m; ++k) {
+      if (UNLIKELY(isnan(out[k])))
+        out[k] = exponential ? ottery_zig_exp_slow_(st, raw[k]) :
+          ottery_zig_normal_slow_(st, raw[k]);
+    }
+    if (locking)
+      UNLOCK(st);
+
+    out += m;
+    n -= m;
+  }
+  ottery_memclear_(raw, sizeof(raw));
+}
+
+void
+ottery_st_rand_normal_array(struct ottery_state *st, double *out, size_t n)
+{
+  ottery_st_rand_zig_array_impl(st, out, n, 0, 1);
+}
+
+void
+ottery_st_rand_normal_array_nolock(struct ottery_state_nolock *st,
+                                   double *out, size_t n)
+{
+  ottery_st_rand_zig_array_impl(st, out, n, 0, 0);
+}
+
+void
+ottery_st_rand_exponential_array(struct ottery_state *st,
+                                 double *out, size_t n)
+{
+  ottery_st_rand_zig_array_impl(st, out, n, 1, 1);
+}
+
+void
+ottery_st_rand_exponential_array_nolock(struct ottery_state_nolock *st,
+                                        double *out, size_t n)
+{
+  ottery_st_rand_zig_array_impl(st, out, n, 1, 0);
+}
@@ -56,6 +56,26 @@ uint32_t ottery_rand_uint32(void);
  *   chosen uniformly.
  */
 uint64_t ottery_rand_uint64(void);
+/**
+ * Fill an array with random numbers of type uint32_t.
+ *
+ * This is much faster than calling ottery_rand_uint32() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint32_t would not fit in memory.
+ */
+void ottery_rand_uint32_array(uint32_t *out, size_t n);
+/**
+ * Fill an array with random numbers of type uint64_t.
+ *
+ * This is much faster than calling ottery_rand_uint64() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint64_t would not fit in memory.
+ */
+void ottery_rand_uint64_array(uint64_t *out, size_t n);
 /**
  * Generate a random number of type unsigned in a given range.
  *
@@ -72,6 +92,171 @@ unsigned ottery_rand_range(unsigned top);
  *   chosen uniformly.
  */
 uint64_t ottery_rand_range64(uint64_t top);
+/**
+ * Fill an array with random numbers of type uint32_t in a given range.
+ *
+ * This is much faster than calling ottery_rand_range() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint32_t would not fit in memory.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_rand_range_array(uint32_t *out, size_t n, uint32_t top);
+/**
+ * Choose an index at random, with the weights in an alias table.
+ *
+ * @param tbl A table from ottery_alias_table_new().
+ * @return An index less than the number of weights in tbl.
+ */
+uint32_t ottery_rand_weighted(const struct ottery_alias_table *tbl);
+/**
+ * Fill an array with indices chosen at random, as from
+ * ottery_rand_weighted().
+ *
+ * This is much faster than calling ottery_rand_weighted() n times.
+ *
+ * @param tbl A table from ottery_alias_table_new().
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_weighted_array(const struct ottery_alias_table *tbl,
+                                uint32_t *out, size_t n);
+/**
+ * Generate a single random bit.
+ *
+ * This is much cheaper than taking the low bit of ottery_rand_unsigned().
+ *
+ * @return 0 or 1, each with probability 1/2.
+ */
+int ottery_rand_bit(void);
+/**
+ * Return 1 with a given probability, and 0 otherwise.
+ *
+ * @param p The probability of returning 1.  Values of 0 or less (or NaN)
+ *   always give 0; values of 1 or more always give 1.
+ * @return 1 with probability p; 0 otherwise.
+ */
+int ottery_rand_bernoulli(double p);
+/**
+ * Fill an array of 64-bit words with random bits, each of which is set
+ * with a given probability.
+ *
+ * See ottery_st_rand_bernoulli_mask() for details.
+ *
+ * @param out The array to fill.
+ * @param n The number of 64-bit words to write.  It is a fatal error if n
+ *   such words would not fit in memory.
+ * @param p The probability that each bit is set.
+ */
+void ottery_rand_bernoulli_mask(uint64_t *out, size_t n, double p);
+/**
+ * Generate a random double in [0, 1).
+ *
+ * The result is a multiple of 2^-53, chosen uniformly.
+ *
+ * @return A random number at least 0 and less than 1.
+ */
+double ottery_rand_double(void);
+/**
+ * Generate a random float in [0, 1).
+ *
+ * The result is a multiple of 2^-24, chosen uniformly.
+ *
+ * @return A random number at least 0 and less than 1.
+ */
+float ottery_rand_float(void);
+/**
+ * Generate a random double in [0, 1), with full precision.
+ *
+ * Unlike ottery_rand_double(), this can return any double in [0, 1): the
+ * result is a real number chosen uniformly from [0, 1), rounded down to
+ * the nearest double.  It is a little slower.
+ *
+ * @return A random number at least 0 and less than 1.
+ */
+double ottery_rand_double_full(void);
+/**
+ * Generate a random float in [0, 1), with full precision.
+ *
+ * As ottery_rand_double_full(), but for floats.
+ *
+ * @return A random number at least 0 and less than 1.
+ */
+float ottery_rand_float_full(void);
+/**
+ * Fill an array with random doubles in [0, 1), as from
+ * ottery_rand_double().
+ *
+ * This is much faster than calling ottery_rand_double() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of double would not fit in memory.
+ */
+void ottery_rand_double_array(double *out, size_t n);
+/**
+ * Fill an array with random floats in [0, 1), as from ottery_rand_float().
+ *
+ * This is much faster than calling ottery_rand_float() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of float would not fit in memory.
+ */
+void ottery_rand_float_array(float *out, size_t n);
+/**
+ * Put an array into random order.
+ *
+ * Every order is equally likely.  See ottery_st_shuffle() for details.
+ *
+ * @param base The array to shuffle.
+ * @param nmemb The number of elements in the array.
+ * @param size The size of each element, in bytes.
+ */
+void ottery_shuffle(void *base, size_t nmemb, size_t size);
+/**
+ * Fill an array with a random permutation of the numbers 0 through n-1.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.  Must be no more than
+ *   UINT32_MAX + 1; a bigger n is a fatal error.
+ */
+void ottery_rand_permutation(uint32_t *out, size_t n);
+/**
+ * Generate a random number from the standard normal distribution, with
+ * mean 0 and standard deviation 1.
+ *
+ * @return A normally distributed random number.
+ */
+double ottery_rand_normal(void);
+/**
+ * Generate a random number from the exponential distribution with rate 1
+ * (and so with mean 1).
+ *
+ * @return An exponentially distributed random number, at least 0.
+ */
+double ottery_rand_exponential(void);
+/**
+ * Fill an array with random numbers from the standard normal distribution,
+ * as from ottery_rand_normal().
+ *
+ * This is much faster than calling ottery_rand_normal() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_normal_array(double *out, size_t n);
+/**
+ * Fill an array with random numbers from the exponential distribution, as
+ * from ottery_rand_exponential().
+ *
+ * This is much faster than calling ottery_rand_exponential() n times.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_exponential_array(double *out, size_t n);
 
 /**
  * Initialize the libottery global state.
@@ -111,6 +296,20 @@ int ottery_init(const struct ottery_config *cfg);
  */
 int ottery_add_seed(const uint8_t *seed, size_t n);
 
+/**
+ * Reseed the libottery global state from the operating system, without
+ * waiting for the operating system.
+ *
+ * The read from the entropy source happens on a helper thread, and the
+ * result is mixed in the next time the state generates a block of output;
+ * see ottery_st_request_reseed_async().  In the per-thread global state
+ * mode, this reseeds the calling thread's state.
+ *
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes if we
+ *   couldn't start the helper thread.
+ */
+int ottery_request_reseed_async(void);
+
 /**
  * Destroy the libottery global state and release any resources that it might
  * hold.
@@ -136,6 +335,16 @@ void ottery_wipe(void);
  */
 void ottery_prevent_backtracking(void);
 
+/**
+ * Generate the next block of output ahead of time, if the global state was
+ * configured with ottery_config_enable_prefill().
+ *
+ * In the per-thread global state mode, this prefills the calling thread's
+ * state.  Otherwise, it prefills the shared state, and it's fine to call
+ * it from a helper thread.
+ */
+void ottery_prefill(void);
+
 #ifdef __cplusplus
 }
 #endif
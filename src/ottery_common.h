@@ -23,6 +23,7 @@
 /** @file */
 
 struct ottery_config;
+struct ottery_alias_table;
 
 /* Error codes */
 
@@ -51,6 +52,8 @@ struct ottery_config;
 /** FATAL ERROR: An ottery_st function other than ottery_st_init() was
  * called on and uninitialized state. */
 #define OTTERY_ERR_STATE_INIT            0x1000
+/** FATAL ERROR: Somebody tried to read past the end of an ottery_stream. */
+#define OTTERY_ERR_STREAM_EXHAUSTED      0x1001
 /** FLAG; FATAL ERROR: The error occurred while initializing the global
  * state during the first call to an ottery_rand_* function. */
 #define OTTERY_ERR_FLAG_GLOBAL_PRNG_INIT 0x2000
@@ -184,6 +187,122 @@ void ottery_config_set_urandom_device(struct ottery_config *cfg,
 void ottery_config_set_urandom_fd(struct ottery_config *cfg,
                                   int fd);
 
+/**
+ * Keep the urandom device open between reseeds.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to
+ * ottery_st_init() or ottery_init().
+ *
+ * By default, libottery opens the urandom device, checks that it really is
+ * a device, reads from it, and closes it, every time it needs entropy.  If
+ * this option is set, each state keeps the device open once it has been
+ * opened and checked, until the state is wiped.  That saves a few system
+ * calls on every reseed, and lets a program that has opened the device
+ * once keep reseeding after it chroots somewhere without /dev.
+ *
+ * This has no effect when the getrandom() entropy source is available and
+ * working, or when ottery_config_set_urandom_fd() was used.
+ *
+ * If you use this option, you MUST NOT close file descriptors that you
+ * did not open, and you must call ottery_wipe() or ottery_st_wipe() to
+ * release the descriptor.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param keep_open True if we should keep the urandom device open.
+ */
+void ottery_config_keep_urandom_open(struct ottery_config *cfg,
+                                     int keep_open);
+
+/**
+ * Keep a spare block of output ready in every state.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to
+ * ottery_st_init() or ottery_init().
+ *
+ * Most requests are answered from a buffered block of PRF output, but every
+ * time that block runs out, the unlucky caller has to wait for the PRF to
+ * generate the next one.  With this option, each state allocates room for
+ * a second block, and ottery_st_prefill(), ottery_st_prefill_nolock(), or
+ * ottery_prefill() generate the next block into it ahead of time.  Call
+ * them from an idle-time hook, or (for a locked state) from a helper
+ * thread; the next caller to run out of buffered output then just copies
+ * the spare block into place.  The output is exactly the same as it would
+ * have been without prefilling.
+ *
+ * This costs one extra block of memory per state (up to 1k), allocated
+ * when the state is initialized and released when it is wiped.  Without
+ * this option, the prefill functions do nothing.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param enable True if states should keep a spare block.
+ */
+void ottery_config_enable_prefill(struct ottery_config *cfg, int enable);
+
+/**
+ * Limit how much PRF output a state buffers at a time.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to
+ * ottery_st_init() or ottery_init().
+ *
+ * Every state holds one block of PRF output, and hands it out a little at a
+ * time.  The fastest PRF implementations use big blocks (up to 1k), which
+ * is good for throughput, but a program that takes a few bytes at a time
+ * between doing other work will find that block crowding its own data out
+ * of the L1 cache.  This option makes libottery use the best implementation
+ * of the chosen PRF whose blocks are no bigger than len bytes.  The output
+ * is just as secure, but it is not the same output: a different block size
+ * gives a different stream.
+ *
+ * The smallest blocks on offer are 256 bytes, from a portable
+ * implementation that is slower per byte but refills much sooner.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param len The largest block size to use, in bytes, or 0 for no limit.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if no PRF that
+ *   this CPU supports has blocks that small.  If you force a PRF with
+ *   ottery_config_force_implementation() that has no implementation with
+ *   small enough blocks, ottery_st_init() will fail with
+ *   OTTERY_ERR_INVALID_ARGUMENT.
+ */
+int ottery_config_set_max_buffer_len(struct ottery_config *cfg, size_t len);
+
+/**
+ * Make states reseed themselves from the operating system every so often.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to
+ * ottery_st_init() or ottery_init().
+ *
+ * Ordinarily, a state takes entropy from the OS when it is created, after
+ * a fork, and when you call ottery_st_add_seed() with a NULL seed.  With
+ * this option, it also does so once it has generated about n_bytes bytes
+ * of output, or once n_seconds seconds have passed since it was last
+ * seeded, whichever comes first.  That way, somebody who learns the state
+ * of the PRF at one point can't keep predicting its output forever.
+ *
+ * The reseed happens in whichever call to the state notices that it is
+ * due.  For a locked state, that call reads from the entropy source
+ * without holding the lock, and only takes the lock long enough to mix
+ * the result into the key; other threads keep getting output meanwhile.
+ * If the entropy source fails, we keep using the old key, and try again
+ * after the next block of output.
+ *
+ * Output is counted in whole blocks, and time is checked only when a
+ * block is generated, so a state that isn't used doesn't reseed until it
+ * is used again.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param n_bytes Reseed after generating this many bytes, or 0 for no
+ *   limit.
+ * @param n_seconds Reseed after this many seconds, or 0 for no limit.
+ */
+void ottery_config_set_reseed_interval(struct ottery_config *cfg,
+                                       uint64_t n_bytes,
+                                       unsigned n_seconds);
+
 struct sockaddr;
 
 /**
@@ -196,6 +315,9 @@ struct sockaddr;
  * ottery_config_init(), and before passing that structure to
  * ottery_st_init() or ottery_init().
  *
+ * Each state keeps its connection to the daemon open between reseeds,
+ * until the state is wiped; if the daemon goes away, we reconnect.
+ *
  * TODO: This is not implemented for Windows yet.
  *
  * @param cfg The configuration structure to configure.
@@ -225,8 +347,86 @@ void ottery_config_set_egd_socket(struct ottery_config *cfg,
 /** Some local server obeying the EGD protocol.  Has no effect unless
  * ottery_config_set_egd_socket was called. */
 #define OTTERY_ENTROPY_SRC_EGD            0x0080000
+/** The getrandom() system call, on Linux and some other unix-like
+ * systems.  Not used if a urandom device or fd was configured. */
+#define OTTERY_ENTROPY_SRC_GETRANDOM      0x0100000
+/** The Intel RDSEED instruction.  This is much slower than RDRAND, so we
+ * only use it if RDRAND fails; disable RDRAND if you would rather seed from
+ * RDSEED. */
+#define OTTERY_ENTROPY_SRC_RDSEED         0x0200000
+/** Every source added with ottery_config_add_entropy_source(). */
+#define OTTERY_ENTROPY_SRC_USER           0x0400000
 /** @} */
 
+/**
+ * @brief Flags for external entropy sources.
+ *
+ * @{ */
+/** An RNG that probably provides strong entropy. */
+#define OTTERY_ENTROPY_FL_STRONG          0x000001
+/** An RNG that runs very quickly. */
+#define OTTERY_ENTROPY_FL_FAST            0x000002
+/** @} */
+
+/**
+ * @brief Identifying external entropy domains.
+ *
+ * We only take entropy from the first working source in each domain.
+ *
+ * @{ */
+/** An RNG provided by the operating system. */
+#define OTTERY_ENTROPY_DOM_OS             0x000100
+/** An RNG provided by the CPU. */
+#define OTTERY_ENTROPY_DOM_CPU            0x000200
+/** An EGD-style entropy source */
+#define OTTERY_ENTROPY_DOM_EGD            0x000400
+/** A domain that none of libottery's own sources use.  So do 0x1000,
+ * 0x2000, 0x4000, and 0x8000. */
+#define OTTERY_ENTROPY_DOM_USER           0x000800
+/** @} */
+
+/**
+ * Add an entropy source of your own.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to
+ * ottery_st_init() or ottery_init().
+ *
+ * Whenever libottery wants entropy, it calls fn(arg, out, n), which should
+ * fill all n bytes of out with random bytes and return 0, or return
+ * nonzero on failure.  The function may be called from any thread that
+ * uses a state with this configuration, from several at once, and from
+ * the helper thread of ottery_st_request_reseed_async().
+ *
+ * Sources you add are treated just like libottery's own: we take entropy
+ * from the first working source in each domain, and we fail unless at
+ * least one of the sources we took entropy from is strong.  Your sources
+ * come before ours, in the order you added them.  So if you add a source
+ * in OTTERY_ENTROPY_DOM_OS, we use it instead of the operating system's
+ * RNG while it works; if you add one in a domain of its own, like
+ * OTTERY_ENTROPY_DOM_USER, we use it as well as the others.
+ *
+ * You can disable your sources, or mark them weak, with
+ * OTTERY_ENTROPY_SRC_USER.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param fn The function to call for entropy.
+ * @param arg The first argument to pass to fn.
+ * @param flags Zero or more OTTERY_ENTROPY_FL_* flags: set
+ *   OTTERY_ENTROPY_FL_STRONG if the source is good enough to seed from on
+ *   its own.
+ * @param domain One OTTERY_ENTROPY_DOM_* value.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if fn is NULL,
+ *   the flags or domain are not valid, or the configuration already has
+ *   four sources of your own.
+ */
+int ottery_config_add_entropy_source(struct ottery_config *cfg,
+                                     int (*fn)(void *arg, uint8_t *out,
+                                               size_t n),
+                                     void *arg,
+                                     uint32_t flags,
+                                     uint32_t domain);
+
 /**
  * Disable the use of one or more entropy sources.
  *
@@ -268,6 +468,57 @@ void ottery_config_disable_entropy_sources(struct ottery_config *cfg,
 void ottery_config_mark_entropy_sources_weak(struct ottery_config *cfg,
                                              uint32_t weak_source);
 
+/**
+ * @name Ways for the global API to use its states
+ *
+ * @see ottery_config_set_global_state_mode()
+ *
+ * @{ */
+/** Every thread shares one locked state.  This is the default. */
+#define OTTERY_GLOBAL_STATE_SHARED     0
+/** Each thread lazily creates its own unlocked state the first time it
+ * calls an ottery_rand_* function, and wipes it when the thread exits. */
+#define OTTERY_GLOBAL_STATE_PER_THREAD 1
+/** There is one locked state for each CPU, and each thread uses the state
+ * for the CPU that it is running on. */
+#define OTTERY_GLOBAL_STATE_PER_CPU    2
+/** @} */
+
+/**
+ * Choose how the global ottery_rand_* functions map onto PRNG states.
+ *
+ * By default, every thread that uses the global API shares a single state,
+ * protected by a lock.  In a heavily threaded program, that lock can get
+ * busy.  With OTTERY_GLOBAL_STATE_PER_THREAD, each thread gets its own
+ * ottery_state_nolock instead, seeded independently from the OS, and the
+ * ottery_rand_* functions take no lock at all.  The cost is one state
+ * (a few kilobytes) and one round of seeding per thread.
+ *
+ * If your program creates lots of short-lived threads, that cost adds up;
+ * use OTTERY_GLOBAL_STATE_PER_CPU instead.  Then ottery_init() creates one
+ * state per CPU, all keyed from a single round of seeding, and each call
+ * uses the state for the CPU that the caller is running on.  Those states
+ * still have locks, since a thread can move to another CPU at any moment,
+ * but the locks are seldom contended.
+ *
+ * In per-thread mode, ottery_add_seed() and ottery_prevent_backtracking()
+ * affect only the calling thread's state; in per-CPU mode, they affect
+ * every CPU's state.  After ottery_wipe() or another call to ottery_init(),
+ * every thread's state is reinitialized the next time that thread uses it.
+ *
+ * This setting only matters for ottery_init(); ottery_st_init() ignores it.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to ottery_init().
+ *
+ * @param cfg The configuration structure to configure.
+ * @param mode One of the OTTERY_GLOBAL_STATE_* values.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if the mode is
+ *    unknown or not supported on this platform.
+ */
+int ottery_config_set_global_state_mode(struct ottery_config *cfg,
+                                        int mode);
+
 /** Size reserved for struct ottery_config */
 #define OTTERY_CONFIG_DUMMY_SIZE_ 1024
 
@@ -300,6 +551,37 @@ struct ottery_config {
  */
 size_t ottery_get_sizeof_config(void);
 
+/* Weighted choice. */
+
+/**
+ * Build a table for choosing indices at random with given weights.
+ *
+ * With the table, ottery_st_rand_weighted() and friends return each index i
+ * in [0, n) with probability weights[i] / (the sum of the weights), in
+ * constant time no matter how big n is.  Building the table takes O(n)
+ * time.  A table is never modified after it is built, so any number of
+ * threads can draw from it at once.
+ *
+ * The probabilities are rounded to multiples of 2^-32 / n.
+ *
+ * @param out On success, set to point to a new table.  On failure, set to
+ *   NULL.
+ * @param weights An array of n weights.  Every weight must be finite and
+ *   non-negative, and at least one must be positive.
+ * @param n The number of weights.  Must be between 1 and UINT32_MAX.
+ * @return Zero on success, OTTERY_ERR_INVALID_ARGUMENT if the weights are
+ *   unusable, or OTTERY_ERR_INTERNAL if we couldn't allocate memory.
+ */
+int ottery_alias_table_new(struct ottery_alias_table **out,
+                           const double *weights, size_t n);
+
+/**
+ * Release a table returned by ottery_alias_table_new().
+ *
+ * @param tbl The table to free.  May be NULL.
+ */
+void ottery_alias_table_free(struct ottery_alias_table *tbl);
+
 /**
  * @name libottery build flag
  *
@@ -33,20 +33,22 @@
 #if defined(X86)
 #ifdef _MSC_VER
 #include <intrin.h>
-#define cpuid(a,b) __cpuid((b), (a))
+#include <immintrin.h>
+#define cpuid(a,b,c) __cpuidex((c), (a), (b))
+#define xgetbv0() ((uint64_t)_xgetbv(0))
 #else
 static void
-cpuid(int index, int regs[4])
+cpuid(int index, int subindex, int regs[4])
 {
   unsigned int eax, ebx, ecx, edx;
 #ifdef X86_64
   __asm("cpuid" : "=a"(eax), "=b" (ebx), "=c"(ecx), "=d"(edx)
-        : "0"(index));
+        : "0"(index), "2"(subindex));
 #else
   __asm volatile(
                "xchgl %%ebx, %1; cpuid; xchgl %%ebx, %1"
                : "=a" (eax), "=r" (ebx), "=c" (ecx), "=d" (edx)
-               : "0" (index)
+               : "0" (index), "2" (subindex)
                : "cc" );
 #endif
 
@@ -55,7 +57,25 @@ cpuid(int index, int regs[4])
   regs[2] = ecx;
   regs[3] = edx;
 }
+
+/** Return the value of the XCR0 register, which tells us which register
+ * files the operating system has agreed to save and restore for us.  Only
+ * call this if cpuid says that OSXSAVE is set. */
+static uint64_t
+xgetbv0(void)
+{
+  uint32_t eax, edx;
+  /* This is "xgetbv", hand-encoded for the benefit of old assemblers. */
+  __asm volatile(".byte 0x0f, 0x01, 0xd0"
+                 : "=a"(eax), "=d"(edx) : "c"(0));
+  return (((uint64_t)edx) << 32) | eax;
+}
 #endif
+
+/** XCR0 bits for the SSE and AVX register state. */
+#define XCR0_SSE_AVX 0x06
+/** XCR0 bits for the AVX-512 opmask and zmm register state. */
+#define XCR0_AVX512  0xe0
 #endif
 
 static uint32_t disabled_cpu_capabilities = 0;
@@ -72,7 +92,11 @@ ottery_get_cpu_capabilities_(void)
 #ifdef X86
   uint32_t cap = 0;
   int res[4];
-  cpuid(1, res);
+  int max_index;
+  int os_saves_avx = 0, os_saves_avx512 = 0;
+  cpuid(0, 0, res);
+  max_index = res[0];
+  cpuid(1, 0, res);
   if (res[3] & (1<<26))
     cap |= OTTERY_CPUCAP_SIMD;
   if (res[2] & (1<<9))
@@ -81,6 +105,23 @@ ottery_get_cpu_capabilities_(void)
     cap |= OTTERY_CPUCAP_AES;
   if (res[2] & (1<<30))
     cap |= OTTERY_CPUCAP_RAND;
+  /* The CPU might support AVX while the OS doesn't save the upper halves of
+   * the vector registers on a context switch; check OSXSAVE and XCR0. */
+  if ((res[2] & (1<<27)) && (res[2] & (1<<28))) {
+    const uint64_t xcr0 = xgetbv0();
+    os_saves_avx = ((xcr0 & XCR0_SSE_AVX) == XCR0_SSE_AVX);
+    os_saves_avx512 = os_saves_avx &&
+      ((xcr0 & XCR0_AVX512) == XCR0_AVX512);
+  }
+  if (max_index >= 7) {
+    cpuid(7, 0, res);
+    if (os_saves_avx && (res[1] & (1<<5)))
+      cap |= OTTERY_CPUCAP_AVX2;
+    if (os_saves_avx512 && (res[1] & (1<<16)))
+      cap |= OTTERY_CPUCAP_AVX512;
+    if (res[1] & (1<<18))
+      cap |= OTTERY_CPUCAP_RDSEED;
+  }
 #else
   uint32_t cap = OTTERY_CPUCAP_SIMD;
 #endif
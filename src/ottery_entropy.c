@@ -24,6 +24,7 @@
 #define FL(x)  OTTERY_ENTROPY_FL_  ## x
 
 #include "ottery_entropy_cryptgenrandom.c"
+#include "ottery_entropy_getrandom.c"
 #include "ottery_entropy_urandom.c"
 #include "ottery_entropy_rdrand.c"
 #include "ottery_entropy_egd.c"
@@ -38,22 +39,50 @@ static struct ottery_randbytes_source {
 #ifdef ENTROPY_SOURCE_CRYPTGENRANDOM
   ENTROPY_SOURCE_CRYPTGENRANDOM,
 #endif
+#ifdef ENTROPY_SOURCE_GETRANDOM
+  ENTROPY_SOURCE_GETRANDOM,
+#endif
 #ifdef ENTROPY_SOURCE_URANDOM
   ENTROPY_SOURCE_URANDOM,
 #endif
 #ifdef ENTROPY_SOURCE_EGD
   ENTROPY_SOURCE_EGD,
 #endif
+/* RDRAND and RDSEED are both in the CPU domain, so we only use RDSEED if
+ * RDRAND fails or is disabled. */
 #ifdef ENTROPY_SOURCE_RDRAND
   ENTROPY_SOURCE_RDRAND,
+#endif
+#ifdef ENTROPY_SOURCE_RDSEED
+  ENTROPY_SOURCE_RDSEED,
 #endif
   { NULL, 0 }
 };
 
+void
+ottery_release_entropy_state_(struct ottery_entropy_state *state)
+{
+#ifndef _WIN32
+  if (state->urandom_fd_is_cached) {
+    close(state->urandom_cached_fd);
+    state->urandom_cached_fd = -1;
+    state->urandom_fd_is_cached = 0;
+  }
+  if (state->egd_fd_is_cached) {
+    close(state->egd_cached_fd);
+    state->egd_cached_fd = -1;
+    state->egd_fd_is_cached = 0;
+  }
+#else
+  (void) state;
+#endif
+}
+
 size_t
 ottery_get_entropy_bufsize_(size_t n)
 {
-  return n * (sizeof(RAND_SOURCES)/sizeof(RAND_SOURCES[0]) - 1);
+  return n * (sizeof(RAND_SOURCES)/sizeof(RAND_SOURCES[0]) - 1 +
+              OTTERY_MAX_USER_ENTROPY_SOURCES);
 }
 
 int
@@ -64,18 +93,22 @@ ottery_get_entropy_(const struct ottery_entropy_config *config,
                      uint32_t *flags_out)
 {
   ssize_t err = OTTERY_ERR_INIT_STRONG_RNG, last_err = 0;
-  int i;
+  unsigned i;
   uint32_t got = 0;
   uint8_t *next;
   const uint32_t disabled_sources = config ? config->disabled_sources : 0;
+  const unsigned n_user = config ? config->n_user_sources : 0;
 
   memset(bytes, 0, *buflen);
   next = bytes;
 
   *flags_out = 0;
 
-  for (i=0; RAND_SOURCES[i].fn; ++i) {
-    uint32_t flags = RAND_SOURCES[i].flags;
+  /* The user's sources come first, then the ones in RAND_SOURCES. */
+  for (i=0; i < n_user || RAND_SOURCES[i - n_user].fn; ++i) {
+    const struct ottery_user_entropy_source_ *user =
+      i < n_user ? &config->user_sources[i] : NULL;
+    uint32_t flags = user ? user->flags : RAND_SOURCES[i - n_user].flags;
     /* Don't use a disabled source. */
     if (0 != (flags & disabled_sources))
       continue;
@@ -88,9 +121,13 @@ ottery_get_entropy_(const struct ottery_entropy_config *config,
     /* If we can't write these bytes, don't try. */
     if (next + n > bytes + *buflen)
       break;
-    err = RAND_SOURCES[i].fn(config, state, next, n);
+    if (user) {
+      /* We don't know what the user's error codes mean. */
+      err = user->fn(user->arg, next, n) ? OTTERY_ERR_ACCESS_STRONG_RNG : 0;
+    } else {
+      err = RAND_SOURCES[i - n_user].fn(config, state, next, n);
+    }
     if (err == 0) {
-      uint32_t flags = RAND_SOURCES[i].flags;
       if (config && (flags & config->weak_sources))
         flags &= ~OTTERY_ENTROPY_FL_STRONG;
 
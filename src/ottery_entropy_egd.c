@@ -16,57 +16,131 @@
 /* TODO: Support win32. */
 #include <sys/socket.h>
 
+#ifdef MSG_NOSIGNAL
+/* If the daemon has gone away, we want an error, not a SIGPIPE. */
+#define EGD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define EGD_SEND_FLAGS 0
+#endif
+
+/** The most bytes that one EGD request can ask for. */
+#define EGD_MAX_REQUEST 255
+
+/** Open a connection to the EGD socket in cfg.  Return the socket on
+ * success, or -1 on failure. */
+static int
+ottery_egd_connect_(const struct ottery_entropy_config *cfg)
+{
+  int sock, type = SOCK_STREAM;
+#ifdef SOCK_CLOEXEC
+  /* We might keep this socket for a long time; don't leak it into
+   * exec()ed programs. */
+  type |= SOCK_CLOEXEC;
+#endif
+
+  sock = socket(cfg->egd_sockaddr->sa_family, type, 0);
+  if (sock < 0)
+    return -1;
+  if (connect(sock, cfg->egd_sockaddr, cfg->egd_socklen) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/** Fill outlen bytes of out from the EGD connection sock, asking for no
+ * more than EGD_MAX_REQUEST bytes at a time.  Return 0 on success, or an
+ * OTTERY_ERR_* code on failure. */
+static int
+ottery_egd_read_(int sock, uint8_t *out, size_t outlen)
+{
+  unsigned char msg[2];
+  size_t want;
+  int n;
+
+  do {
+    want = outlen > EGD_MAX_REQUEST ? EGD_MAX_REQUEST : outlen;
+    msg[0] = 1;                    /* nonblocking request */
+    msg[1] = (unsigned char) want; /* for want bytes */
+
+    if (send(sock, msg, 2, EGD_SEND_FLAGS) != 2 ||
+        read(sock, msg, 1) != 1)
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+
+    /* A daemon that is running low can give us fewer bytes than we asked
+     * for.  We take what it gives us, and ask again for the rest; but if
+     * it has nothing at all, we give up. */
+    if (msg[0] > want || (msg[0] == 0 && want != 0))
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+
+    n = ottery_read_n_bytes_from_file_(sock, out, msg[0]);
+    if (n < 0 || n != msg[0])
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+    out += n;
+    outlen -= n;
+  } while (outlen);
+
+  return 0;
+}
+
 /** Implement an entropy-source that uses the EGD protocol.  The
  * Entropy-Gathering Daemon is program (actually, one of several programs)
  * that watches system events, periodically runs commands whose outputs have
  * high variance, and so on.  It communicates over a simple socket-based
- * protocol, of which we use only a tiny piece. */
+ * protocol, of which we use only a tiny piece.
+ *
+ * If we have an entropy state, we keep our connection to the daemon there,
+ * and use it again next time; connecting costs more than the request. */
 static int
 ottery_get_entropy_egd(const struct ottery_entropy_config *cfg,
                        struct ottery_entropy_state *state,
                        uint8_t *out, size_t outlen)
 {
-  int sock, n, result;
-  unsigned char msg[2];
-  (void) state;
+  int sock, result, use_state = 0;
 
   if (! cfg || ! cfg->egd_sockaddr || ! cfg->egd_socklen)
     return OTTERY_ERR_INIT_STRONG_RNG;
-  if (outlen > 255)
-    return OTTERY_ERR_ACCESS_STRONG_RNG;
-
-  sock = socket(cfg->egd_sockaddr->sa_family, SOCK_STREAM, 0);
-  if (sock < 0)
-    return OTTERY_ERR_INIT_STRONG_RNG;
 
-  if (connect(sock, cfg->egd_sockaddr, cfg->egd_socklen) < 0) {
-    result = OTTERY_ERR_INIT_STRONG_RNG;
-    goto out;
+  /* Only one thread at a time can talk over the state's connection.  If
+   * somebody else is using it, we make a connection of our own rather than
+   * wait. */
+  if (state && __sync_bool_compare_and_swap(&state->egd_fd_busy, 0, 1)) {
+    use_state = 1;
+    if (state->egd_fd_is_cached && state->egd_fd_pid != getpid()) {
+      /* We have forked: the connection is shared with our parent, and
+       * their requests and ours would get mixed up. */
+      close(state->egd_cached_fd);
+      state->egd_fd_is_cached = 0;
+    }
+    if (state->egd_fd_is_cached) {
+      if (ottery_egd_read_(state->egd_cached_fd, out, outlen) == 0) {
+        result = 0;
+        goto out;
+      }
+      /* Maybe the daemon restarted.  Try again with a new connection. */
+      close(state->egd_cached_fd);
+      state->egd_fd_is_cached = 0;
+    }
   }
 
-  msg[0] = 1;                      /* nonblocking request */
-  msg[1] = (unsigned char) outlen; /* for outlen bytes */
-
-  if (write(sock, msg, 2) != 2 ||
-      read(sock, msg, 1)  != 1) {
-    result = OTTERY_ERR_ACCESS_STRONG_RNG;
+  sock = ottery_egd_connect_(cfg);
+  if (sock < 0) {
+    result = OTTERY_ERR_INIT_STRONG_RNG;
     goto out;
   }
 
-  if (msg[0] != outlen) {
-    /* TODO Use any bytes we get, even if they aren't as many as we wanted. */
-    result = OTTERY_ERR_ACCESS_STRONG_RNG;
-    goto out;
+  result = ottery_egd_read_(sock, out, outlen);
+  if (use_state && result == 0) {
+    state->egd_cached_fd = sock;
+    state->egd_fd_pid = getpid();
+    state->egd_fd_is_cached = 1;
+  } else {
+    close(sock);
   }
 
-  n = ottery_read_n_bytes_from_file_(sock, out, outlen);
-  if (n < 0 || (size_t)n != outlen) {
-    result = OTTERY_ERR_ACCESS_STRONG_RNG;
-    goto out;
-  }
-  result = 0;
  out:
-  close(sock);
+  if (use_state)
+    __sync_lock_release(&state->egd_fd_busy);
   return result;
 }
 
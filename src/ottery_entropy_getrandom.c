@@ -0,0 +1,63 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+#include <sys/random.h>
+#define OTTERY_GETRANDOM(buf, n) getrandom((buf), (n), 0)
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#ifdef SYS_getrandom
+#define OTTERY_GETRANDOM(buf, n) syscall(SYS_getrandom, (buf), (n), 0)
+#endif
+#endif
+
+#ifdef OTTERY_GETRANDOM
+#include <errno.h>
+
+/** Generate random bytes using the getrandom() system call.
+ *
+ * This is better than /dev/urandom when we can get it: it doesn't need a
+ * file descriptor or a /dev directory, and it blocks until the kernel's RNG
+ * has been seeded, rather than handing out predictable bytes early in
+ * boot.  If the configuration names a particular urandom device or fd, we
+ * step aside and let the user's choice be used instead. */
+static int
+ottery_get_entropy_getrandom(const struct ottery_entropy_config *cfg,
+                             struct ottery_entropy_state *state,
+                             uint8_t *out, size_t outlen)
+{
+  (void) state;
+  if (cfg && (cfg->urandom_fname || cfg->urandom_fd_is_set))
+    return OTTERY_ERR_INIT_STRONG_RNG;
+
+  while (outlen) {
+    long r = (long) OTTERY_GETRANDOM(out, outlen);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      /* ENOSYS means an old kernel; fall back to the device. */
+      return OTTERY_ERR_INIT_STRONG_RNG;
+    }
+    if (r == 0 || (size_t)r > outlen)
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+    out += r;
+    outlen -= r;
+  }
+  return 0;
+}
+
+#define ENTROPY_SOURCE_GETRANDOM \
+  { ottery_get_entropy_getrandom, SRC(GETRANDOM)|DOM(OS)|FL(STRONG) }
+
+#endif
@@ -19,14 +19,79 @@
     defined(_M_IX86) || \
     defined(__INTEL_COMPILER)
 
-/** Helper: invoke the RDRAND instruction to get 4 random bytes in the output
- * value. Return 0 on success, and an error on failure. */
+/*
+ * We read RDRAND and RDSEED a whole register at a time: 8 bytes on x86_64,
+ * and 4 on 32-bit x86.  The instructions are hand-encoded for the benefit
+ * of old assemblers.
+ */
+#if defined(__x86_64) || defined(__x86_64__)
+/** A register's worth of output from RDRAND or RDSEED. */
+typedef uint64_t ottery_cpurand_word_t;
+#define RDRAND_INSN ".byte 0x48, 0x0F, 0xC7, 0xF0"
+#define RDSEED_INSN ".byte 0x48, 0x0F, 0xC7, 0xF8"
+#else
+typedef uint32_t ottery_cpurand_word_t;
+#define RDRAND_INSN ".byte 0x0F, 0xC7, 0xF0"
+#define RDSEED_INSN ".byte 0x0F, 0xC7, 0xF8"
+#endif
+
+/** How many times to retry RDRAND when it fails.  Intel says that it should
+ * essentially never fail ten times in a row unless the hardware is
+ * broken. */
+#define RDRAND_RETRIES 10
+/** How many times to retry RDSEED when it fails.  RDSEED fails whenever the
+ * entropy source hasn't caught up with demand, which is normal when several
+ * cores are asking at once, so we try much harder, and pause in between. */
+#define RDSEED_RETRIES 200
+
+/** Helper: invoke the RDRAND instruction once.  Return 1 and set *out on
+ * success; return 0 on failure. */
+static int
+rdrand(ottery_cpurand_word_t *out)
+{
+  unsigned char ok;
+  __asm volatile(RDRAND_INSN " ; setc %1"
+                 : "=a" (*out), "=qm" (ok) : : "cc");
+  return ok;
+}
+
+/** Helper: invoke the RDSEED instruction once.  Return 1 and set *out on
+ * success; return 0 on failure. */
 static int
-rdrand(uint32_t *therand) {
- unsigned char status;
- __asm volatile(".byte 0x0F, 0xC7, 0xF0 ; setc %1"
- : "=a" (*therand), "=qm" (status));
- return (status)==1 ? 0 : OTTERY_ERR_INIT_STRONG_RNG;
+rdseed(ottery_cpurand_word_t *out)
+{
+  unsigned char ok;
+  __asm volatile(RDSEED_INSN " ; setc %1"
+                 : "=a" (*out), "=qm" (ok) : : "cc");
+  return ok;
+}
+
+/**
+ * Fill out with outlen bytes from insn (rdrand or rdseed), retrying each
+ * word up to retries times.  If pause is set, execute a PAUSE instruction
+ * between retries.
+ */
+static int
+ottery_get_entropy_cpurand(int (*insn)(ottery_cpurand_word_t *),
+                           int retries, int pause,
+                           uint8_t *out, size_t outlen)
+{
+  ottery_cpurand_word_t w = 0;
+  while (outlen) {
+    const size_t n = outlen < sizeof(w) ? outlen : sizeof(w);
+    int tries = 0;
+    while (! insn(&w)) {
+      if (++tries > retries)
+        return OTTERY_ERR_INIT_STRONG_RNG;
+      if (pause)
+        __asm volatile("pause");
+    }
+    memcpy(out, &w, n);
+    out += n;
+    outlen -= n;
+  }
+  ottery_memclear_(&w, sizeof(w));
+  return 0;
 }
 
 /** Generate bytes using the Intel RDRAND instruction. */
@@ -35,29 +100,33 @@ ottery_get_entropy_rdrand(const struct ottery_entropy_config *cfg,
                           struct ottery_entropy_state *state,
                            uint8_t *out, size_t outlen)
 {
-  int err;
-  uint32_t *up = (uint32_t *) out;
   (void) cfg;
   (void) state;
   if (! (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RAND))
     return OTTERY_ERR_INIT_STRONG_RNG;
-  while (outlen >= 4) {
-    if ((err = rdrand(up)))
-      return err;
-    up += 1;
-    outlen -= 4;
-  }
-  if (outlen) {
-    uint32_t tmp;
-    if ((err = rdrand(&tmp)))
-      return err;
-    memcpy(up, &tmp, outlen);
-  }
-  return 0;
+  return ottery_get_entropy_cpurand(rdrand, RDRAND_RETRIES, 0, out, outlen);
+}
+
+/** Generate bytes using the Intel RDSEED instruction.  Unlike RDRAND, which
+ * gives the output of a DRBG that the hardware reseeds now and then, RDSEED
+ * gives conditioned output straight from the entropy source, which is what
+ * we want for seeding. */
+static int
+ottery_get_entropy_rdseed(const struct ottery_entropy_config *cfg,
+                          struct ottery_entropy_state *state,
+                          uint8_t *out, size_t outlen)
+{
+  (void) cfg;
+  (void) state;
+  if (! (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RDSEED))
+    return OTTERY_ERR_INIT_STRONG_RNG;
+  return ottery_get_entropy_cpurand(rdseed, RDSEED_RETRIES, 1, out, outlen);
 }
 
 #define ENTROPY_SOURCE_RDRAND                                           \
   { ottery_get_entropy_rdrand,  SRC(RDRAND)|DOM(CPU)|FL(FAST)|FL(STRONG) }
+#define ENTROPY_SOURCE_RDSEED                                           \
+  { ottery_get_entropy_rdseed,  SRC(RDSEED)|DOM(CPU)|FL(STRONG) }
 
 #endif
 
@@ -65,11 +65,22 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
   struct stat st;
   int own_fd = 0;
   int check_device = !cfg || !cfg->allow_nondev_urandom;
+  int keep_open = 0;
+  int cached_fd = 0;
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
+  /* Only one thread at a time can use or replace the cached fd.  If
+   * somebody else has it, we open a device of our own, and close it when
+   * we're done. */
+  if (cfg && cfg->urandom_keep_open && state)
+    keep_open = __sync_bool_compare_and_swap(&state->urandom_fd_busy, 0, 1);
+
   if (cfg && cfg->urandom_fd_is_set && cfg->urandom_fd >= 0) {
     fd = cfg->urandom_fd;
+  } else if (keep_open && state->urandom_fd_is_cached) {
+    fd = state->urandom_cached_fd;
+    cached_fd = 1;
   } else {
     if (cfg && cfg->urandom_fname)
       urandom_fname = cfg->urandom_fname;
@@ -77,11 +88,16 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
       urandom_fname = "/dev/urandom";
 
     fd = open(urandom_fname, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+      result = OTTERY_ERR_INIT_STRONG_RNG;
+      goto end;
+    }
     own_fd = 1;
-    if (fd < 0)
-      return OTTERY_ERR_INIT_STRONG_RNG;
   }
   if (fstat(fd, &st) < 0) {
+    /* If this was our cached fd, somebody closed it out from under us. */
+    if (cached_fd)
+      state->urandom_fd_is_cached = 0;
     result = OTTERY_ERR_INIT_STRONG_RNG;
     goto end;
   }
@@ -95,8 +111,12 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
       if (0 == state->urandom_fd_inode) {
         state->urandom_fd_inode = (uint64_t) st.st_ino;
       } else if ((uint64_t)st.st_ino != state->urandom_fd_inode) {
-        close(fd);
-        return OTTERY_ERR_ACCESS_STRONG_RNG;
+        /* Somebody replaced the fd under us.  If it was our cached one,
+         * it isn't ours to close any more. */
+        if (cached_fd)
+          state->urandom_fd_is_cached = 0;
+        result = OTTERY_ERR_ACCESS_STRONG_RNG;
+        goto end;
       }
     }
   }
@@ -105,9 +125,18 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
   if (n < 0 || (size_t)n != outlen)
     result = OTTERY_ERR_ACCESS_STRONG_RNG;
 
+  /* The device checked out; hang on to it if we were asked to. */
+  if (own_fd && keep_open && result == 0) {
+    state->urandom_cached_fd = fd;
+    state->urandom_fd_is_cached = 1;
+    own_fd = 0;
+  }
+
  end:
   if (own_fd)
     close(fd);
+  if (keep_open)
+    __sync_lock_release(&state->urandom_fd_busy);
   return result;
 }
 
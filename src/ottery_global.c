@@ -12,16 +12,31 @@
       <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 #define OTTERY_INTERNAL
-#include <stdlib.h>
+/* This has to come before <stdlib.h>, or we won't get sched_getcpu(). */
 #include "ottery-internal.h"
+#include <stdlib.h>
 #include "ottery.h"
 #include "ottery_st.h"
+#include "ottery_nolock.h"
+
+#ifdef OTTERY_THREAD_STATES
+#include <pthread.h>
+#endif
+#ifdef OTTERY_CPU_STATES
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 /**
  * Evaluate the condition 'x', while hinting to the compiler that it is
  * likely to be false.
  */
 #define UNLIKELY(x) __builtin_expect((x), 0)
+/**
+ * Evaluate the condition 'x', while hinting to the compiler that it is
+ * likely to be true.
+ */
+#define LIKELY(x) __builtin_expect((x), 1)
 
 /** Flag: true iff ottery_global_state_ is initialized. */
 static int ottery_global_state_initialized_ = 0;
@@ -29,6 +44,232 @@ static int ottery_global_state_initialized_ = 0;
  * state. */
 static struct ottery_state ottery_global_state_;
 
+#ifdef OTTERY_THREAD_STATES
+/** Flag: true iff the global API should use per-thread states. */
+static int ottery_global_per_thread_ = 0;
+/** The configuration that ottery_init() was called with, used to set up
+ * each thread's state. */
+static struct ottery_config ottery_global_config_;
+/** Incremented whenever the global configuration changes or is wiped, so
+ * that threads can tell that their states are out of date. */
+static unsigned ottery_global_generation_ = 0;
+
+/** Pthread key whose destructor wipes and frees a thread's state when the
+ * thread exits. */
+static pthread_key_t ottery_thread_state_key_;
+/** Used to create ottery_thread_state_key_ exactly once. */
+static pthread_once_t ottery_thread_state_key_once_ = PTHREAD_ONCE_INIT;
+/** Flag: true iff we created ottery_thread_state_key_ successfully. */
+static int ottery_thread_state_key_ok_ = 0;
+
+/** This thread's state, or NULL if it doesn't have one yet. */
+static __thread struct ottery_state_nolock *ottery_thread_state_ = NULL;
+/** The value of ottery_global_generation_ when ottery_thread_state_ was
+ * last initialized. */
+static __thread unsigned ottery_thread_state_generation_ = 0;
+
+/** Pthread key destructor: wipe and release a thread's state. */
+static void
+ottery_thread_state_free_(void *ptr)
+{
+  struct ottery_state_nolock *st = ptr;
+  ottery_st_wipe_nolock(st);
+  free(st);
+}
+
+/** Helper for pthread_once: create ottery_thread_state_key_. */
+static void
+ottery_thread_state_key_init_(void)
+{
+  if (pthread_key_create(&ottery_thread_state_key_,
+                         ottery_thread_state_free_) == 0)
+    ottery_thread_state_key_ok_ = 1;
+}
+
+/**
+ * Slow path for THREAD_STATE(): create or refresh this thread's state.
+ *
+ * @return The calling thread's state, or NULL if we should use the
+ *   shared global state instead.
+ */
+static struct ottery_state_nolock *
+ottery_get_thread_state_slow_(void)
+{
+  struct ottery_state_nolock *st = ottery_thread_state_;
+  void *mem = NULL;
+  int err;
+
+  if (! ottery_global_per_thread_)
+    return NULL;
+
+  if (st == NULL) {
+    pthread_once(&ottery_thread_state_key_once_,
+                 ottery_thread_state_key_init_);
+    if (! ottery_thread_state_key_ok_) {
+      err = OTTERY_ERR_INTERNAL;
+      goto err;
+    }
+    if (posix_memalign(&mem, OTTERY_CACHE_LINE,
+                       ottery_get_sizeof_state_nolock())) {
+      err = OTTERY_ERR_INTERNAL;
+      goto err;
+    }
+    st = mem;
+  } else {
+    /* Release anything the stale state was holding on to. */
+    ottery_st_wipe_nolock(st);
+  }
+
+  if ((err = ottery_st_init_nolock(st, &ottery_global_config_)))
+    goto err;
+
+  if (mem) {
+    if (pthread_setspecific(ottery_thread_state_key_, st)) {
+      ottery_st_wipe_nolock(st);
+      err = OTTERY_ERR_INTERNAL;
+      goto err;
+    }
+    ottery_thread_state_ = st;
+  }
+  ottery_thread_state_generation_ = ottery_global_generation_;
+  return st;
+
+ err:
+  /* We don't leave a stale state behind: if we were refreshing an
+   * existing one, it's no longer good to use. */
+  if (ottery_thread_state_) {
+    pthread_setspecific(ottery_thread_state_key_, NULL);
+    ottery_thread_state_free_(ottery_thread_state_);
+    ottery_thread_state_ = NULL;
+  } else {
+    free(mem);
+  }
+  ottery_fatal_error_(OTTERY_ERR_FLAG_GLOBAL_PRNG_INIT|err);
+  return NULL;
+}
+
+/**
+ * Return the calling thread's state if the global API is in per-thread mode,
+ * and NULL if it should use ottery_global_state_.
+ */
+static inline struct ottery_state_nolock *
+ottery_get_thread_state_(void)
+{
+  /* In the default shared mode, don't make a call just to find that out. */
+  if (! ottery_global_per_thread_)
+    return NULL;
+  if (LIKELY(ottery_thread_state_ != NULL &&
+             ottery_thread_state_generation_ == ottery_global_generation_))
+    return ottery_thread_state_;
+  return ottery_get_thread_state_slow_();
+}
+#define THREAD_STATE() ottery_get_thread_state_()
+#else
+#define THREAD_STATE() ((struct ottery_state_nolock *)NULL)
+#endif
+
+#ifdef OTTERY_CPU_STATES
+/*
+ * Per-CPU states.
+ *
+ * We keep one locked state for each CPU, and have each thread use the state
+ * for the CPU that it's running on.  A thread can get moved to another CPU
+ * at any time, so we still need the locks, but they are almost never
+ * contended.  Unlike per-thread states, a new thread costs nothing, and the
+ * number of states is bounded by the number of CPUs.
+ *
+ * Finding the current CPU with sched_getcpu() costs a memory load on
+ * recent glibc, which reads it from the restartable-sequences area that
+ * the kernel keeps up to date for each thread; elsewhere, it goes through
+ * the vDSO.  We don't try to run the generator itself as a restartable
+ * sequence: it's much too long.
+ */
+
+/** Flag: true iff the global API should use per-CPU states. */
+static int ottery_global_per_cpu_ = 0;
+/** Memory holding ottery_n_cpu_states_ states, each starting on its own
+ * cache line.  NULL if we have no per-CPU states. */
+static uint8_t *ottery_cpu_states_ = NULL;
+/** Number of states in ottery_cpu_states_. */
+static unsigned ottery_n_cpu_states_ = 0;
+
+/** Distance between the starts of two consecutive per-CPU states.  We
+ * round up to a whole number of cache lines, so that no two states share
+ * one. */
+#define CPU_STATE_STRIDE \
+  ((sizeof(struct ottery_state) + OTTERY_CACHE_LINE - 1) & \
+   ~(size_t)(OTTERY_CACHE_LINE - 1))
+
+/** Return the idx'th per-CPU state. */
+#define CPU_STATE(idx) \
+  ((struct ottery_state *)(ottery_cpu_states_ + (idx) * CPU_STATE_STRIDE))
+
+/** Wipe and release every per-CPU state. */
+static void
+ottery_cpu_states_free_(void)
+{
+  unsigned i;
+  if (! ottery_cpu_states_)
+    return;
+  for (i = 0; i < ottery_n_cpu_states_; ++i)
+    ottery_st_wipe(CPU_STATE(i));
+  free(ottery_cpu_states_);
+  ottery_cpu_states_ = NULL;
+  ottery_n_cpu_states_ = 0;
+}
+
+/**
+ * Create a state for each CPU.  We key them all from ottery_global_state_,
+ * which must already be initialized, so that we only need to ask the OS
+ * for entropy once.
+ *
+ * @return An OTTERY_ERR_* value (zero on success, nonzero on failure).
+ */
+static int
+ottery_cpu_states_init_(void)
+{
+  long n_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  void *mem = NULL;
+  unsigned i;
+  int err;
+
+  if (n_cpus < 1)
+    n_cpus = 1;
+  if (posix_memalign(&mem, OTTERY_CACHE_LINE,
+                     CPU_STATE_STRIDE * (size_t)n_cpus))
+    return OTTERY_ERR_INTERNAL;
+  ottery_cpu_states_ = mem;
+
+  for (i = 0; i < (unsigned)n_cpus; ++i) {
+    if ((err = ottery_st_init_from_parent(CPU_STATE(i),
+                                          &ottery_global_state_))) {
+      ottery_cpu_states_free_();
+      return err;
+    }
+    ottery_n_cpu_states_ = i + 1;
+  }
+  return 0;
+}
+
+/**
+ * Return the state for the CPU we're running on, or ottery_global_state_ if
+ * we can't tell which one that is.
+ */
+static inline struct ottery_state *
+ottery_get_cpu_state_(void)
+{
+  int cpu = sched_getcpu();
+  if (UNLIKELY(cpu < 0))
+    return &ottery_global_state_;
+  /* CPUs can be numbered sparsely, or come online after we start. */
+  return CPU_STATE((unsigned)cpu % ottery_n_cpu_states_);
+}
+#define SHARED_STATE() \
+  (ottery_global_per_cpu_ ? ottery_get_cpu_state_() : &ottery_global_state_)
+#else
+#define SHARED_STATE() (&ottery_global_state_)
+#endif
+
 /** Initialize ottery_global_state_ if it has not been initialize. */
 #define CHECK_INIT(rv) do {                                 \
     if (UNLIKELY(!ottery_global_state_initialized_)) {      \
@@ -43,69 +284,374 @@ static struct ottery_state ottery_global_state_;
 int
 ottery_init(const struct ottery_config *cfg)
 {
-  int n = ottery_st_init(&ottery_global_state_, cfg);
-  if (n == 0)
+  int n;
+  /* Release whatever the old global state was holding on to. */
+  if (ottery_global_state_initialized_) {
+    ottery_global_state_initialized_ = 0;
+#ifdef OTTERY_CPU_STATES
+    ottery_global_per_cpu_ = 0;
+    ottery_cpu_states_free_();
+#endif
+    ottery_st_wipe(&ottery_global_state_);
+  }
+  n = ottery_st_init(&ottery_global_state_, cfg);
+#ifdef OTTERY_CPU_STATES
+  if (n == 0 && cfg &&
+      cfg->global_state_mode == OTTERY_GLOBAL_STATE_PER_CPU) {
+    if ((n = ottery_cpu_states_init_()))
+      ottery_st_wipe(&ottery_global_state_);
+    else
+      ottery_global_per_cpu_ = 1;
+  }
+#endif
+  if (n == 0) {
+#ifdef OTTERY_THREAD_STATES
+    if (cfg)
+      ottery_global_config_ = *cfg;
+    else
+      ottery_config_init(&ottery_global_config_);
+    ottery_global_per_thread_ = (ottery_global_config_.global_state_mode ==
+                                 OTTERY_GLOBAL_STATE_PER_THREAD);
+    ++ottery_global_generation_;
+#endif
     ottery_global_state_initialized_ = 1;
+  }
   return n;
 }
 
 int
 ottery_add_seed(const uint8_t *seed, size_t n)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_add_seed_nolock(tst, seed, n);
+#ifdef OTTERY_CPU_STATES
+  if (ottery_global_per_cpu_) {
+    unsigned i;
+    int err;
+    for (i = 0; i < ottery_n_cpu_states_; ++i)
+      if ((err = ottery_st_add_seed(CPU_STATE(i), seed, n)))
+        return err;
+  }
+#endif
   return ottery_st_add_seed(&ottery_global_state_, seed, n);
 }
 
+int
+ottery_request_reseed_async(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_request_reseed_async_nolock(tst);
+#ifdef OTTERY_CPU_STATES
+  if (ottery_global_per_cpu_) {
+    unsigned i;
+    int err;
+    for (i = 0; i < ottery_n_cpu_states_; ++i)
+      if ((err = ottery_st_request_reseed_async(CPU_STATE(i))))
+        return err;
+  }
+#endif
+  return ottery_st_request_reseed_async(&ottery_global_state_);
+}
+
 void
 ottery_wipe(void)
 {
   if (ottery_global_state_initialized_) {
     ottery_global_state_initialized_ = 0;
+#ifdef OTTERY_CPU_STATES
+    ottery_global_per_cpu_ = 0;
+    ottery_cpu_states_free_();
+#endif
     ottery_st_wipe(&ottery_global_state_);
+#ifdef OTTERY_THREAD_STATES
+    /* Other threads will notice the new generation and reinitialize their
+     * states; we can clear our own right away. */
+    ++ottery_global_generation_;
+    if (ottery_thread_state_)
+      ottery_st_wipe_nolock(ottery_thread_state_);
+#endif
   }
 }
 
 void
 ottery_prevent_backtracking(void)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT();
+  if ((tst = THREAD_STATE())) {
+    ottery_st_prevent_backtracking_nolock(tst);
+    return;
+  }
+#ifdef OTTERY_CPU_STATES
+  if (ottery_global_per_cpu_) {
+    unsigned i;
+    for (i = 0; i < ottery_n_cpu_states_; ++i)
+      ottery_st_prevent_backtracking(CPU_STATE(i));
+  }
+#endif
   ottery_st_prevent_backtracking(&ottery_global_state_);
 }
 
+void
+ottery_prefill(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_prefill_nolock(tst);
+  else
+    ottery_st_prefill(SHARED_STATE());
+}
+
 void
 ottery_rand_bytes(void *out, size_t n)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT();
-  ottery_st_rand_bytes(&ottery_global_state_, out, n);
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_bytes_nolock(tst, out, n);
+  else
+    ottery_st_rand_bytes(SHARED_STATE(), out, n);
 }
 
 unsigned
 ottery_rand_unsigned(void)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT(0);
-  return ottery_st_rand_unsigned(&ottery_global_state_);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_unsigned_nolock(tst);
+  return ottery_st_rand_unsigned(SHARED_STATE());
 }
 uint32_t
 ottery_rand_uint32(void)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT(0);
-  return ottery_st_rand_uint32(&ottery_global_state_);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_uint32_nolock(tst);
+  return ottery_st_rand_uint32(SHARED_STATE());
 }
 uint64_t
 ottery_rand_uint64(void)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT(0);
-  return ottery_st_rand_uint64(&ottery_global_state_);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_uint64_nolock(tst);
+  return ottery_st_rand_uint64(SHARED_STATE());
+}
+void
+ottery_rand_uint32_array(uint32_t *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_uint32_array_nolock(tst, out, n);
+  else
+    ottery_st_rand_uint32_array(SHARED_STATE(), out, n);
+}
+void
+ottery_rand_uint64_array(uint64_t *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_uint64_array_nolock(tst, out, n);
+  else
+    ottery_st_rand_uint64_array(SHARED_STATE(), out, n);
 }
 unsigned
 ottery_rand_range(unsigned top)
 {
+  struct ottery_state_nolock *tst;
   CHECK_INIT(0);
-  return ottery_st_rand_range(&ottery_global_state_, top);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_range_nolock(tst, top);
+  return ottery_st_rand_range(SHARED_STATE(), top);
 }
 uint64_t
 ottery_rand_range64(uint64_t top)
 {
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_range64_nolock(tst, top);
+  return ottery_st_rand_range64(SHARED_STATE(), top);
+}
+void
+ottery_rand_range_array(uint32_t *out, size_t n, uint32_t top)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_range_array_nolock(tst, out, n, top);
+  else
+    ottery_st_rand_range_array(SHARED_STATE(), out, n, top);
+}
+uint32_t
+ottery_rand_weighted(const struct ottery_alias_table *tbl)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_weighted_nolock(tst, tbl);
+  return ottery_st_rand_weighted(SHARED_STATE(), tbl);
+}
+void
+ottery_rand_weighted_array(const struct ottery_alias_table *tbl,
+                           uint32_t *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_weighted_array_nolock(tst, tbl, out, n);
+  else
+    ottery_st_rand_weighted_array(SHARED_STATE(), tbl, out, n);
+}
+int
+ottery_rand_bit(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_bit_nolock(tst);
+  return ottery_st_rand_bit(SHARED_STATE());
+}
+int
+ottery_rand_bernoulli(double p)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_bernoulli_nolock(tst, p);
+  return ottery_st_rand_bernoulli(SHARED_STATE(), p);
+}
+void
+ottery_rand_bernoulli_mask(uint64_t *out, size_t n, double p)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_bernoulli_mask_nolock(tst, out, n, p);
+  else
+    ottery_st_rand_bernoulli_mask(SHARED_STATE(), out, n, p);
+}
+double
+ottery_rand_double(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_double_nolock(tst);
+  return ottery_st_rand_double(SHARED_STATE());
+}
+float
+ottery_rand_float(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_float_nolock(tst);
+  return ottery_st_rand_float(SHARED_STATE());
+}
+double
+ottery_rand_double_full(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_double_full_nolock(tst);
+  return ottery_st_rand_double_full(SHARED_STATE());
+}
+float
+ottery_rand_float_full(void)
+{
+  struct ottery_state_nolock *tst;
   CHECK_INIT(0);
-  return ottery_st_rand_range64(&ottery_global_state_, top);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_float_full_nolock(tst);
+  return ottery_st_rand_float_full(SHARED_STATE());
+}
+void
+ottery_rand_double_array(double *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_double_array_nolock(tst, out, n);
+  else
+    ottery_st_rand_double_array(SHARED_STATE(), out, n);
+}
+void
+ottery_rand_float_array(float *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_float_array_nolock(tst, out, n);
+  else
+    ottery_st_rand_float_array(SHARED_STATE(), out, n);
+}
+void
+ottery_shuffle(void *base, size_t nmemb, size_t size)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_shuffle_nolock(tst, base, nmemb, size);
+  else
+    ottery_st_shuffle(SHARED_STATE(), base, nmemb, size);
+}
+void
+ottery_rand_permutation(uint32_t *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_permutation_nolock(tst, out, n);
+  else
+    ottery_st_rand_permutation(SHARED_STATE(), out, n);
+}
+double
+ottery_rand_normal(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_normal_nolock(tst);
+  return ottery_st_rand_normal(SHARED_STATE());
+}
+double
+ottery_rand_exponential(void)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT(0);
+  if ((tst = THREAD_STATE()))
+    return ottery_st_rand_exponential_nolock(tst);
+  return ottery_st_rand_exponential(SHARED_STATE());
+}
+void
+ottery_rand_normal_array(double *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_normal_array_nolock(tst, out, n);
+  else
+    ottery_st_rand_normal_array(SHARED_STATE(), out, n);
+}
+void
+ottery_rand_exponential_array(double *out, size_t n)
+{
+  struct ottery_state_nolock *tst;
+  CHECK_INIT();
+  if ((tst = THREAD_STATE()))
+    ottery_st_rand_exponential_array_nolock(tst, out, n);
+  else
+    ottery_st_rand_exponential_array(SHARED_STATE(), out, n);
 }
@@ -27,8 +27,9 @@ extern "C" {
 struct ottery_config;
 struct ottery_state_nolock;
 
-/** Size reserved for struct ottery_state_nolock */
-#define OTTERY_STATE_NOLOCK_DUMMY_SIZE_ 1536
+/** Size reserved for struct ottery_state_nolock.  This must match
+ * OTTERY_STATE_DUMMY_SIZE_. */
+#define OTTERY_STATE_NOLOCK_DUMMY_SIZE_ 2048
 
 #ifndef OTTERY_INTERNAL
 /**
@@ -81,6 +82,20 @@ size_t ottery_get_sizeof_state_nolock(void);
  */
 int ottery_st_init_nolock(struct ottery_state_nolock *st, const struct ottery_config *cfg);
 
+/**
+ * Initialize an ottery_state_nolock structure from the output of another
+ * one.
+ *
+ * As ottery_st_init_from_parent(), but for ottery_state_nolock structures.
+ *
+ * @param child The ottery_state_nolock to initialize.
+ * @param parent An initialized ottery_state_nolock to take the key from.
+ *   It must not be the same as child.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_init_from_parent_nolock(struct ottery_state_nolock *child,
+                                      struct ottery_state_nolock *parent);
+
 /**
  * Add more entropy to an ottery_state_nolock structure.
  *
@@ -101,6 +116,28 @@ int ottery_st_init_nolock(struct ottery_state_nolock *st, const struct ottery_co
  */
 int ottery_st_add_seed_nolock(struct ottery_state_nolock *st, const uint8_t *seed, size_t n);
 
+/**
+ * Reseed an ottery_state_nolock from the operating system, without waiting
+ * for the operating system.
+ *
+ * This has the same effect as ottery_st_add_seed_nolock(st, NULL, 0), but
+ * the read from the entropy source happens on a helper thread, and this
+ * function returns right away.  When the entropy arrives, the state mixes
+ * it in the next time it generates a block of output; until then, it goes
+ * on using its old key.  The helper thread only hands over the entropy, so
+ * you can go on using the state from one thread as usual.  If a reseed is
+ * already on its way, this function does nothing.  If the entropy source
+ * fails, the state keeps its old key; nobody is told.
+ *
+ * ottery_st_wipe_nolock() waits for the helper thread, if there is one.
+ * On platforms without threads, this function reseeds right away.
+ *
+ * @param st The state to reseed.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes if we
+ *   couldn't start the helper thread.
+ */
+int ottery_st_request_reseed_async_nolock(struct ottery_state_nolock *st);
+
 /**
  * Destroy an ottery_state_nolock structure and release any resources that it
  * might hold.
@@ -130,6 +167,21 @@ void ottery_st_wipe_nolock(struct ottery_state_nolock *st);
  */
 void ottery_st_prevent_backtracking_nolock(struct ottery_state_nolock *st);
 
+/**
+ * Generate the next block of output ahead of time.
+ *
+ * If the state was configured with ottery_config_enable_prefill() and its
+ * spare block is empty, generate the block that the state will need next,
+ * so that whoever exhausts the current block doesn't have to wait for it.
+ * Otherwise, do nothing.
+ *
+ * Since this state isn't thread safe, you'll want to call this from some
+ * idle-time hook in the thread that owns the state.
+ *
+ * @param st The state to prefill.
+ */
+void ottery_st_prefill_nolock(struct ottery_state_nolock *st);
+
 /**
  * Use an ottery_state_nolock structure to fill a buffer with random bytes.
  *
@@ -162,6 +214,28 @@ uint32_t ottery_st_rand_uint32_nolock(struct ottery_state_nolock *st);
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_uint64_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint32_t.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint32_t would not fit in memory.
+ */
+void ottery_st_rand_uint32_array_nolock(struct ottery_state_nolock *st,
+                                        uint32_t *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint64_t.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint64_t would not fit in memory.
+ */
+void ottery_st_rand_uint64_array_nolock(struct ottery_state_nolock *st,
+                                        uint64_t *out, size_t n);
 /**
  * Use an ottery_state_nolock structure to generate a random number of type unsigned
  * in a given range.
@@ -182,6 +256,205 @@ unsigned ottery_st_rand_range_nolock(struct ottery_state_nolock *st, unsigned to
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_range64_nolock(struct ottery_state_nolock *st, uint64_t top);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint32_t in a given range.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint32_t would not fit in memory.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_st_rand_range_array_nolock(struct ottery_state_nolock *st,
+                                       uint32_t *out, size_t n, uint32_t top);
+/**
+ * Use an ottery_state_nolock structure to choose an index at random, with
+ * the weights in an alias table.
+ *
+ * See ottery_st_rand_weighted().
+ *
+ * @param st The state structure to use.
+ * @param tbl A table from ottery_alias_table_new().
+ * @return An index less than the number of weights in tbl.
+ */
+uint32_t ottery_st_rand_weighted_nolock(struct ottery_state_nolock *st,
+                                        const struct ottery_alias_table *tbl);
+/**
+ * Use an ottery_state_nolock structure to fill an array with indices
+ * chosen at random, as from ottery_st_rand_weighted_nolock().
+ *
+ * @param st The state structure to use.
+ * @param tbl A table from ottery_alias_table_new().
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_weighted_array_nolock(struct ottery_state_nolock *st,
+                                          const struct ottery_alias_table *tbl,
+                                          uint32_t *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to generate a single random bit.
+ *
+ * See ottery_st_rand_bit().
+ *
+ * @param st The state structure to use.
+ * @return 0 or 1, each with probability 1/2.
+ */
+int ottery_st_rand_bit_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to return 1 with a given
+ * probability, and 0 otherwise.
+ *
+ * See ottery_st_rand_bernoulli().
+ *
+ * @param st The state structure to use.
+ * @param p The probability of returning 1.
+ * @return 1 with probability p; 0 otherwise.
+ */
+int ottery_st_rand_bernoulli_nolock(struct ottery_state_nolock *st, double p);
+/**
+ * Use an ottery_state_nolock structure to fill an array of 64-bit words
+ * with random bits, each of which is set with a given probability.
+ *
+ * See ottery_st_rand_bernoulli_mask().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of 64-bit words to write.  It is a fatal error if n
+ *   such words would not fit in memory.
+ * @param p The probability that each bit is set.
+ */
+void ottery_st_rand_bernoulli_mask_nolock(struct ottery_state_nolock *st,
+                                          uint64_t *out, size_t n, double p);
+/**
+ * Use an ottery_state_nolock structure to generate a random double in
+ * [0, 1).
+ *
+ * The result is a multiple of 2^-53, chosen uniformly.
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+double ottery_st_rand_double_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to generate a random float in
+ * [0, 1).
+ *
+ * The result is a multiple of 2^-24, chosen uniformly.
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+float ottery_st_rand_float_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to generate a random double in
+ * [0, 1), with full precision.
+ *
+ * See ottery_st_rand_double_full().
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+double ottery_st_rand_double_full_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to generate a random float in
+ * [0, 1), with full precision.
+ *
+ * See ottery_st_rand_double_full().
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+float ottery_st_rand_float_full_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random
+ * doubles in [0, 1), as from ottery_st_rand_double_nolock().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of double would not fit in memory.
+ */
+void ottery_st_rand_double_array_nolock(struct ottery_state_nolock *st,
+                                        double *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random
+ * floats in [0, 1), as from ottery_st_rand_float_nolock().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of float would not fit in memory.
+ */
+void ottery_st_rand_float_array_nolock(struct ottery_state_nolock *st,
+                                       float *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to put an array into random order.
+ *
+ * See ottery_st_shuffle().
+ *
+ * @param st The state structure to use.
+ * @param base The array to shuffle.
+ * @param nmemb The number of elements in the array.
+ * @param size The size of each element, in bytes.
+ */
+void ottery_st_shuffle_nolock(struct ottery_state_nolock *st, void *base,
+                              size_t nmemb, size_t size);
+/**
+ * Use an ottery_state_nolock structure to fill an array with a random
+ * permutation of the numbers 0 through n-1.
+ *
+ * See ottery_st_rand_permutation().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  Must be no more than
+ *   UINT32_MAX + 1; a bigger n is a fatal error.
+ */
+void ottery_st_rand_permutation_nolock(struct ottery_state_nolock *st,
+                                       uint32_t *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to generate a random number from
+ * the standard normal distribution.
+ *
+ * See ottery_st_rand_normal().
+ *
+ * @param st The state structure to use.
+ * @return A normally distributed random number.
+ */
+double ottery_st_rand_normal_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to generate a random number from
+ * the exponential distribution with rate 1.
+ *
+ * See ottery_st_rand_exponential().
+ *
+ * @param st The state structure to use.
+ * @return An exponentially distributed random number, at least 0.
+ */
+double ottery_st_rand_exponential_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random
+ * numbers from the standard normal distribution, as from
+ * ottery_st_rand_normal_nolock().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_normal_array_nolock(struct ottery_state_nolock *st,
+                                        double *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random
+ * numbers from the exponential distribution, as from
+ * ottery_st_rand_exponential_nolock().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_exponential_array_nolock(struct ottery_state_nolock *st,
+                                             double *out, size_t n);
 
 #ifdef __cplusplus
 }
@@ -27,8 +27,10 @@ extern "C" {
 struct ottery_config;
 struct ottery_state;
 
-/** Size reserved for struct ottery_state */
-#define OTTERY_STATE_DUMMY_SIZE_ 1536
+/** Size reserved for struct ottery_state.  (This was 1536 before the
+ * reseeding and entropy-source options outgrew it; changing it changes the
+ * ABI.) */
+#define OTTERY_STATE_DUMMY_SIZE_ 2048
 
 #ifndef OTTERY_INTERNAL
 /**
@@ -75,6 +77,26 @@ size_t ottery_get_sizeof_state(void);
  */
 int ottery_st_init(struct ottery_state *st, const struct ottery_config *cfg);
 
+/**
+ * Initialize an ottery_state structure from the output of another one.
+ *
+ * This is much faster than ottery_st_init(), since it doesn't touch the
+ * operating system's entropy source: the new state's key comes from the
+ * parent state, and everything else (the PRF, the entropy configuration,
+ * and whether to prefill) is copied from the parent.  Use it when you need
+ * lots of short-lived generators, such as one per connection.
+ *
+ * The child is exactly as unpredictable as the parent is; knowing its
+ * output tells an attacker nothing about the parent's later output.
+ *
+ * @param child The ottery_state to initialize.
+ * @param parent An initialized ottery_state to take the key from.  It
+ *   must not be the same as child.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_init_from_parent(struct ottery_state *child,
+                               struct ottery_state *parent);
+
 /**
  * Add more entropy to an ottery_state structure.
  *
@@ -95,6 +117,27 @@ int ottery_st_init(struct ottery_state *st, const struct ottery_config *cfg);
  */
 int ottery_st_add_seed(struct ottery_state *st, const uint8_t *seed, size_t n);
 
+/**
+ * Reseed an ottery_state from the operating system, without waiting for
+ * the operating system.
+ *
+ * This has the same effect as ottery_st_add_seed(st, NULL, 0), but the
+ * read from the entropy source happens on a helper thread, and this
+ * function returns right away.  When the entropy arrives, the state mixes
+ * it in the next time it generates a block of output; until then, it goes
+ * on using its old key.  If a reseed is already on its way, this function
+ * does nothing.  If the entropy source fails, the state keeps its old key;
+ * nobody is told.
+ *
+ * ottery_st_wipe() waits for the helper thread, if there is one.  On
+ * platforms without threads, this function reseeds right away.
+ *
+ * @param st The state to reseed.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes if we
+ *   couldn't start the helper thread.
+ */
+int ottery_st_request_reseed_async(struct ottery_state *st);
+
 /**
  * Destroy an ottery_state structure and release any resources that it might
  * hold.
@@ -124,6 +167,22 @@ void ottery_st_wipe(struct ottery_state *st);
  */
 void ottery_st_prevent_backtracking(struct ottery_state *st);
 
+/**
+ * Generate the next block of output ahead of time.
+ *
+ * If the state was configured with ottery_config_enable_prefill() and its
+ * spare block is empty, generate the block that the state will need next,
+ * so that whoever exhausts the current block doesn't have to wait for it.
+ * Otherwise, do nothing.
+ *
+ * This function holds the state's lock only briefly: the PRF runs while
+ * other threads go on using the state.  That makes it a good thing to call
+ * from a helper thread or an idle loop.
+ *
+ * @param st The state to prefill.
+ */
+void ottery_st_prefill(struct ottery_state *st);
+
 /**
  * Use an ottery_state structure to fill a buffer with random bytes.
  *
@@ -156,6 +215,36 @@ uint32_t ottery_st_rand_uint32(struct ottery_state *st);
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_uint64(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of
+ * type uint32_t.
+ *
+ * This is much faster than calling ottery_st_rand_uint32() n times: it
+ * takes the lock once, and fills the array at the speed of
+ * ottery_st_rand_bytes().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint32_t would not fit in memory.
+ */
+void ottery_st_rand_uint32_array(struct ottery_state *st,
+                                 uint32_t *out, size_t n);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of
+ * type uint64_t.
+ *
+ * This is much faster than calling ottery_st_rand_uint64() n times: it
+ * takes the lock once, and fills the array at the speed of
+ * ottery_st_rand_bytes().
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint64_t would not fit in memory.
+ */
+void ottery_st_rand_uint64_array(struct ottery_state *st,
+                                 uint64_t *out, size_t n);
 /**
  * Use an ottery_state structure to generate a random number of type unsigned
  * in a given range.
@@ -176,6 +265,226 @@ unsigned ottery_st_rand_range(struct ottery_state *st, unsigned top);
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_range64(struct ottery_state *st, uint64_t top);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of
+ * type uint32_t in a given range.
+ *
+ * This is much faster than calling ottery_st_rand_range() n times.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of uint32_t would not fit in memory.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_st_rand_range_array(struct ottery_state *st,
+                                uint32_t *out, size_t n, uint32_t top);
+/**
+ * Use an ottery_state structure to choose an index at random, with the
+ * weights in an alias table.
+ *
+ * @param st The state structure to use.
+ * @param tbl A table from ottery_alias_table_new().
+ * @return An index less than the number of weights in tbl.
+ */
+uint32_t ottery_st_rand_weighted(struct ottery_state *st,
+                                 const struct ottery_alias_table *tbl);
+/**
+ * Use an ottery_state structure to fill an array with indices chosen at
+ * random, as from ottery_st_rand_weighted().
+ *
+ * This is much faster than calling ottery_st_rand_weighted() n times.
+ *
+ * @param st The state structure to use.
+ * @param tbl A table from ottery_alias_table_new().
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_weighted_array(struct ottery_state *st,
+                                   const struct ottery_alias_table *tbl,
+                                   uint32_t *out, size_t n);
+/**
+ * Use an ottery_state structure to generate a single random bit.
+ *
+ * The state keeps a reservoir of random bits, so this uses only one bit
+ * of PRF output, and is much cheaper than taking the low bit of
+ * ottery_st_rand_unsigned().
+ *
+ * @param st The state structure to use.
+ * @return 0 or 1, each with probability 1/2.
+ */
+int ottery_st_rand_bit(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to return 1 with a given probability, and
+ * 0 otherwise.
+ *
+ * The result is exact for any p, and nearly always uses only 8 random
+ * bits.
+ *
+ * @param st The state structure to use.
+ * @param p The probability of returning 1.  Values of 0 or less (or NaN)
+ *   always give 0; values of 1 or more always give 1.
+ * @return 1 with probability p; 0 otherwise.
+ */
+int ottery_st_rand_bernoulli(struct ottery_state *st, double p);
+/**
+ * Use an ottery_state structure to fill an array of 64-bit words with
+ * random bits, each of which is set with a given probability.
+ *
+ * This takes fewer than 8 random words per output word on average (and
+ * exactly 1 when p is 1/2), so it is much faster than calling
+ * ottery_st_rand_bernoulli() for each bit.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of 64-bit words to write.  It is a fatal error if n
+ *   such words would not fit in memory.
+ * @param p The probability that each bit is set, as for
+ *   ottery_st_rand_bernoulli().
+ */
+void ottery_st_rand_bernoulli_mask(struct ottery_state *st,
+                                   uint64_t *out, size_t n, double p);
+/**
+ * Use an ottery_state structure to generate a random double in [0, 1).
+ *
+ * The result is a multiple of 2^-53, chosen uniformly.
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+double ottery_st_rand_double(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to generate a random float in [0, 1).
+ *
+ * The result is a multiple of 2^-24, chosen uniformly.
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+float ottery_st_rand_float(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to generate a random double in [0, 1),
+ * with full precision.
+ *
+ * Unlike ottery_st_rand_double(), this can return any double in [0, 1):
+ * the result is a real number chosen uniformly from [0, 1), rounded down
+ * to the nearest double.  It is a little slower.
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+double ottery_st_rand_double_full(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to generate a random float in [0, 1),
+ * with full precision.
+ *
+ * As ottery_st_rand_double_full(), but for floats.
+ *
+ * @param st The state structure to use.
+ * @return A random number at least 0 and less than 1.
+ */
+float ottery_st_rand_float_full(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to fill an array with random doubles in
+ * [0, 1), as from ottery_st_rand_double().
+ *
+ * This is much faster than calling ottery_st_rand_double() n times.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of double would not fit in memory.
+ */
+void ottery_st_rand_double_array(struct ottery_state *st,
+                                 double *out, size_t n);
+/**
+ * Use an ottery_state structure to fill an array with random floats in
+ * [0, 1), as from ottery_st_rand_float().
+ *
+ * This is much faster than calling ottery_st_rand_float() n times.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  It is a fatal error if n
+ *   elements of float would not fit in memory.
+ */
+void ottery_st_rand_float_array(struct ottery_state *st,
+                                float *out, size_t n);
+/**
+ * Use an ottery_state structure to put an array into random order.
+ *
+ * Every order is equally likely.  This is much faster than a Fisher-Yates
+ * shuffle built on ottery_st_rand_range(): it takes the lock once for
+ * every few hundred elements, not once per element.  For arrays bigger
+ * than a few hundred kilobytes, it splits the elements into buckets first,
+ * so that it doesn't spend all its time waiting for memory; that needs a
+ * temporary copy of the array and one more byte per element.
+ *
+ * @param st The state structure to use.
+ * @param base The array to shuffle.
+ * @param nmemb The number of elements in the array.
+ * @param size The size of each element, in bytes.
+ */
+void ottery_st_shuffle(struct ottery_state *st, void *base, size_t nmemb,
+                       size_t size);
+/**
+ * Use an ottery_state structure to fill an array with a random
+ * permutation of the numbers 0 through n-1.
+ *
+ * This is the same as setting out[i] to i for each i, and then calling
+ * ottery_st_shuffle(), but a little faster.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.  Must be no more than
+ *   UINT32_MAX + 1; a bigger n is a fatal error.
+ */
+void ottery_st_rand_permutation(struct ottery_state *st,
+                                uint32_t *out, size_t n);
+/**
+ * Use an ottery_state structure to generate a random number from the
+ * standard normal distribution, with mean 0 and standard deviation 1.
+ *
+ * For mean m and standard deviation s, use m + s * ottery_st_rand_normal().
+ *
+ * @param st The state structure to use.
+ * @return A normally distributed random number.
+ */
+double ottery_st_rand_normal(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to generate a random number from the
+ * exponential distribution with rate 1 (and so with mean 1).
+ *
+ * For rate l, use ottery_st_rand_exponential() / l.
+ *
+ * @param st The state structure to use.
+ * @return An exponentially distributed random number, at least 0.
+ */
+double ottery_st_rand_exponential(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to fill an array with random numbers from
+ * the standard normal distribution, as from ottery_st_rand_normal().
+ *
+ * This is much faster than calling ottery_st_rand_normal() n times.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_normal_array(struct ottery_state *st,
+                                 double *out, size_t n);
+/**
+ * Use an ottery_state structure to fill an array with random numbers from
+ * the exponential distribution, as from ottery_st_rand_exponential().
+ *
+ * This is much faster than calling ottery_st_rand_exponential() n times.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_exponential_array(struct ottery_state *st,
+                                      double *out, size_t n);
 
 #ifdef __cplusplus
 }
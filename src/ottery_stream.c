@@ -0,0 +1,368 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+#define OTTERY_INTERNAL
+#include "ottery-internal.h"
+#include "ottery_stream.h"
+#include <string.h>
+
+/*
+ * Deterministic streams.
+ *
+ * A stream is just the output of the PRF under a fixed key, taken in order
+ * of the PRF counter: we never rekey, and we never touch the entropy
+ * sources.  All the ChaCha PRFs produce the same 64-byte blocks for the same
+ * block counter, no matter how many blocks they make per call, so we can
+ * find the PRF output holding any byte of the stream with a division, and
+ * seeking is free.  We remember where the output in our buffer starts, so
+ * that most requests don't need to divide at all.
+ */
+
+#ifdef __GNUC__
+#define UNLIKELY(x) __builtin_expect((x), 0)
+#else
+#define UNLIKELY(x) (x)
+#endif
+
+#ifdef OTTERY_NO_INIT_CHECK
+#define CHECK_STREAM_INIT(s, rv) ((void)0)
+#else
+#define STREAM_MAGIC_BASIS 0x57e4c0deu
+#define STREAM_MAGIC(ptr) (((uint32_t)(uintptr_t)(ptr)) ^ STREAM_MAGIC_BASIS)
+/** Return rv from the calling function if s is not an initialized stream. */
+#define CHECK_STREAM_INIT(s, rv) do {                   \
+    if (UNLIKELY((s)->magic != STREAM_MAGIC(s))) {      \
+      ottery_fatal_error_(OTTERY_ERR_STATE_INIT);       \
+      return rv;                                        \
+    }                                                   \
+  } while (0)
+#endif
+
+/** Total length of a stream, in bytes. */
+#define STREAM_LEN (OTTERY_STREAM_MAX_BLOCKS * OTTERY_STREAM_BLOCK_LEN)
+/** Length of the key material that we take from the seed and stream ID. */
+#define STREAM_KEY_LEN (OTTERY_STREAM_SEED_LEN + 8)
+
+size_t
+ottery_get_sizeof_stream(void)
+{
+  return sizeof(struct ottery_stream);
+}
+
+/** Helper: initialize s to use the given prf, seed, and stream_id. */
+static int
+ottery_stream_init_prf(struct ottery_stream *s,
+                       const struct ottery_prf *prf,
+                       const uint8_t *seed,
+                       uint64_t stream_id)
+{
+  uint8_t key[STREAM_KEY_LEN];
+  unsigned i;
+
+  if (((uintptr_t)s) & 0xf)
+    return OTTERY_ERR_STATE_ALIGNMENT;
+
+  /* We need a PRF that takes a 32-byte key and an 8-byte nonce, and that
+   * makes whole ChaCha blocks. */
+  if (prf->state_bytes != STREAM_KEY_LEN ||
+      prf->output_len % OTTERY_STREAM_BLOCK_LEN)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  if (prf->state_len > MAX_STATE_LEN ||
+      prf->output_len > MAX_OUTPUT_LEN ||
+      sizeof(struct ottery_stream) > OTTERY_STREAM_DUMMY_SIZE_)
+    return OTTERY_ERR_INTERNAL;
+
+  memset(s, 0, sizeof(*s));
+  memcpy(&s->prf, prf, sizeof(*prf));
+
+  memcpy(key, seed, OTTERY_STREAM_SEED_LEN);
+  for (i = 0; i < 8; ++i)
+    key[OTTERY_STREAM_SEED_LEN + i] = (uint8_t)(stream_id >> (8*i));
+  s->prf.setup(s->state, key);
+  ottery_memclear_(key, sizeof(key));
+
+#ifndef OTTERY_NO_INIT_CHECK
+  s->magic = STREAM_MAGIC(s);
+#endif
+  return 0;
+}
+
+int
+ottery_stream_init(struct ottery_stream *s,
+                   const struct ottery_config *cfg,
+                   const uint8_t *seed,
+                   uint64_t stream_id)
+{
+  const struct ottery_prf *prf = NULL;
+
+  if (cfg)
+    prf = cfg->impl;
+  if (!prf)
+    prf = ottery_get_impl_(NULL);
+  if (!prf)
+    return OTTERY_ERR_INTERNAL;
+
+  return ottery_stream_init_prf(s, prf, seed, stream_id);
+}
+
+void
+ottery_stream_wipe(struct ottery_stream *s)
+{
+  ottery_memclear_(s, sizeof(struct ottery_stream));
+}
+
+int
+ottery_stream_seek(struct ottery_stream *s, uint64_t block_idx)
+{
+  CHECK_STREAM_INIT(s, OTTERY_ERR_STATE_INIT);
+  if (block_idx >= OTTERY_STREAM_MAX_BLOCKS)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  s->pos = block_idx * OTTERY_STREAM_BLOCK_LEN;
+  return 0;
+}
+
+int
+ottery_stream_jump(struct ottery_stream *s, uint64_t n_blocks)
+{
+  CHECK_STREAM_INIT(s, OTTERY_ERR_STATE_INIT);
+  if (n_blocks > (STREAM_LEN - s->pos) / OTTERY_STREAM_BLOCK_LEN)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  s->pos += n_blocks * OTTERY_STREAM_BLOCK_LEN;
+  return 0;
+}
+
+uint64_t
+ottery_stream_tell(const struct ottery_stream *s)
+{
+  return s->pos;
+}
+
+/**
+ * Make sure that s->buffer holds the PRF output containing the byte at
+ * s->pos, which must be in the stream.  Return the offset of that byte
+ * in s->buffer.
+ */
+static size_t
+ottery_stream_load_(struct ottery_stream *s)
+{
+  const uint64_t idx = s->pos / s->prf.output_len;
+  const uint64_t start = idx * s->prf.output_len;
+  if (!s->buffer_len || s->buffer_start != start) {
+    s->prf.generate(s->state, s->buffer, (uint32_t)idx);
+    s->buffer_start = start;
+    if (STREAM_LEN - start < s->prf.output_len)
+      s->buffer_len = (uint32_t)(STREAM_LEN - start);
+    else
+      s->buffer_len = s->prf.output_len;
+  }
+  return (size_t)(s->pos - start);
+}
+
+/**
+ * Take n bytes from s.  If they are all in the same block of PRF output,
+ * return a pointer to them in s->buffer.  Otherwise, take nothing, and
+ * return NULL.
+ */
+static inline const uint8_t *
+ottery_stream_take_(struct ottery_stream *s, size_t n)
+{
+  uint64_t off = s->pos - s->buffer_start;
+  if (UNLIKELY(off >= s->buffer_len)) {
+    if (s->pos >= STREAM_LEN)
+      return NULL;
+    off = ottery_stream_load_(s);
+  }
+  if (UNLIKELY(n > s->buffer_len - off))
+    return NULL;
+  s->pos += n;
+  return s->buffer + off;
+}
+
+/**
+ * Take n bytes from s into out.  Return 0 on success, or -1 if there
+ * aren't that many bytes left in the stream.
+ */
+static int
+ottery_stream_bytes_(struct ottery_stream *s, uint8_t *out, size_t n)
+{
+  const size_t output_len = s->prf.output_len;
+
+  if (UNLIKELY(n > STREAM_LEN - s->pos)) {
+    ottery_fatal_error_(OTTERY_ERR_STREAM_EXHAUSTED);
+    memset(out, 0, n);
+    return -1;
+  }
+
+  while (n) {
+    const uint64_t idx = s->pos / output_len;
+    size_t off = (size_t)(s->pos - idx * output_len);
+    size_t cpy;
+    if (off == 0 && n >= output_len && PRF_CAN_GENERATE_INTO(s, out)) {
+      /* A whole block: skip the buffer. */
+      s->prf.generate(s->state, out, (uint32_t)idx);
+      cpy = output_len;
+    } else {
+      off = ottery_stream_load_(s);
+      cpy = output_len - off;
+      if (cpy > n)
+        cpy = n;
+      memcpy(out, s->buffer + off, cpy);
+    }
+    out += cpy;
+    n -= cpy;
+    s->pos += cpy;
+  }
+  return 0;
+}
+
+/** Decode a 4-byte little-endian value. */
+static inline uint32_t
+ottery_le32_(const uint8_t *p)
+{
+  return ((uint32_t)p[0]) | (((uint32_t)p[1]) << 8) |
+    (((uint32_t)p[2]) << 16) | (((uint32_t)p[3]) << 24);
+}
+
+/** Decode an 8-byte little-endian value. */
+static inline uint64_t
+ottery_le64_(const uint8_t *p)
+{
+  return ((uint64_t)ottery_le32_(p)) | (((uint64_t)ottery_le32_(p+4)) << 32);
+}
+
+/** Take a 32-bit value from s into *out.  Return 0 on success, -1 if the
+ * stream is exhausted. */
+static inline int
+ottery_stream_next32_(struct ottery_stream *s, uint32_t *out)
+{
+  uint8_t tmp[4];
+  const uint8_t *p = ottery_stream_take_(s, 4);
+  if (UNLIKELY(p == NULL)) {
+    if (ottery_stream_bytes_(s, tmp, 4))
+      return -1;
+    p = tmp;
+  }
+  *out = ottery_le32_(p);
+  return 0;
+}
+
+/** Take a 64-bit value from s into *out.  Return 0 on success, -1 if the
+ * stream is exhausted. */
+static inline int
+ottery_stream_next64_(struct ottery_stream *s, uint64_t *out)
+{
+  uint8_t tmp[8];
+  const uint8_t *p = ottery_stream_take_(s, 8);
+  if (UNLIKELY(p == NULL)) {
+    if (ottery_stream_bytes_(s, tmp, 8))
+      return -1;
+    p = tmp;
+  }
+  *out = ottery_le64_(p);
+  return 0;
+}
+
+int
+ottery_stream_split(struct ottery_stream *parent,
+                    struct ottery_stream *child)
+{
+  uint8_t key[STREAM_KEY_LEN];
+  int err;
+
+  CHECK_STREAM_INIT(parent, OTTERY_ERR_STATE_INIT);
+  if (STREAM_LEN - parent->pos < sizeof(key))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  ottery_stream_bytes_(parent, key, sizeof(key));
+  err = ottery_stream_init_prf(child, &parent->prf, key,
+                               ottery_le64_(key + OTTERY_STREAM_SEED_LEN));
+  ottery_memclear_(key, sizeof(key));
+  return err;
+}
+
+void
+ottery_stream_bytes(struct ottery_stream *s, void *out, size_t n)
+{
+  CHECK_STREAM_INIT(s, );
+  ottery_stream_bytes_(s, out, n);
+}
+
+uint32_t
+ottery_stream_uint32(struct ottery_stream *s)
+{
+  uint32_t r = 0;
+  CHECK_STREAM_INIT(s, 0);
+  ottery_stream_next32_(s, &r);
+  return r;
+}
+
+uint64_t
+ottery_stream_uint64(struct ottery_stream *s)
+{
+  uint64_t r = 0;
+  CHECK_STREAM_INIT(s, 0);
+  ottery_stream_next64_(s, &r);
+  return r;
+}
+
+/*
+ * The range functions use the same multiply-and-shift method as
+ * ottery_st_rand_range(); we spell it out in doc/specification.txt, since
+ * the values and the number of bytes consumed are part of the stream's
+ * format.
+ */
+uint32_t
+ottery_stream_range(struct ottery_stream *s, uint32_t top)
+{
+  const uint32_t range = top + 1;
+  uint32_t x;
+  uint64_t m;
+
+  CHECK_STREAM_INIT(s, 0);
+  if (ottery_stream_next32_(s, &x))
+    return 0;
+  if (range == 0)
+    return x;
+  m = (uint64_t)x * range;
+  if (UNLIKELY((uint32_t)m < range)) {
+    const uint32_t threshold = (0u - range) % range;
+    while ((uint32_t)m < threshold) {
+      if (ottery_stream_next32_(s, &x))
+        return 0;
+      m = (uint64_t)x * range;
+    }
+  }
+  return (uint32_t)(m >> 32);
+}
+
+uint64_t
+ottery_stream_range64(struct ottery_stream *s, uint64_t top)
+{
+  const uint64_t range = top + 1;
+  uint64_t x, hi, lo;
+
+  CHECK_STREAM_INIT(s, 0);
+  if (ottery_stream_next64_(s, &x))
+    return 0;
+  if (range == 0)
+    return x;
+  hi = ottery_mul64_(x, range, &lo);
+  if (UNLIKELY(lo < range)) {
+    const uint64_t threshold = (0u - range) % range;
+    while (lo < threshold) {
+      if (ottery_stream_next64_(s, &x))
+        return 0;
+      hi = ottery_mul64_(x, range, &lo);
+    }
+  }
+  return hi;
+}
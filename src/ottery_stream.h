@@ -0,0 +1,204 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+#ifndef OTTERY_STREAM_H_HEADER_INCLUDED_
+#define OTTERY_STREAM_H_HEADER_INCLUDED_
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ottery_common.h"
+
+/** @file
+ *
+ * Deterministic, seekable random streams.
+ *
+ * An ottery_stream is NOT a source of secure random numbers: it produces
+ * exactly the same output every time you give it the same seed, and it
+ * never mixes in entropy from the operating system.  It is meant for
+ * things like simulations, where you need reproducible randomness, and
+ * where many workers need to draw from a common seed without coordinating
+ * with each other.
+ *
+ * A stream is named by a PRF, a seed of OTTERY_STREAM_SEED_LEN bytes, and a
+ * 64-bit stream ID.  Its output is a fixed sequence of
+ * OTTERY_STREAM_MAX_BLOCKS blocks of OTTERY_STREAM_BLOCK_LEN bytes, as
+ * described in doc/specification.txt; future versions of libottery will
+ * produce the same bytes, and so will every implementation of the same PRF.
+ * Every ottery_stream_* function that returns random data consumes bytes
+ * from the current position in that sequence.
+ *
+ * Streams are not thread-safe: give each thread its own.
+ */
+
+struct ottery_config;
+struct ottery_stream;
+
+/** Number of bytes in the seed for a stream. */
+#define OTTERY_STREAM_SEED_LEN 32
+/** Number of bytes in each block of a stream's output. */
+#define OTTERY_STREAM_BLOCK_LEN 64
+/** Number of blocks in a stream.  Reading past the end of a stream is a
+ * fatal error. */
+#define OTTERY_STREAM_MAX_BLOCKS (((uint64_t)1) << 32)
+
+/** Size reserved for struct ottery_stream */
+#define OTTERY_STREAM_DUMMY_SIZE_ 1536
+
+#ifndef OTTERY_INTERNAL
+/**
+ * The state for a deterministic random stream.
+ *
+ * An ottery_stream structure is constucted with ottery_stream_init().  It
+ * MUST be aligned on a 16-byte boundary.
+ *
+ * The contents of this structure are opaque; The definition here is
+ * defined to be large enough so that programs that allocate it will get
+ * more than enough room.
+ */
+struct __attribute__((aligned(16))) ottery_stream {
+  /** Nothing to see here */
+  uint8_t dummy_[OTTERY_STREAM_DUMMY_SIZE_];
+};
+#endif
+
+/**
+ * Get the minimal size for allocating an ottery_stream.
+ *
+ * @return The minimal number of bytes to use when allocating an
+ *   ottery_stream structure.
+ */
+size_t ottery_get_sizeof_stream(void);
+
+/**
+ * Initialize a deterministic stream, and set its position to the start.
+ *
+ * @param s The stream to initialize.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().  Only the PRF choice from
+ *   ottery_config_force_implementation() matters here: different PRFs
+ *   produce different streams.  The default is CHACHA20.
+ * @param seed A seed of OTTERY_STREAM_SEED_LEN bytes.
+ * @param stream_id Which of the streams for this seed to produce.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_stream_init(struct ottery_stream *s,
+                       const struct ottery_config *cfg,
+                       const uint8_t *seed,
+                       uint64_t stream_id);
+
+/**
+ * Derive a new stream from an existing one.
+ *
+ * Consumes OTTERY_STREAM_SEED_LEN + 8 bytes from parent, and uses them as
+ * the seed and stream ID for child.  The child uses the same PRF as the
+ * parent.  Calling this repeatedly gives a tree of streams that are
+ * independent of each other and of the parent's later output.
+ *
+ * @param parent The stream to derive from.
+ * @param child The stream to initialize.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_stream_split(struct ottery_stream *parent,
+                        struct ottery_stream *child);
+
+/**
+ * Erase a stream.
+ *
+ * @param s The stream to wipe.
+ */
+void ottery_stream_wipe(struct ottery_stream *s);
+
+/**
+ * Move to the start of a given block in a stream.
+ *
+ * This takes constant time, no matter how far away the block is.
+ *
+ * @param s The stream to reposition.
+ * @param block_idx The index of the block to move to.  Must be less than
+ *   OTTERY_STREAM_MAX_BLOCKS.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if block_idx is
+ *   out of range.
+ */
+int ottery_stream_seek(struct ottery_stream *s, uint64_t block_idx);
+
+/**
+ * Skip forward in a stream by a given number of blocks.
+ *
+ * This takes constant time, no matter how far we skip.  The position
+ * within the current block stays the same.
+ *
+ * @param s The stream to reposition.
+ * @param n_blocks The number of blocks to skip.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if that would
+ *   move past the end of the stream.  On failure, the position is
+ *   unchanged.
+ */
+int ottery_stream_jump(struct ottery_stream *s, uint64_t n_blocks);
+
+/**
+ * Return the current position of a stream, in bytes from its start.
+ */
+uint64_t ottery_stream_tell(const struct ottery_stream *s);
+
+/**
+ * Take bytes from a stream.
+ *
+ * @param s The stream to use.
+ * @param out A buffer to hold the bytes.
+ * @param n The number of bytes to take.
+ */
+void ottery_stream_bytes(struct ottery_stream *s, void *out, size_t n);
+
+/**
+ * Take a 32-bit value from a stream: the next 4 bytes, in little-endian
+ * order.
+ *
+ * @param s The stream to use.
+ */
+uint32_t ottery_stream_uint32(struct ottery_stream *s);
+
+/**
+ * Take a 64-bit value from a stream: the next 8 bytes, in little-endian
+ * order.
+ *
+ * @param s The stream to use.
+ */
+uint64_t ottery_stream_uint64(struct ottery_stream *s);
+
+/**
+ * Take a value between 0 and top, inclusive, from a stream, with each
+ * value equally likely.  The number of bytes consumed depends on the
+ * values drawn; see doc/specification.txt.
+ *
+ * @param s The stream to use.
+ * @param top The upper bound of the range (inclusive).
+ */
+uint32_t ottery_stream_range(struct ottery_stream *s, uint32_t top);
+
+/**
+ * As ottery_stream_range(), but for 64-bit values.
+ *
+ * @param s The stream to use.
+ * @param top The upper bound of the range (inclusive).
+ */
+uint64_t ottery_stream_range64(struct ottery_stream *s, uint64_t top);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,10 +11,35 @@
    work in doc/cc0.txt.  If not, see
       <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
+
+/*
+ * Benchmark harness for libottery.
+ *
+ * Every benchmark is a function that performs some operation a given number
+ * of times.  We pick an iteration count so that one sample takes about
+ * --sample-ms milliseconds, run a few warm-up samples, then take --reps
+ * timed samples, and report the median and the spread of the time per
+ * operation.  Times come from CLOCK_MONOTONIC_RAW where we have it; on x86
+ * we also read the time-stamp counter, so we can report cycles per byte.
+ * (The TSC ticks at a fixed reference rate, which is not quite the core
+ * clock on a CPU with frequency scaling.  Pin the frequency if you need
+ * exact numbers.)
+ *
+ * Suites:
+ *   prf      Raw speed of every PRF implementation this CPU can run.
+ *   api      Single-threaded speed of the locked, nolock and global APIs.
+ *   threads  Aggregate throughput with 1..N threads, for the locked,
+ *            nolock, global, per-thread global and per-CPU global APIs.
+ *   other    Other RNGs, for comparison.
+ *
+ * Usage: bench_rng [--json] [--quick] [--reps=N] [--warmup=N]
+ *                  [--sample-ms=N] [--threads=N] [suite...]
+ */
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 #define NO_URANDOM
@@ -31,76 +56,15 @@
 #include <openssl/rand.h>
 #endif
 
+#define OTTERY_INTERNAL
 #include "ottery-internal.h"
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
 
-#define N 10000000
-
-#define TIME_UNSIGNED_RNG(rng_fn) do {                           \
-    struct timeval start, end;                                   \
-    unsigned accumulator = 0;                                    \
-    int i;                                                       \
-    gettimeofday(&start, NULL);                                  \
-    for (i = 0; i < N; ++i) {                                    \
-      accumulator += (unsigned)(rng_fn);                         \
-    }                                                            \
-    gettimeofday(&end, NULL);                                    \
-    uint64_t usec = end.tv_sec - start.tv_sec;                   \
-    usec *= 1000000;                                             \
-    usec += end.tv_usec - start.tv_usec;                         \
-    printf("%s: %f nsec per call\n", __func__, (usec*1000.0)/N); \
-} while (0)
-
-#define N2 100000
-
-#define TIME_BUF(buf_sz, rng_fn) do {                             \
-    struct timeval start, end;                                    \
-    unsigned char buf[buf_sz];                                    \
-    int i;                                                        \
-    gettimeofday(&start, NULL);                                   \
-    for (i = 0; i < N2; ++i) {                                    \
-      rng_fn;                                                     \
-    }                                                             \
-    gettimeofday(&end, NULL);                                     \
-    uint64_t usec = end.tv_sec - start.tv_sec;                    \
-    usec *= 1000000;                                              \
-    usec += end.tv_usec - start.tv_usec;                          \
-    printf("%s: %f nsec per call\n", __func__, (usec*1000.0)/N2); \
-                                                                  \
-} while (0)
-
-
-struct ottery_state s8;
-struct ottery_state s12;
-struct ottery_state s20;
-struct ottery_state_nolock s8nl;
-struct ottery_state_nolock s12nl;
-struct ottery_state_nolock s20nl;
-
-#ifndef NO_URANDOM
-int urandom_fd = -1;
-
-static void
-urandom_buf(void *buf, size_t n)
-{
-  read(urandom_fd, buf, n);
-}
-static unsigned
-urandom_unsigned(void)
-{
-  unsigned u;
-  read(urandom_fd, (void*)&u, sizeof(u));
-  return u;
-}
-static uint64_t
-urandom_u64(void)
-{
-  uint64_t u;
-  read(urandom_fd, (void*)&u, sizeof(u));
-  return u;
-}
+#ifdef OTTERY_THREAD_STATES
+#define BENCH_THREADS
+#include <pthread.h>
 #endif
 
 #if defined(i386) || \
@@ -109,344 +73,895 @@ urandom_u64(void)
     defined(__M_IX86) || \
     defined(_M_IX86) || \
     defined(__INTEL_COMPILER)
-static unsigned
-rdrand(void)
+#define BENCH_X86
+#endif
+
+/** Largest number of samples we take for any one benchmark. */
+#define MAX_REPS 101
+/** Largest number of results we report in one run. */
+#define MAX_RESULTS 1024
+/** Largest number of threads we try in the threads suite. */
+#define MAX_THREADS 256
+
+/** Command-line options. */
+static struct {
+  int json;
+  int warmup;
+  int reps;
+  double sample_ms;
+  int max_threads;
+} opt = { 0, 2, 11, 20.0, 0 };
+
+/** Benchmarks write here so that the compiler can't drop their work. */
+static volatile uint64_t sink;
+
+/* ------------------------------------------------------------ */
+/* Clocks */
+
+#if defined(CLOCK_MONOTONIC_RAW)
+#define BENCH_CLOCK CLOCK_MONOTONIC_RAW
+#define BENCH_CLOCK_NAME "CLOCK_MONOTONIC_RAW"
+#else
+#define BENCH_CLOCK CLOCK_MONOTONIC
+#define BENCH_CLOCK_NAME "CLOCK_MONOTONIC"
+#endif
+
+/** Return the current time in nanoseconds. */
+static uint64_t
+now_ns(void)
 {
-  unsigned therand;
-  unsigned char status;
-  __asm volatile(".byte 0x0F, 0xC7, 0xF0 ; setc %1"
-               : "=a" (therand), "=qm" (status));
-  assert(status);
-  return therand;
+  struct timespec ts;
+  clock_gettime(BENCH_CLOCK, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
 }
-#else
-static unsigned
-rdrand(void)
+
+/** Return the time-stamp counter, or 0 if we don't have one. */
+static inline uint64_t
+now_cycles(void)
 {
+#ifdef BENCH_X86
+  uint32_t lo, hi;
+  __asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (((uint64_t)hi) << 32) | lo;
+#else
   return 0;
-}
 #endif
+}
 
-
-#define CHACHA_SUITE(fn_suffix, state, ottery_suffix)                                 \
-  void                                                                                \
-  time_ ## fn_suffix (void)                                                           \
-  {                                                                                   \
-    TIME_UNSIGNED_RNG((ottery_st_rand_unsigned ## ottery_suffix (state)));            \
-  }                                                                                   \
-  void                                                                                \
-    time_ ## fn_suffix ## _u64(void)                                                  \
-  {                                                                                   \
-    TIME_UNSIGNED_RNG((ottery_st_rand_uint64 ## ottery_suffix (state)));              \
-  }                                                                                   \
-  void                                                                                \
-    time_ ## fn_suffix ## _onebyte(void)                                              \
-  {                                                                                   \
-    TIME_BUF(1, ottery_st_rand_bytes ## ottery_suffix(state, buf, sizeof(buf)));      \
-  }                                                                                   \
-  void                                                                                \
-    time_ ## fn_suffix ## _buf16(void)                                                \
-  {                                                                                   \
-    TIME_BUF(16, (ottery_st_rand_bytes ## ottery_suffix(state, buf, sizeof(buf))));   \
-  }                                                                                   \
-  void                                                                                \
-    time_ ## fn_suffix ## _buf1024(void)                                              \
-  {                                                                                   \
-    TIME_BUF(1024, (ottery_st_rand_bytes ## ottery_suffix(state, buf, sizeof(buf)))); \
+/** Return the name of the PRF that a default state uses. */
+static const char *
+default_prf_name(void)
+{
+  static char name[64];
+  struct ottery_state_nolock st;
+  if (!name[0]) {
+    if (ottery_st_init_nolock(&st, NULL))
+      return "unknown";
+    snprintf(name, sizeof(name), "%s", st.prf.flav);
+    ottery_st_wipe_nolock(&st);
   }
+  return name;
+}
 
-CHACHA_SUITE(chacharand8, &s8, );
-CHACHA_SUITE(chacharand12, &s12, );
-CHACHA_SUITE(chacharand20, &s20, );
-CHACHA_SUITE(chacharand8nl, &s8nl, _nolock );
-CHACHA_SUITE(chacharand12nl, &s12nl, _nolock );
-CHACHA_SUITE(chacharand20nl, &s20nl, _nolock );
-
-void
-time_rdrandom(void)
+/* ------------------------------------------------------------ */
+/* Results */
+
+/** The samples and summary for one benchmark. */
+struct result {
+  const char *suite;
+  char name[96];
+  /** Number of threads, or 0 for a single-threaded benchmark. */
+  int threads;
+  /** Bytes produced per operation, or 0 if that isn't meaningful. */
+  double bytes_per_op;
+  /** Operations per sample (per thread, for threaded benchmarks). */
+  uint64_t iters;
+  int n_samples;
+  double ns_per_op[MAX_REPS];
+  double cycles_per_op[MAX_REPS];
+};
+
+static struct result results[MAX_RESULTS];
+static int n_results = 0;
+
+static int
+cmp_double(const void *a_, const void *b_)
 {
-  TIME_UNSIGNED_RNG(rdrand());
+  const double a = *(const double *)a_, b = *(const double *)b_;
+  return (a < b) ? -1 : (a > b) ? 1 : 0;
 }
 
-#ifndef NO_URANDOM
-void
-time_urandom(void)
+/** Return the q'th quantile of the n sorted values in v. */
+static double
+quantile(const double *v, int n, double q)
 {
-  TIME_UNSIGNED_RNG((urandom_unsigned()));
+  return v[(int)((n - 1) * q + 0.5)];
 }
-#endif
 
-void
-time_arc4random(void)
+/** Sort the samples in r, and print it if we're not writing JSON. */
+static void
+finish_result(struct result *r)
 {
-#ifdef HAVE_ARC4RANDOM
-  TIME_UNSIGNED_RNG((arc4random()));
+  double med, ops_per_sec;
+  qsort(r->ns_per_op, r->n_samples, sizeof(double), cmp_double);
+  qsort(r->cycles_per_op, r->n_samples, sizeof(double), cmp_double);
+  if (opt.json)
+    return;
+
+  med = quantile(r->ns_per_op, r->n_samples, 0.5);
+  ops_per_sec = med > 0 ? 1e9 / med : 0;
+  printf("%-8s %-40s", r->suite, r->name);
+  if (r->threads)
+    printf(" %3dT", r->threads);
+  else
+    printf("     ");
+  printf(" %10.2f ns/op [p10 %9.2f, p90 %9.2f]",
+         med, quantile(r->ns_per_op, r->n_samples, 0.1),
+         quantile(r->ns_per_op, r->n_samples, 0.9));
+  if (r->bytes_per_op > 0) {
+    printf(" %9.1f MB/s", ops_per_sec * r->bytes_per_op / 1e6);
+#ifdef BENCH_X86
+    printf(" %7.3f cyc/B",
+           quantile(r->cycles_per_op, r->n_samples, 0.5) / r->bytes_per_op);
 #endif
+  } else {
+    printf(" %9.2f Mop/s", ops_per_sec / 1e6);
+  }
+  puts("");
 }
 
-#ifdef _WIN32
-#define libc_random() ((rand()<<16)+rand())
+/** Write every result as one JSON object on stdout. */
+static void
+print_json(void)
+{
+  int i, j;
+  printf("{\n  \"clock\": \"%s\",\n", BENCH_CLOCK_NAME);
+#ifdef BENCH_X86
+  printf("  \"tsc\": true,\n");
 #else
-#define libc_random() random()
+  printf("  \"tsc\": false,\n");
 #endif
+  printf("  \"default_prf\": \"%s\",\n", default_prf_name());
+  printf("  \"warmup\": %d,\n  \"reps\": %d,\n", opt.warmup, opt.reps);
+  printf("  \"results\": [\n");
+  for (i = 0; i < n_results; ++i) {
+    const struct result *r = &results[i];
+    const double med = quantile(r->ns_per_op, r->n_samples, 0.5);
+    const double cyc = quantile(r->cycles_per_op, r->n_samples, 0.5);
+    printf("    {\"suite\": \"%s\", \"name\": \"%s\", \"threads\": %d, "
+           "\"iters\": %llu, \"bytes_per_op\": %g,\n",
+           r->suite, r->name, r->threads ? r->threads : 1,
+           (unsigned long long)r->iters, r->bytes_per_op);
+    printf("     \"ns_per_op\": {\"median\": %.4f, \"min\": %.4f, "
+           "\"p10\": %.4f, \"p90\": %.4f, \"max\": %.4f},\n",
+           med, r->ns_per_op[0],
+           quantile(r->ns_per_op, r->n_samples, 0.1),
+           quantile(r->ns_per_op, r->n_samples, 0.9),
+           r->ns_per_op[r->n_samples - 1]);
+    printf("     \"cycles_per_op\": %.4f, \"cycles_per_byte\": %.4f, "
+           "\"mb_per_sec\": %.4f,\n",
+           cyc, r->bytes_per_op > 0 ? cyc / r->bytes_per_op : 0.0,
+           (r->bytes_per_op > 0 && med > 0) ?
+             1e3 * r->bytes_per_op / med : 0.0);
+    printf("     \"samples_ns_per_op\": [");
+    for (j = 0; j < r->n_samples; ++j)
+      printf("%s%.4f", j ? ", " : "", r->ns_per_op[j]);
+    printf("]}%s\n", (i + 1 < n_results) ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+/* ------------------------------------------------------------ */
+/* Single-threaded runner */
 
-void
-time_libc_random(void)
+/** A benchmark: do some operation 'iters' times. */
+typedef void (*bench_fn)(void *arg, uint64_t iters);
+
+/** Helper: time one sample of fn. */
+static void
+time_sample(bench_fn fn, void *arg, uint64_t iters,
+            uint64_t *ns_out, uint64_t *cycles_out)
 {
-  TIME_UNSIGNED_RNG((libc_random()));
+  uint64_t t0, c0, t1, c1;
+  t0 = now_ns();
+  c0 = now_cycles();
+  fn(arg, iters);
+  c1 = now_cycles();
+  t1 = now_ns();
+  *ns_out = t1 - t0;
+  *cycles_out = c1 - c0;
 }
 
+/** Return an iteration count for which fn takes about opt.sample_ms. */
+static uint64_t
+calibrate(bench_fn fn, void *arg)
+{
+  const uint64_t target = (uint64_t)(opt.sample_ms * 1e6);
+  uint64_t iters = 1, ns, cycles;
+  for (;;) {
+    time_sample(fn, arg, iters, &ns, &cycles);
+    if (ns >= target / 4 || iters >= ((uint64_t)1) << 40)
+      break;
+    iters *= 4;
+  }
+  if (ns == 0)
+    ns = 1;
+  iters = (uint64_t)((double)iters * target / ns);
+  return iters ? iters : 1;
+}
 
-#ifndef NO_URANDOM
-void
-time_urandom_u64(void)
+/** Allocate a new result. */
+static struct result *
+new_result(const char *suite, const char *name, double bytes_per_op)
 {
-  TIME_UNSIGNED_RNG((urandom_u64()));
+  struct result *r;
+  if (n_results == MAX_RESULTS) {
+    fprintf(stderr, "Too many results.\n");
+    exit(1);
+  }
+  r = &results[n_results++];
+  memset(r, 0, sizeof(*r));
+  r->suite = suite;
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->bytes_per_op = bytes_per_op;
+  return r;
 }
-#endif
-void
-time_libc_random_u64(void)
+
+/** Run and report a single-threaded benchmark. */
+static void
+run_bench(const char *suite, const char *name, double bytes_per_op,
+          bench_fn fn, void *arg)
 {
-  TIME_UNSIGNED_RNG((((uint64_t)libc_random()) << 32) + libc_random());
+  struct result *r = new_result(suite, name, bytes_per_op);
+  uint64_t ns, cycles;
+  int i;
+
+  r->iters = calibrate(fn, arg);
+  for (i = 0; i < opt.warmup; ++i)
+    time_sample(fn, arg, r->iters, &ns, &cycles);
+  for (i = 0; i < opt.reps; ++i) {
+    time_sample(fn, arg, r->iters, &ns, &cycles);
+    r->ns_per_op[i] = (double)ns / r->iters;
+    r->cycles_per_op[i] = (double)cycles / r->iters;
+  }
+  r->n_samples = opt.reps;
+  finish_result(r);
 }
 
+/* ------------------------------------------------------------ */
+/* The prf suite */
 
-#ifdef HAVE_ARC4RANDOM_BUF
-static inline uint64_t
-arc4random_u64(void)
+/** Argument for PRF benchmarks. */
+struct prf_arg {
+  const struct ottery_prf *prf;
+  __attribute__((aligned(16))) uint8_t state[MAX_STATE_LEN];
+  __attribute__((aligned(64))) uint8_t out[MAX_OUTPUT_LEN];
+};
+
+static void
+bench_prf_generate(void *arg_, uint64_t iters)
 {
-  uint64_t x;
-  arc4random_buf((void*)&x, sizeof(x));
-  return x;
+  struct prf_arg *arg = arg_;
+  uint64_t i;
+  for (i = 0; i < iters; ++i)
+    arg->prf->generate(arg->state, arg->out, (uint32_t)i);
+  sink += arg->out[0];
 }
+
+static const struct ottery_prf *all_prfs[] = {
+  &ottery_prf_chacha8_merged_,
+  &ottery_prf_chacha12_merged_,
+  &ottery_prf_chacha20_merged_,
+  &ottery_prf_chacha8_merged_small_,
+  &ottery_prf_chacha12_merged_small_,
+  &ottery_prf_chacha20_merged_small_,
+#ifdef HAVE_SIMD_CHACHA
+  &ottery_prf_chacha8_krovetz_1_,
+  &ottery_prf_chacha12_krovetz_1_,
+  &ottery_prf_chacha20_krovetz_1_,
+#endif
+#ifdef HAVE_SIMD_CHACHA_2
+  &ottery_prf_chacha8_krovetz_2_,
+  &ottery_prf_chacha12_krovetz_2_,
+  &ottery_prf_chacha20_krovetz_2_,
+#endif
+#ifdef HAVE_SIMD_CHACHA_AVX2
+  &ottery_prf_chacha8_avx2_,
+  &ottery_prf_chacha12_avx2_,
+  &ottery_prf_chacha20_avx2_,
+#endif
+#ifdef HAVE_SIMD_CHACHA_AVX512
+  &ottery_prf_chacha8_avx512_,
+  &ottery_prf_chacha12_avx512_,
+  &ottery_prf_chacha20_avx512_,
 #endif
+  NULL
+};
 
-void
-time_arc4random_u64(void)
+static void
+suite_prf(void)
 {
-#ifdef HAVE_ARC4RANDOM_BUF
-  TIME_UNSIGNED_RNG((arc4random_u64()));
-#endif
+  static struct prf_arg arg;
+  uint8_t key[MAX_STATE_BYTES];
+  int i;
+
+  for (i = 0; i < (int)sizeof(key); ++i)
+    key[i] = (uint8_t)(i * 7 + 1);
+
+  for (i = 0; all_prfs[i]; ++i) {
+    const struct ottery_prf *prf = all_prfs[i];
+    const uint32_t caps = ottery_get_cpu_capabilities_();
+    if ((prf->required_cpucap & caps) != prf->required_cpucap)
+      continue;
+    memset(&arg, 0, sizeof(arg));
+    arg.prf = prf;
+    prf->setup(arg.state, key);
+    run_bench("prf", prf->flav, prf->output_len, bench_prf_generate, &arg);
+  }
 }
 
-#ifndef NO_OPENSSL
-static inline unsigned
-openssl_random(void)
+/* ------------------------------------------------------------ */
+/* The api suite */
+
+/** Argument for API benchmarks. */
+struct api_arg {
+  void *st;
+  size_t n;
+  uint8_t *buf;
+};
+
+/** Define a benchmark that evaluates 'expr' once per iteration, with 'st'
+ * bound to the state and 'arg' to the struct api_arg. */
+#define API_BENCH(fname, st_type, expr)               \
+  static void                                         \
+  fname(void *arg_, uint64_t iters)                   \
+  {                                                   \
+    struct api_arg *arg = arg_;                       \
+    st_type *st = arg->st;                            \
+    uint64_t i, acc = 0;                              \
+    (void)st;                                         \
+    (void)arg;                                        \
+    for (i = 0; i < iters; ++i) {                     \
+      acc += (uint64_t)(expr);                        \
+    }                                                 \
+    sink += acc;                                      \
+  }
+
+/** Define the usual set of benchmarks for one flavor of the API. */
+#define API_SUITE(sfx, st_type, uint32_fn, uint64_fn, range_fn,          \
+                  bytes_fn, array_fn, double_fn, darray_fn,              \
+                  normal_fn, narray_fn)                                  \
+  API_BENCH(bench_uint32_ ## sfx, st_type, uint32_fn)                    \
+  API_BENCH(bench_uint64_ ## sfx, st_type, uint64_fn)                    \
+  API_BENCH(bench_range_ ## sfx, st_type, range_fn)                      \
+  API_BENCH(bench_bytes_ ## sfx, st_type, (bytes_fn, arg->buf[0]))       \
+  API_BENCH(bench_array_ ## sfx, st_type, (array_fn, arg->buf[0]))       \
+  API_BENCH(bench_double_ ## sfx, st_type, (double_fn) * 4294967296.0)   \
+  API_BENCH(bench_darray_ ## sfx, st_type, (darray_fn, arg->buf[0]))     \
+  API_BENCH(bench_normal_ ## sfx, st_type, (normal_fn) * 4294967296.0)   \
+  API_BENCH(bench_narray_ ## sfx, st_type, (narray_fn, arg->buf[0]))
+
+API_SUITE(locked, struct ottery_state,
+          ottery_st_rand_uint32(st),
+          ottery_st_rand_uint64(st),
+          ottery_st_rand_range(st, 1000),
+          ottery_st_rand_bytes(st, arg->buf, arg->n),
+          ottery_st_rand_uint32_array(st, (uint32_t *)arg->buf, arg->n / 4),
+          ottery_st_rand_double(st),
+          ottery_st_rand_double_array(st, (double *)arg->buf, arg->n / 8),
+          ottery_st_rand_normal(st),
+          ottery_st_rand_normal_array(st, (double *)arg->buf, arg->n / 8))
+API_SUITE(nolock, struct ottery_state_nolock,
+          ottery_st_rand_uint32_nolock(st),
+          ottery_st_rand_uint64_nolock(st),
+          ottery_st_rand_range_nolock(st, 1000),
+          ottery_st_rand_bytes_nolock(st, arg->buf, arg->n),
+          ottery_st_rand_uint32_array_nolock(st, (uint32_t *)arg->buf,
+                                             arg->n / 4),
+          ottery_st_rand_double_nolock(st),
+          ottery_st_rand_double_array_nolock(st, (double *)arg->buf,
+                                             arg->n / 8),
+          ottery_st_rand_normal_nolock(st),
+          ottery_st_rand_normal_array_nolock(st, (double *)arg->buf,
+                                             arg->n / 8))
+API_SUITE(global, void,
+          ottery_rand_uint32(),
+          ottery_rand_uint64(),
+          ottery_rand_range(1000),
+          ottery_rand_bytes(arg->buf, arg->n),
+          ottery_rand_uint32_array((uint32_t *)arg->buf, arg->n / 4),
+          ottery_rand_double(),
+          ottery_rand_double_array((double *)arg->buf, arg->n / 8),
+          ottery_rand_normal(),
+          ottery_rand_normal_array((double *)arg->buf, arg->n / 8))
+
+/** One flavor of the API, for the api and threads suites. */
+struct api_flavor {
+  const char *name;
+  bench_fn uint32_fn, uint64_fn, range_fn, bytes_fn, array_fn;
+  bench_fn double_fn, darray_fn;
+  bench_fn normal_fn, narray_fn;
+};
+
+static const struct api_flavor api_flavors[] = {
+  { "locked", bench_uint32_locked, bench_uint64_locked, bench_range_locked,
+    bench_bytes_locked, bench_array_locked,
+    bench_double_locked, bench_darray_locked,
+    bench_normal_locked, bench_narray_locked },
+  { "nolock", bench_uint32_nolock, bench_uint64_nolock, bench_range_nolock,
+    bench_bytes_nolock, bench_array_nolock,
+    bench_double_nolock, bench_darray_nolock,
+    bench_normal_nolock, bench_narray_nolock },
+  { "global", bench_uint32_global, bench_uint64_global, bench_range_global,
+    bench_bytes_global, bench_array_global,
+    bench_double_global, bench_darray_global,
+    bench_normal_global, bench_narray_global },
+  { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/** Allocate and initialize a state for the given API flavor.  Returns NULL
+ * for the global API. */
+static void *
+new_api_state(const char *flavor)
 {
-  unsigned u;
-  RAND_bytes((void*)&u, sizeof(u));
-  return u;
+  void *st = NULL;
+  int err = 0;
+  if (!strcmp(flavor, "locked")) {
+    if (posix_memalign(&st, 64, ottery_get_sizeof_state()))
+      abort();
+    err = ottery_st_init(st, NULL);
+  } else if (!strcmp(flavor, "nolock")) {
+    if (posix_memalign(&st, 64, ottery_get_sizeof_state_nolock()))
+      abort();
+    err = ottery_st_init_nolock(st, NULL);
+  }
+  if (err) {
+    fprintf(stderr, "Couldn't initialize a state: %d\n", err);
+    exit(1);
+  }
+  return st;
 }
-#endif
-void
-time_openssl_random(void)
+
+static void
+free_api_state(const char *flavor, void *st)
 {
-#ifndef NO_OPENSSL
-  TIME_UNSIGNED_RNG((openssl_random()));
-#endif
+  if (!st)
+    return;
+  if (!strcmp(flavor, "locked"))
+    ottery_st_wipe(st);
+  else
+    ottery_st_wipe_nolock(st);
+  free(st);
 }
 
-static inline void
-libc_random_buf(void *b, size_t n)
+static void
+suite_api(void)
 {
-  unsigned *cp = b;
-  unsigned i;
-  for (i = 0; i < n/sizeof(unsigned); ++i) {
-    *cp++ = libc_random();
+  static const size_t buf_sizes[] = { 1, 16, 1024, 65536, 0 };
+  static uint8_t buf[65536];
+  struct api_arg arg;
+  char name[96];
+  int i, j;
+
+  ottery_init(NULL);
+  for (i = 0; api_flavors[i].name; ++i) {
+    const struct api_flavor *f = &api_flavors[i];
+    memset(&arg, 0, sizeof(arg));
+    arg.st = new_api_state(f->name);
+    arg.buf = buf;
+
+    snprintf(name, sizeof(name), "%s/uint32", f->name);
+    run_bench("api", name, 4, f->uint32_fn, &arg);
+    snprintf(name, sizeof(name), "%s/uint64", f->name);
+    run_bench("api", name, 8, f->uint64_fn, &arg);
+    snprintf(name, sizeof(name), "%s/range(1000)", f->name);
+    run_bench("api", name, 0, f->range_fn, &arg);
+    for (j = 0; buf_sizes[j]; ++j) {
+      arg.n = buf_sizes[j];
+      snprintf(name, sizeof(name), "%s/bytes(%u)", f->name,
+               (unsigned)arg.n);
+      run_bench("api", name, arg.n, f->bytes_fn, &arg);
+    }
+    arg.n = 4096;
+    snprintf(name, sizeof(name), "%s/uint32_array(1024)", f->name);
+    run_bench("api", name, arg.n, f->array_fn, &arg);
+    snprintf(name, sizeof(name), "%s/double", f->name);
+    run_bench("api", name, 8, f->double_fn, &arg);
+    arg.n = 8192;
+    snprintf(name, sizeof(name), "%s/double_array(1024)", f->name);
+    run_bench("api", name, arg.n, f->darray_fn, &arg);
+    snprintf(name, sizeof(name), "%s/normal", f->name);
+    run_bench("api", name, 8, f->normal_fn, &arg);
+    snprintf(name, sizeof(name), "%s/normal_array(1024)", f->name);
+    run_bench("api", name, arg.n, f->narray_fn, &arg);
+
+    free_api_state(f->name, arg.st);
   }
+  ottery_wipe();
 }
 
-static inline void
-rdrandom_buf(void *b, size_t n)
+/* ------------------------------------------------------------ */
+/* The threads suite */
+
+#ifdef BENCH_THREADS
+/** Per-thread information for a threaded sample. */
+struct thread_job {
+  pthread_t thread;
+  pthread_barrier_t *barrier;
+  const char *flavor;
+  bench_fn fn;
+  struct api_arg arg;
+  uint64_t iters;
+  uint8_t buf[1024];
+  uint64_t start_ns, end_ns;
+  uint64_t start_cycles, end_cycles;
+};
+
+static void *
+thread_main(void *job_)
 {
-  unsigned *cp = b;
-  unsigned i;
-  for (i = 0; i < n/sizeof(unsigned); ++i) {
-    *cp++ = rdrand();
+  struct thread_job *job = job_;
+  /* Each nolock thread gets its own state; everybody else shares. */
+  void *own_state = NULL;
+  if (!strcmp(job->flavor, "nolock"))
+    job->arg.st = own_state = new_api_state("nolock");
+  job->arg.buf = job->buf;
+  /* Get any lazy setup (like a per-thread global state) out of the way. */
+  job->fn(&job->arg, 1);
+
+  pthread_barrier_wait(job->barrier);
+  job->start_ns = now_ns();
+  job->start_cycles = now_cycles();
+  job->fn(&job->arg, job->iters);
+  job->end_cycles = now_cycles();
+  job->end_ns = now_ns();
+
+  free_api_state("nolock", own_state);
+  return NULL;
+}
+
+/** Run one sample of fn on n_threads threads at once.  Return the wall
+ * time from the first start to the last finish. */
+static void
+time_threaded_sample(const char *flavor, bench_fn fn, void *shared_state,
+                     size_t n, int n_threads, uint64_t iters,
+                     uint64_t *ns_out, uint64_t *cycles_out)
+{
+  static struct thread_job jobs[MAX_THREADS];
+  pthread_barrier_t barrier;
+  uint64_t first_ns = UINT64_MAX, last_ns = 0;
+  uint64_t first_cyc = UINT64_MAX, last_cyc = 0;
+  int i;
+
+  pthread_barrier_init(&barrier, NULL, n_threads);
+  for (i = 0; i < n_threads; ++i) {
+    struct thread_job *job = &jobs[i];
+    memset(job, 0, sizeof(*job));
+    job->barrier = &barrier;
+    job->flavor = flavor;
+    job->fn = fn;
+    job->arg.st = shared_state;
+    job->arg.n = n;
+    job->iters = iters;
+    if (pthread_create(&job->thread, NULL, thread_main, job)) {
+      perror("pthread_create");
+      exit(1);
+    }
   }
+  for (i = 0; i < n_threads; ++i) {
+    struct thread_job *job = &jobs[i];
+    pthread_join(job->thread, NULL);
+    if (job->start_ns < first_ns) first_ns = job->start_ns;
+    if (job->end_ns > last_ns) last_ns = job->end_ns;
+    if (job->start_cycles < first_cyc) first_cyc = job->start_cycles;
+    if (job->end_cycles > last_cyc) last_cyc = job->end_cycles;
+  }
+  pthread_barrier_destroy(&barrier);
+  *ns_out = last_ns - first_ns;
+  *cycles_out = last_cyc - first_cyc;
 }
 
-void
-time_arc4random_onebyte(void)
+/** Run and report a threaded benchmark.  We report the wall time per
+ * operation across all threads, so perfect scaling shows up as the time
+ * dividing by the number of threads. */
+static void
+run_threaded_bench(const char *name, const char *flavor, double bytes_per_op,
+                   bench_fn fn, size_t n, int n_threads)
 {
-#if HAVE_ARC4RANDOM_BUF
-  TIME_BUF(1, arc4random_buf(buf, sizeof(buf)));
-#endif
+  struct result *r = new_result("threads", name, bytes_per_op);
+  struct api_arg arg;
+  uint8_t buf[1024];
+  void *shared = NULL;
+  uint64_t ns, cycles;
+  int i;
+
+  if (!strcmp(flavor, "locked"))
+    shared = new_api_state("locked");
+
+  /* Calibrate on one thread, then give every thread that much work. */
+  memset(&arg, 0, sizeof(arg));
+  arg.st = !strcmp(flavor, "nolock") ? new_api_state("nolock") : shared;
+  arg.buf = buf;
+  arg.n = n;
+  r->iters = calibrate(fn, &arg);
+  if (arg.st != shared)
+    free_api_state("nolock", arg.st);
+
+  r->threads = n_threads;
+  for (i = 0; i < opt.warmup; ++i)
+    time_threaded_sample(flavor, fn, shared, n, n_threads, r->iters,
+                         &ns, &cycles);
+  for (i = 0; i < opt.reps; ++i) {
+    time_threaded_sample(flavor, fn, shared, n, n_threads, r->iters,
+                         &ns, &cycles);
+    r->ns_per_op[i] = (double)ns / (r->iters * n_threads);
+    r->cycles_per_op[i] = (double)cycles / (r->iters * n_threads);
+  }
+  r->n_samples = opt.reps;
+  finish_result(r);
+
+  free_api_state("locked", shared);
 }
 
-void
-time_libc_onebyte(void)
+static void
+suite_threads(void)
 {
-#ifdef _WIN32
-  TIME_UNSIGNED_RNG((rand() & 0xff));
+  struct ottery_config cfg;
+  char name[96];
+  int i, t;
+
+  for (i = 0; api_flavors[i].name; ++i) {
+    const struct api_flavor *f = &api_flavors[i];
+    int mode;
+    for (mode = OTTERY_GLOBAL_STATE_SHARED;
+         mode <= OTTERY_GLOBAL_STATE_PER_CPU; ++mode) {
+      const char *label = f->name;
+      if (mode != OTTERY_GLOBAL_STATE_SHARED && strcmp(f->name, "global"))
+        continue;
+      ottery_config_init(&cfg);
+      if (mode != OTTERY_GLOBAL_STATE_SHARED) {
+        if (ottery_config_set_global_state_mode(&cfg, mode))
+          continue;
+        label = (mode == OTTERY_GLOBAL_STATE_PER_THREAD) ?
+          "global-per-thread" : "global-per-cpu";
+      }
+      ottery_init(&cfg);
+      for (t = 1; ; t = (t * 2 > opt.max_threads && t < opt.max_threads) ?
+                          opt.max_threads : t * 2) {
+        snprintf(name, sizeof(name), "%s/uint32", label);
+        run_threaded_bench(name, f->name, 4, f->uint32_fn, 0, t);
+        snprintf(name, sizeof(name), "%s/bytes(1024)", label);
+        run_threaded_bench(name, f->name, 1024, f->bytes_fn, 1024, t);
+        if (t >= opt.max_threads)
+          break;
+      }
+      ottery_wipe();
+    }
+  }
+}
 #else
-  TIME_UNSIGNED_RNG((libc_random() & 0xff));
-#endif
+static void
+suite_threads(void)
+{
+  fprintf(stderr, "No thread support; skipping the threads suite.\n");
 }
+#endif
+
+/* ------------------------------------------------------------ */
+/* The other suite */
 
 #ifndef NO_URANDOM
-void
-time_urandom_buf16(void)
+static int urandom_fd = -1;
+
+static void
+bench_urandom(void *arg, uint64_t iters)
 {
-  TIME_BUF(16, (urandom_buf(buf, sizeof(buf))));
+  struct api_arg *a = arg;
+  uint64_t i;
+  for (i = 0; i < iters; ++i) {
+    if (read(urandom_fd, a->buf, a->n) < 0)
+      abort();
+  }
+  sink += a->buf[0];
 }
 #endif
 
-void
-time_arc4random_buf16(void)
+static void
+bench_libc_random(void *arg, uint64_t iters)
 {
-#ifdef HAVE_ARC4RANDOM_BUF
-  TIME_BUF(16, (arc4random_buf(buf, sizeof(buf))));
+  uint64_t i, acc = 0;
+  (void)arg;
+  for (i = 0; i < iters; ++i) {
+#ifdef _WIN32
+    acc += rand();
+#else
+    acc += random();
 #endif
+  }
+  sink += acc;
 }
 
-void
-time_libcrandom_buf16(void)
+#ifdef HAVE_ARC4RANDOM_BUF
+static void
+bench_arc4random_buf(void *arg, uint64_t iters)
 {
-  TIME_BUF(16, (libc_random_buf(buf, sizeof(buf))));
+  struct api_arg *a = arg;
+  uint64_t i;
+  for (i = 0; i < iters; ++i)
+    arc4random_buf(a->buf, a->n);
+  sink += a->buf[0];
 }
-void
-time_opensslrandom_buf16(void)
-{
-#ifndef NO_OPENSSL
-  TIME_BUF(16, (RAND_bytes(buf, sizeof(buf))));
 #endif
-}
 
-void
-time_rdrandom_buf16(void)
-{
-  TIME_BUF(16, rdrandom_buf(buf, sizeof(buf)));
-}
-
-#ifndef NO_URANDOM
-void
-time_urandom_buf1024(void)
+#ifndef NO_OPENSSL
+static void
+bench_openssl(void *arg, uint64_t iters)
 {
-  TIME_BUF(1024, (urandom_buf(buf, sizeof(buf))));
+  struct api_arg *a = arg;
+  uint64_t i;
+  for (i = 0; i < iters; ++i)
+    RAND_bytes(a->buf, (int)a->n);
+  sink += a->buf[0];
 }
 #endif
 
-void
-time_arc4random_buf1024(void)
+#ifdef BENCH_X86
+static void
+bench_rdrand(void *arg, uint64_t iters)
 {
-#ifdef HAVE_ARC4RANDOM_BUF
-  TIME_BUF(1024, (arc4random_buf(buf, sizeof(buf))));
-#endif
+  uint64_t i, acc = 0;
+  (void)arg;
+  for (i = 0; i < iters; ++i) {
+    unsigned therand;
+    unsigned char status;
+    __asm volatile(".byte 0x0F, 0xC7, 0xF0 ; setc %1"
+                   : "=a" (therand), "=qm" (status));
+    acc += therand;
+  }
+  sink += acc;
 }
 
-void
-time_libcrandom_buf1024(void)
+static void
+bench_rdseed(void *arg, uint64_t iters)
 {
-  TIME_BUF(1024, (libc_random_buf(buf, sizeof(buf))));
+  uint64_t i, acc = 0;
+  (void)arg;
+  for (i = 0; i < iters; ++i) {
+    unsigned therand;
+    unsigned char status;
+    __asm volatile(".byte 0x0F, 0xC7, 0xF8 ; setc %1"
+                   : "=a" (therand), "=qm" (status));
+    acc += therand;
+  }
+  sink += acc;
 }
+#endif
 
-void
-time_opensslrandom_buf1024(void)
+static void
+suite_other(void)
 {
+  static uint8_t buf[1024];
+  struct api_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.buf = buf;
+
+  run_bench("other", "libc_random", 4, bench_libc_random, &arg);
+#ifdef BENCH_X86
+  if (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RAND)
+    run_bench("other", "rdrand", 4, bench_rdrand, &arg);
+  if (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RDSEED)
+    run_bench("other", "rdseed", 4, bench_rdseed, &arg);
+#endif
+#ifndef NO_URANDOM
+  urandom_fd = open("/dev/urandom", O_RDONLY);
+  if (urandom_fd >= 0) {
+    arg.n = 16;
+    run_bench("other", "urandom/bytes(16)", 16, bench_urandom, &arg);
+    arg.n = 1024;
+    run_bench("other", "urandom/bytes(1024)", 1024, bench_urandom, &arg);
+    close(urandom_fd);
+  }
+#endif
+#ifdef HAVE_ARC4RANDOM_BUF
+  arg.n = 16;
+  run_bench("other", "arc4random/bytes(16)", 16, bench_arc4random_buf, &arg);
+  arg.n = 1024;
+  run_bench("other", "arc4random/bytes(1024)", 1024, bench_arc4random_buf,
+            &arg);
+#endif
 #ifndef NO_OPENSSL
-  TIME_BUF(1024, (RAND_bytes(buf, sizeof(buf))));
+  RAND_poll();
+  arg.n = 16;
+  run_bench("other", "openssl/bytes(16)", 16, bench_openssl, &arg);
+  arg.n = 1024;
+  run_bench("other", "openssl/bytes(1024)", 1024, bench_openssl, &arg);
 #endif
 }
 
-void
-time_rdrandom_buf1024(void)
+/* ------------------------------------------------------------ */
+
+static const struct {
+  const char *name;
+  void (*fn)(void);
+} suites[] = {
+  { "prf", suite_prf },
+  { "api", suite_api },
+  { "threads", suite_threads },
+  { "other", suite_other },
+  { NULL, NULL }
+};
+
+static void
+usage(const char *argv0)
 {
-  TIME_BUF(1024, rdrandom_buf(buf, sizeof(buf)));
+  fprintf(stderr,
+          "Usage: %s [--json] [--quick] [--reps=N] [--warmup=N]\n"
+          "       [--sample-ms=N] [--threads=N] [prf|api|threads|other...]\n",
+          argv0);
+  exit(1);
 }
 
-
 int
 main(int argc, char **argv)
 {
-  (void) argc;
-  (void) argv;
-#ifndef NO_OPENSSL
-  RAND_poll();
-#endif
-  struct ottery_config cfg_chacha8;
-  struct ottery_config cfg_chacha12;
-  struct ottery_config cfg_chacha20;
-  ottery_config_init(&cfg_chacha8);
-  ottery_config_force_implementation(&cfg_chacha8, OTTERY_PRF_CHACHA8);
-  ottery_config_init(&cfg_chacha12);
-  ottery_config_force_implementation(&cfg_chacha12, OTTERY_PRF_CHACHA12);
-  ottery_config_init(&cfg_chacha20);
-  ottery_config_force_implementation(&cfg_chacha20, OTTERY_PRF_CHACHA20);
-
-  ottery_st_init(&s8, &cfg_chacha8);
-  ottery_st_init(&s12, &cfg_chacha12);
-  ottery_st_init(&s20, &cfg_chacha20);
-  ottery_st_init_nolock(&s8nl, &cfg_chacha8);
-  ottery_st_init_nolock(&s12nl, &cfg_chacha12);
-  ottery_st_init_nolock(&s20nl, &cfg_chacha20);
-
-  time_chacharand8();
-  time_chacharand8_u64();
-  time_chacharand8_onebyte();
-  time_chacharand8_buf16();
-  time_chacharand8_buf1024();
-
-  time_chacharand12();
-  time_chacharand12_u64();
-  time_chacharand12_onebyte();
-  time_chacharand12_buf16();
-  time_chacharand12_buf1024();
-
-  time_chacharand20();
-  time_chacharand20_u64();
-  time_chacharand20_onebyte();
-  time_chacharand20_buf16();
-  time_chacharand20_buf1024();
-
-  time_chacharand8nl();
-  time_chacharand8nl_u64();
-  time_chacharand8nl_onebyte();
-  time_chacharand8nl_buf16();
-  time_chacharand8nl_buf1024();
-
-  time_chacharand12nl();
-  time_chacharand12nl_u64();
-  time_chacharand12nl_onebyte();
-  time_chacharand12nl_buf16();
-  time_chacharand12nl_buf1024();
-
-  time_chacharand20nl();
-  time_chacharand20nl_u64();
-  time_chacharand20nl_onebyte();
-  time_chacharand20nl_buf16();
-  time_chacharand20nl_buf1024();
-
-  time_arc4random();
-  time_arc4random_u64();
-  time_arc4random_onebyte();
-  time_arc4random_buf16();
-  time_arc4random_buf1024();
-
-  if (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RAND) {
-    time_rdrandom();
-    time_rdrandom_buf16();
-    time_rdrandom_buf1024();
-  }
+  int i, j, any_suite = 0;
+  long ncpu = 1;
 
-#ifndef NO_URANDOM
-  urandom_fd = open("/dev/urandom", O_RDONLY);
-  time_urandom();
-  time_urandom_u64();
-  time_urandom_buf16();
-  time_urandom_buf1024();
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
+  opt.max_threads = ncpu < 2 ? 2 : (int)ncpu;
+
+  for (i = 1; i < argc; ++i) {
+    const char *a = argv[i];
+    if (!strcmp(a, "--json")) {
+      opt.json = 1;
+    } else if (!strcmp(a, "--quick")) {
+      opt.warmup = 1;
+      opt.reps = 3;
+      opt.sample_ms = 2;
+    } else if (!strncmp(a, "--reps=", 7)) {
+      opt.reps = atoi(a + 7);
+    } else if (!strncmp(a, "--warmup=", 9)) {
+      opt.warmup = atoi(a + 9);
+    } else if (!strncmp(a, "--sample-ms=", 12)) {
+      opt.sample_ms = atof(a + 12);
+    } else if (!strncmp(a, "--threads=", 10)) {
+      opt.max_threads = atoi(a + 10);
+    } else if (a[0] == '-') {
+      usage(argv[0]);
+    } else {
+      any_suite = 1;
+    }
+  }
+  if (opt.reps < 1 || opt.reps > MAX_REPS || opt.warmup < 0 ||
+      opt.sample_ms <= 0 || opt.max_threads < 1 ||
+      opt.max_threads > MAX_THREADS)
+    usage(argv[0]);
+
+  if (!opt.json)
+    printf("# clock: %s; default PRF: %s; %d warm-up + %d samples each\n",
+           BENCH_CLOCK_NAME, default_prf_name(), opt.warmup, opt.reps);
+
+  for (j = 0; suites[j].name; ++j) {
+    int run = !any_suite;
+    for (i = 1; i < argc && !run; ++i) {
+      if (!strcmp(argv[i], suites[j].name))
+        run = 1;
+    }
+    if (run)
+      suites[j].fn();
+  }
+  for (i = 1; i < argc; ++i) {
+    int known = (argv[i][0] == '-');
+    for (j = 0; suites[j].name && !known; ++j)
+      known = !strcmp(argv[i], suites[j].name);
+    if (!known)
+      fprintf(stderr, "Unknown suite '%s'\n", argv[i]);
+  }
 
-  time_libc_random();
-  time_libc_random_u64();
-  time_libc_onebyte();
-  time_libcrandom_buf16();
-  time_libcrandom_buf1024();
-
-  time_openssl_random();
-  time_opensslrandom_buf16();
-  time_opensslrandom_buf1024();
+  if (opt.json)
+    print_json();
 
   return 0;
 }
-
@@ -17,6 +17,9 @@
  * A broken EGD implementation that works just well enough to respond to
  * the "nonblocking request" request type and return (NON-RANDOM!)
  * prefixes of bits of "O Fortuna".
+ *
+ * It answers requests from a single connection until the client closes
+ * it, and then says how many requests it answered.
  */
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -35,6 +38,7 @@ static const unsigned char o_fortuna[] =
 
 int bug_truncate_output = 0;
 int bug_short_output = 0;
+int bug_short_once = 0;
 int bug_no_output = 0;
 int bug_close_after_read = 0;
 int bug_close_before_read = 0;
@@ -58,8 +62,9 @@ reply(int fd)
     return -2;
   len = buf[1];
 
-  if (bug_short_output)
+  if (bug_short_output || bug_short_once)
     len /= 2;
+  bug_short_once = 0;
   if (bug_no_output)
     len = 0;
 
@@ -72,6 +77,11 @@ reply(int fd)
   if (write(fd, buf, n) != n)
     return -3;
 
+  /* After a truncated reply, the client is waiting for the rest, and won't
+   * send us anything else. */
+  if (bug_truncate_output)
+    return 0;
+
   return 1;
 }
 
@@ -81,6 +91,7 @@ struct bug_table_ent {
 } bug_table[] = {
   { "--truncate-output",   &bug_truncate_output },
   { "--short-output",      &bug_short_output },
+  { "--short-once",        &bug_short_once },
   { "--no-output",         &bug_no_output },
   { "--close-after-read",  &bug_close_after_read },
   { "--close-before-read", &bug_close_before_read },
@@ -122,6 +133,7 @@ main(int argc, char **argv)
   int family;
   int listener;
   int fd;
+  int n_requests = 0;
   const char *path = NULL;
   struct sockaddr_in sin;
   struct sockaddr_un sun;
@@ -196,11 +208,14 @@ main(int argc, char **argv)
     return 1;
   }
 
-  (void) reply(fd);
+  while (reply(fd) > 0)
+    ++n_requests;
 
   close(fd);
   close(listener);
 
+  printf("REQUESTS:%d\n", n_requests);
+
   return 0;
 }
 
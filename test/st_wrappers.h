@@ -18,6 +18,18 @@
   (USING_NOLOCK() ? ottery_st_rand_uint64_nolock(STATE_NOLOCK()) : \
    USING_STATE() ? ottery_st_rand_uint64(STATE()) : ottery_rand_uint64())
 
+#define OTTERY_RAND_UINT32_ARRAY(p,n)                                    \
+  (USING_NOLOCK() ?                                                      \
+     ottery_st_rand_uint32_array_nolock(STATE_NOLOCK(),(p),(n)) :        \
+   USING_STATE() ? ottery_st_rand_uint32_array(STATE(),(p),(n)) :        \
+   ottery_rand_uint32_array((p),(n)))
+
+#define OTTERY_RAND_UINT64_ARRAY(p,n)                                    \
+  (USING_NOLOCK() ?                                                      \
+     ottery_st_rand_uint64_array_nolock(STATE_NOLOCK(),(p),(n)) :        \
+   USING_STATE() ? ottery_st_rand_uint64_array(STATE(),(p),(n)) :        \
+   ottery_rand_uint64_array((p),(n)))
+
 #define OTTERY_RAND_RANGE(n)                                          \
   (USING_NOLOCK() ? ottery_st_rand_range_nolock(STATE_NOLOCK(),(n)) : \
    USING_STATE() ? ottery_st_rand_range(STATE(), (n)) : ottery_rand_range(n))
@@ -27,6 +39,101 @@
    USING_STATE() ? ottery_st_rand_range64(STATE(), (n)) :                \
    ottery_rand_range64(n))
 
+#define OTTERY_RAND_RANGE_ARRAY(p,n,top)                                  \
+  (USING_NOLOCK() ?                                                       \
+     ottery_st_rand_range_array_nolock(STATE_NOLOCK(),(p),(n),(top)) :    \
+   USING_STATE() ? ottery_st_rand_range_array(STATE(),(p),(n),(top)) :    \
+   ottery_rand_range_array((p),(n),(top)))
+
+#define OTTERY_RAND_WEIGHTED(t)                                         \
+  (USING_NOLOCK() ? ottery_st_rand_weighted_nolock(STATE_NOLOCK(),(t)) : \
+   USING_STATE() ? ottery_st_rand_weighted(STATE(),(t)) :               \
+   ottery_rand_weighted(t))
+
+#define OTTERY_RAND_WEIGHTED_ARRAY(t,p,n)                                  \
+  (USING_NOLOCK() ?                                                        \
+     ottery_st_rand_weighted_array_nolock(STATE_NOLOCK(),(t),(p),(n)) :    \
+   USING_STATE() ? ottery_st_rand_weighted_array(STATE(),(t),(p),(n)) :    \
+   ottery_rand_weighted_array((t),(p),(n)))
+
+#define OTTERY_RAND_BIT()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_bit_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_bit(STATE()) : ottery_rand_bit())
+
+#define OTTERY_RAND_BERNOULLI(p)                                          \
+  (USING_NOLOCK() ? ottery_st_rand_bernoulli_nolock(STATE_NOLOCK(),(p)) : \
+   USING_STATE() ? ottery_st_rand_bernoulli(STATE(),(p)) :                \
+   ottery_rand_bernoulli(p))
+
+#define OTTERY_RAND_BERNOULLI_MASK(o,n,p)                                  \
+  (USING_NOLOCK() ?                                                        \
+     ottery_st_rand_bernoulli_mask_nolock(STATE_NOLOCK(),(o),(n),(p)) :    \
+   USING_STATE() ? ottery_st_rand_bernoulli_mask(STATE(),(o),(n),(p)) :    \
+   ottery_rand_bernoulli_mask((o),(n),(p)))
+
+#define OTTERY_RAND_DOUBLE()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_double_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_double(STATE()) : ottery_rand_double())
+
+#define OTTERY_RAND_FLOAT()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_float_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_float(STATE()) : ottery_rand_float())
+
+#define OTTERY_RAND_DOUBLE_FULL()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_double_full_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_double_full(STATE()) :                \
+   ottery_rand_double_full())
+
+#define OTTERY_RAND_FLOAT_FULL()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_float_full_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_float_full(STATE()) :                \
+   ottery_rand_float_full())
+
+#define OTTERY_RAND_DOUBLE_ARRAY(p,n)                                    \
+  (USING_NOLOCK() ?                                                      \
+     ottery_st_rand_double_array_nolock(STATE_NOLOCK(),(p),(n)) :        \
+   USING_STATE() ? ottery_st_rand_double_array(STATE(),(p),(n)) :        \
+   ottery_rand_double_array((p),(n)))
+
+#define OTTERY_RAND_FLOAT_ARRAY(p,n)                                    \
+  (USING_NOLOCK() ?                                                      \
+     ottery_st_rand_float_array_nolock(STATE_NOLOCK(),(p),(n)) :        \
+   USING_STATE() ? ottery_st_rand_float_array(STATE(),(p),(n)) :        \
+   ottery_rand_float_array((p),(n)))
+
+#define OTTERY_SHUFFLE(p,n,sz)                                              \
+  (USING_NOLOCK() ?                                                       \
+     ottery_st_shuffle_nolock(STATE_NOLOCK(),(p),(n),(sz)) :              \
+   USING_STATE() ? ottery_st_shuffle(STATE(),(p),(n),(sz)) :              \
+   ottery_shuffle((p),(n),(sz)))
+
+#define OTTERY_RAND_PERMUTATION(p,n)                                        \
+  (USING_NOLOCK() ?                                                       \
+     ottery_st_rand_permutation_nolock(STATE_NOLOCK(),(p),(n)) :          \
+   USING_STATE() ? ottery_st_rand_permutation(STATE(),(p),(n)) :          \
+   ottery_rand_permutation((p),(n)))
+
+#define OTTERY_RAND_NORMAL()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_normal_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_normal(STATE()) : ottery_rand_normal())
+
+#define OTTERY_RAND_EXPONENTIAL()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_exponential_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_exponential(STATE()) :                \
+   ottery_rand_exponential())
+
+#define OTTERY_RAND_NORMAL_ARRAY(p,n)                                    \
+  (USING_NOLOCK() ?                                                      \
+     ottery_st_rand_normal_array_nolock(STATE_NOLOCK(),(p),(n)) :        \
+   USING_STATE() ? ottery_st_rand_normal_array(STATE(),(p),(n)) :        \
+   ottery_rand_normal_array((p),(n)))
+
+#define OTTERY_RAND_EXPONENTIAL_ARRAY(p,n)                                  \
+  (USING_NOLOCK() ?                                                         \
+     ottery_st_rand_exponential_array_nolock(STATE_NOLOCK(),(p),(n)) :      \
+   USING_STATE() ? ottery_st_rand_exponential_array(STATE(),(p),(n)) :      \
+   ottery_rand_exponential_array((p),(n)))
+
 #define OTTERY_WIPE()                                       \
   (USING_NOLOCK() ? ottery_st_wipe_nolock(STATE_NOLOCK()) : \
    USING_STATE() ? ottery_st_wipe(STATE()) : ottery_wipe())
@@ -128,7 +128,8 @@ struct ottery_prf dummy_prf =  {
   64, /* output_len */
   0, /* required cpucaps */
   dummy_prf_setup,
-  dummy_prf_generate
+  dummy_prf_generate,
+  OTTERY_PRF_FL_UNALIGNED_OUTPUT
 };
 
 /* Assuming that we stir after every block, the first three blocks will
@@ -157,7 +158,8 @@ setup_state(const struct testcase_t *testcase)
     return NULL;
   ottery_config_set_manual_prf_(&cfg, &dummy_prf);
   ottery_config_set_urandom_device(&cfg, "/dev/zero");
-  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND|
+                                       OTTERY_ENTROPY_SRC_RDSEED);
 
   if (testcase->flags & OT_ENABLE_STATE) {
     state_allocation = malloc(ottery_get_sizeof_state() + 16);
@@ -15,6 +15,11 @@
  * @file test_egd.c
  *
  * Tests for the EGD entropy backend.
+ *
+ * Usage: test_egd N SOCKET [REPEAT]
+ *
+ * Ask the EGD at SOCKET for N bytes, and print what we got.  With REPEAT,
+ * ask REPEAT times with one entropy state, so that we reuse the connection.
  */
 #include "ottery-internal.h"
 #include "ottery.h"
@@ -29,9 +34,10 @@ main(int argc, char **argv)
 {
   struct sockaddr_un sun;
   struct ottery_entropy_config cfg;
-  unsigned char buf[257];
-  size_t buflen = 257;
-  long n;
+  struct ottery_entropy_state state;
+  unsigned char buf[1025];
+  size_t buflen = sizeof(buf);
+  long n, repeat = 0, i;
   char *endp;
   uint32_t flags;
   int result;
@@ -42,10 +48,17 @@ main(int argc, char **argv)
     return 1;
   }
   n = strtol(argv[1], &endp, 10);
-  if (n < 0 || n > 256 || *endp) {
-    printf("First argument must be in 0..256\n");
+  if (n < 0 || n > 1024 || *endp) {
+    printf("First argument must be in 0..1024\n");
     return 1;
   }
+  if (argc > 3) {
+    repeat = strtol(argv[3], &endp, 10);
+    if (repeat < 1 || *endp) {
+      printf("Third argument must be positive\n");
+      return 1;
+    }
+  }
   if (strlen(argv[2])+1 >= sizeof(sun.sun_path)) {
     printf("Path is too long\n");
     return 1;
@@ -64,10 +77,22 @@ main(int argc, char **argv)
   cfg.disabled_sources =
     OTTERY_ENTROPY_ALL_SOURCES & ~OTTERY_ENTROPY_SRC_EGD;
 
-  result = ottery_get_entropy_(&cfg, NULL, 0, buf, (size_t) n, &buflen, &flags);
+  if (repeat) {
+    memset(&state, 0, sizeof(state));
+    for (i = 0; i < repeat; ++i) {
+      buflen = sizeof(buf);
+      result = ottery_get_entropy_(&cfg, &state, 0, buf, (size_t) n,
+                                   &buflen, &flags);
+      if (result)
+        break;
+    }
+    ottery_release_entropy_state_(&state);
+  } else {
+    result = ottery_get_entropy_(&cfg, NULL, 0, buf, (size_t) n,
+                                 &buflen, &flags);
+  }
 
   if (result == 0 && buflen == (size_t)n) {
-    int i;
     printf("FLAGS:%x\n",flags);
     printf("BYTES:");
     for (i=0; i<n; ++i) printf("%02x", buf[i]);
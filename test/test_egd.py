@@ -47,7 +47,7 @@ def cleanup():
 
 atexit.register(cleanup)
 
-def run_egd(tst_args, egd_args):
+def run_egd(tst_args, egd_args, want_egd_output=False):
     fake_egd = subprocess.Popen([FAKE_EGD]+egd_args, stdout=subprocess.PIPE)
     test_egd = subprocess.Popen([TEST_EGD]+tst_args, stdout=subprocess.PIPE)
     fe_output = fake_egd.stdout.read()
@@ -60,8 +60,17 @@ def run_egd(tst_args, egd_args):
     if test_egd.returncode != 0:
         raise TestEGDDied(fake_egd.returncode)
     os.unlink(SOCKNAME)
+    if want_egd_output:
+        return parse_output(te_output), parse_output(fe_output)
     return parse_output(te_output)
 
+def egd_bytes(n, chunk=255):
+    # What fake_egd gives us when we ask for n bytes, chunk bytes at a time.
+    out = b""
+    while len(out) < n:
+        out += o_fortuna[:min(chunk, n - len(out))]
+    return b2a_hex(out).decode()
+
 def parse_output(te_output):
     res = {}
     te_str = te_output if sys.version < '3' else str(te_output, 'ISO-8859-1')
@@ -92,6 +101,28 @@ class EGDTests(unittest.TestCase):
         self.assertEquals(d['FLAGS'], '80401')
         self.assertEquals(d['BYTES'], b2a_hex(o_fortuna[:255]).decode())
 
+    def test_succeed_256(self):
+        d = run_egd(["256", SOCKNAME], [SOCKNAME])
+        self.assertEquals(d['FLAGS'], '80401')
+        self.assertEquals(d['BYTES'], egd_bytes(256))
+
+    def test_succeed_1000(self):
+        d = run_egd(["1000", SOCKNAME], [SOCKNAME])
+        self.assertEquals(d['FLAGS'], '80401')
+        self.assertEquals(d['BYTES'], egd_bytes(1000))
+
+    def test_succeed_short_once(self):
+        # A short reply is fine; we ask again for the rest.
+        d, e = run_egd(["16", SOCKNAME], [SOCKNAME, "--short-once"], True)
+        self.assertEquals(d['BYTES'], egd_bytes(16, 8))
+        self.assertEquals(e['REQUESTS'], '2')
+
+    def test_persistent_connection(self):
+        # With an entropy state, every request goes over one connection.
+        d, e = run_egd(["32", SOCKNAME, "2000"], [SOCKNAME], True)
+        self.assertEquals(d['BYTES'], egd_bytes(32))
+        self.assertEquals(e['REQUESTS'], '2000')
+
     def test_fail_noegd(self):
         cleanup()
         p = subprocess.Popen([TEST_EGD, "16", SOCKNAME], stdout=subprocess.PIPE)
@@ -109,15 +140,6 @@ class EGDTests(unittest.TestCase):
         d = parse_output(o)
         self.assertEquals(d['ERR'], '3') #init_strong_rng
 
-    def test_fail_toolong_256(self):
-        cleanup()
-        p = subprocess.Popen([TEST_EGD, "256", SOCKNAME],
-                             stdout=subprocess.PIPE)
-        o = p.stdout.read()
-        p.wait()
-        d = parse_output(o)
-        self.assertEquals(d['ERR'], '4') #access_strong_rng
-
     def test_fail_short(self):
         d = run_egd(["16", SOCKNAME], [SOCKNAME, "--short-output"])
         self.assertEquals(d['ERR'], '4') #access_strong_rng
@@ -134,7 +156,7 @@ class EGDTests(unittest.TestCase):
         d = run_egd(["16", SOCKNAME], [SOCKNAME, "--close-before-read"])
         self.assertEquals(d['ERR'], '4') #access_strong_rng
 
-    def test_fail_close_early(self):
+    def test_fail_close_late(self):
         d = run_egd(["16", SOCKNAME], [SOCKNAME, "--close-after-read"])
         self.assertEquals(d['ERR'], '4') #access_strong_rng
 
@@ -23,16 +23,22 @@
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
+#include "ottery_stream.h"
 
 #include "tinytest.h"
 #include "tinytest_macros.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#ifdef OTTERY_THREAD_STATES
+#include <pthread.h>
+#endif
 
 #define STATE() state
 #define STATE_NOLOCK() ((struct ottery_state_nolock *)state)
@@ -46,6 +52,7 @@ int state_nolock = 0;
 
 #define OT_ENABLE_STATE TT_FIRST_USER_FLAG
 #define OT_ENABLE_STATE_NOLOCK ((TT_FIRST_USER_FLAG<<1)|OT_ENABLE_STATE)
+#define OT_ENABLE_PER_THREAD (TT_FIRST_USER_FLAG<<2)
 
 void *
 setup_state(const struct testcase_t *testcase)
@@ -64,6 +71,14 @@ setup_state(const struct testcase_t *testcase)
       ottery_st_init(state, NULL);
     state_nolock = (testcase->flags & OT_ENABLE_STATE_NOLOCK);
   }
+  if (testcase->flags & OT_ENABLE_PER_THREAD) {
+    struct ottery_config cfg;
+    ottery_config_init(&cfg);
+    if (ottery_config_set_global_state_mode(&cfg,
+                                     OTTERY_GLOBAL_STATE_PER_THREAD) ||
+        ottery_init(&cfg))
+      return NULL;
+  }
   return (void*) 1;
 }
 int
@@ -94,6 +109,7 @@ test_get_sizeof(void *arg)
   (void)arg;
   tt_int_op(ottery_get_sizeof_config(), <=, sizeof(struct ottery_config));
   tt_int_op(ottery_get_sizeof_state(), <=, sizeof(struct ottery_state));
+  tt_int_op(ottery_get_sizeof_stream(), <=, sizeof(struct ottery_stream));
  end:
   ;
 }
@@ -184,6 +200,36 @@ test_osrandom(void *arg)
             ottery_get_entropy_(&cfg, NULL, 0, buf, 12, &n, &flags));
   tt_int_op(flags, ==, 0);
 
+  /* The CPU sources work iff the CPU has them, in whole words or not. */
+  {
+    const uint32_t cap = ottery_get_cpu_capabilities_();
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.disabled_sources = ALL_ENTROPY_BUT(RDRAND);
+    n = 66;
+    memset(buf, 0, sizeof(buf));
+    if (cap & OTTERY_CPUCAP_RAND) {
+      tt_int_op(0, ==, ottery_get_entropy_(&cfg, NULL, 0, buf, 63, &n, &flags));
+      tt_int_op(n, ==, 63);
+      tt_assert(flags & OTTERY_ENTROPY_DOM_CPU);
+      tt_int_op(0, ==, buf[63]);
+    } else {
+      tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==,
+                ottery_get_entropy_(&cfg, NULL, 0, buf, 63, &n, &flags));
+    }
+    cfg.disabled_sources = ALL_ENTROPY_BUT(RDSEED);
+    n = 66;
+    memset(buf, 0, sizeof(buf));
+    if (cap & OTTERY_CPUCAP_RDSEED) {
+      tt_int_op(0, ==, ottery_get_entropy_(&cfg, NULL, 0, buf, 63, &n, &flags));
+      tt_int_op(n, ==, 63);
+      tt_assert(flags & OTTERY_ENTROPY_DOM_CPU);
+      tt_int_op(0, ==, buf[63]);
+    } else {
+      tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==,
+                ottery_get_entropy_(&cfg, NULL, 0, buf, 63, &n, &flags));
+    }
+  }
+
   /* Make sure at least one OS source works. */
   cfg.disabled_sources = 0;
   flags = 0;
@@ -251,6 +297,41 @@ puts("+++!");
 
   close(cfg.urandom_fd);
 
+  /* Keep the device open between calls. */
+  memset(&cfg, 0, sizeof(cfg));
+  memset(&state, 0, sizeof(state));
+  cfg.disabled_sources = ALL_ENTROPY_BUT(RANDOMDEV);
+  cfg.urandom_keep_open = 1;
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg, &state, 0, buf, 12, &n, &flags));
+  tt_int_op(state.urandom_fd_is_cached, ==, 1);
+  {
+    const int cached = state.urandom_cached_fd;
+    n = sizeof(buf);
+    tt_int_op(0, ==, ottery_get_entropy_(&cfg, &state, 0, buf, 12, &n,
+                                         &flags));
+    tt_int_op(state.urandom_cached_fd, ==, cached);
+    ottery_release_entropy_state_(&state);
+    tt_int_op(state.urandom_fd_is_cached, ==, 0);
+    tt_int_op(-1, ==, fcntl(cached, F_GETFD));
+  }
+
+#endif
+
+#ifdef __linux__
+  /* getrandom() should work by itself... */
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.disabled_sources = ALL_ENTROPY_BUT(GETRANDOM);
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg, NULL, 0, buf, 12, &n, &flags));
+  tt_int_op(n, ==, 12);
+  tt_assert(flags & OTTERY_ENTROPY_DOM_OS);
+  tt_assert(flags & OTTERY_ENTROPY_FL_STRONG);
+  /* ... but step aside for a configured device. */
+  cfg.urandom_fname = "/dev/null";
+  n = sizeof(buf);
+  tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==,
+            ottery_get_entropy_(&cfg, NULL, 0, buf, 12, &n, &flags));
 #endif
 
   /* Make sure at least one OS source works in another way. */
@@ -267,6 +348,122 @@ puts("+++!");
     unlink(tempfname);
 }
 
+/** Entropy source for test_user_entropy: fill out with *arg, and count the
+ * call, or fail if *arg is 0. */
+static int
+fake_entropy_source(void *arg, uint8_t *out, size_t n)
+{
+  int *counter = arg;
+  if (*counter == 0)
+    return -1;
+  memset(out, *counter, n);
+  ++*counter;
+  return 0;
+}
+
+static void
+test_user_entropy(void *arg)
+{
+  __attribute__((aligned(16))) struct ottery_state st;
+  struct ottery_config cfg;
+  uint8_t buf[1024];
+  size_t n;
+  uint32_t flags;
+  int c1 = 0x41, c2 = 0x61;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_add_entropy_source(&cfg, NULL, NULL, 0,
+                                             OTTERY_ENTROPY_DOM_USER));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             OTTERY_ENTROPY_SRC_RDRAND,
+                                             OTTERY_ENTROPY_DOM_USER));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             0, 0));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             0, OTTERY_ENTROPY_DOM_OS |
+                                             OTTERY_ENTROPY_DOM_USER));
+
+  /* A source in a domain of its own comes first, and adds to the rest. */
+  tt_int_op(0, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             0, OTTERY_ENTROPY_DOM_USER));
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg.entropy_config, NULL, 0,
+                                       buf, 16, &n, &flags));
+  tt_int_op(c1, ==, 0x42);
+  tt_int_op(n, >, 16);
+  tt_int_op(buf[0], ==, 0x41);
+  tt_int_op(buf[15], ==, 0x41);
+  tt_int_op(flags & OTTERY_ENTROPY_SRC_USER, !=, 0);
+  tt_int_op(flags & OTTERY_ENTROPY_DOM_USER, !=, 0);
+  tt_int_op(flags & OTTERY_ENTROPY_DOM_OS, !=, 0);
+
+  /* A strong source in the OS domain replaces the OS's own. */
+  tt_int_op(0, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c2,
+                                             OTTERY_ENTROPY_FL_STRONG,
+                                             OTTERY_ENTROPY_DOM_OS));
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg.entropy_config, NULL,
+                                       OTTERY_ENTROPY_DOM_OS,
+                                       buf, 16, &n, &flags));
+  tt_int_op(n, ==, 16);
+  tt_int_op(buf[0], ==, 0x61);
+  tt_int_op(flags & (OTTERY_ENTROPY_SRC_RANDOMDEV|
+                     OTTERY_ENTROPY_SRC_GETRANDOM), ==, 0);
+
+  /* Unless it fails. */
+  c2 = 0;
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg.entropy_config, NULL,
+                                       OTTERY_ENTROPY_DOM_OS,
+                                       buf, 16, &n, &flags));
+  tt_int_op(flags & (OTTERY_ENTROPY_SRC_RANDOMDEV|
+                     OTTERY_ENTROPY_SRC_GETRANDOM), !=, 0);
+
+  /* User sources on their own are enough iff one is strong. */
+  c2 = 0x61;
+  cfg.entropy_config.disabled_sources = ALL_ENTROPY_BUT(USER);
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg.entropy_config, NULL, 0,
+                                       buf, 16, &n, &flags));
+  tt_int_op(n, ==, 32);
+  ottery_config_mark_entropy_sources_weak(&cfg, OTTERY_ENTROPY_SRC_USER);
+  n = sizeof(buf);
+  tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==,
+            ottery_get_entropy_(&cfg.entropy_config, NULL, 0,
+                                buf, 16, &n, &flags));
+  ottery_config_mark_entropy_sources_weak(&cfg, 0);
+
+  /* States use them too. */
+  c1 = c2 = 1;
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_int_op(c1, ==, 2);
+  tt_int_op(c2, ==, 2);
+  tt_int_op(0, ==, ottery_st_add_seed(&st, NULL, 0));
+  tt_int_op(c1, ==, 3);
+  ottery_st_wipe(&st);
+
+  /* There's only room for so many. */
+  tt_int_op(0, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             0, OTTERY_ENTROPY_DOM_USER));
+  tt_int_op(0, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             0, OTTERY_ENTROPY_DOM_USER));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_add_entropy_source(&cfg, fake_entropy_source, &c1,
+                                             0, OTTERY_ENTROPY_DOM_USER));
+
+ end:
+  ;
+}
+
 static void
 test_single_buf(size_t n)
 {
@@ -332,6 +529,470 @@ test_rand_big_buf(void *arg)
   test_single_buf(4096);
 }
 
+static void
+test_bulk_alignment(void *arg)
+{
+  /* Big requests can be generated straight into the caller's buffer when
+   * the PRF allows it, and a locked state generates them after dropping its
+   * lock.  Make sure that we get the same bytes all of these ways as we do
+   * when we copy through the state's buffer, for every PRF we have. */
+  static const char *flavors[] = {
+    "CHACHA20-NOSIMD-DEFAULT",
+    "CHACHA20-SIMD-DEFAULT",
+    "CHACHA20-SIMD-SSSE3",
+    "CHACHA20-SIMD-AVX2",
+    "CHACHA20-SIMD-AVX512",
+    NULL
+  };
+  __attribute__((aligned(16))) struct ottery_state st1;
+  __attribute__((aligned(16))) struct ottery_state st2;
+  __attribute__((aligned(16))) uint8_t buf1[MAX_OUTPUT_LEN*3 + 100];
+  __attribute__((aligned(16))) uint8_t buf2[MAX_OUTPUT_LEN*3 + 100 + 16];
+  struct ottery_config cfg;
+  int i, n_tested = 0;
+  unsigned offset;
+  (void)arg;
+
+  for (i = 0; flavors[i]; ++i) {
+    ottery_config_init(&cfg);
+    if (ottery_config_force_implementation(&cfg, flavors[i]))
+      continue;
+    for (offset = 0; offset < 16; offset += 5) {
+      tt_int_op(0, ==, ottery_st_init(&st1, &cfg));
+      /* Clone the state, fixing up the address-based magic number.  We
+       * only use the clone with the _nolock functions, so it doesn't matter
+       * that we copied the mutex. */
+      memcpy(&st2, &st1, sizeof(st1));
+      st2.magic = st1.magic ^ (uint32_t)(uintptr_t)&st1
+        ^ (uint32_t)(uintptr_t)&st2;
+      /* Leave st->pos at an odd place so the bulk part is misaligned. */
+      ottery_st_rand_bytes(&st1, buf1, 3);
+      ottery_st_rand_bytes_nolock(&st2, buf2, 3);
+
+      ottery_st_rand_bytes(&st1, buf1, sizeof(buf1));
+      ottery_st_rand_bytes_nolock(&st2, buf2 + offset, sizeof(buf1));
+      tt_assert(0 == memcmp(buf1, buf2 + offset, sizeof(buf1)));
+      ottery_st_rand_bytes(&st1, buf1, 64);
+      ottery_st_rand_bytes_nolock(&st2, buf2, 64);
+      tt_assert(0 == memcmp(buf1, buf2, 64));
+      ottery_st_wipe(&st1);
+      ottery_st_wipe_nolock(&st2);
+    }
+    ++n_tested;
+  }
+  tt_int_op(n_tested, >, 0);
+
+ end:
+  ;
+}
+
+static void
+test_prefill(void *arg)
+{
+  /* A state with prefill enabled should produce exactly the same output as
+   * one without, however we interleave prefilling with other requests. */
+  __attribute__((aligned(16))) struct ottery_state st1;
+  __attribute__((aligned(16))) struct ottery_state st2;
+  uint8_t buf1[MAX_OUTPUT_LEN*2 + 10], buf2[MAX_OUTPUT_LEN*2 + 10];
+  const uint8_t seed[] = "prefilled oranges";
+  struct ottery_config cfg;
+  int i;
+  size_t n;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  ottery_config_enable_prefill(&cfg, 1);
+  tt_int_op(0, ==, ottery_st_init(&st1, &cfg));
+  tt_ptr_op(st1.spare_alloc, !=, NULL);
+  /* Clone the state without its spare block; see test_bulk_alignment. */
+  memcpy(&st2, &st1, sizeof(st1));
+  st2.magic = st1.magic ^ (uint32_t)(uintptr_t)&st1
+    ^ (uint32_t)(uintptr_t)&st2;
+  st2.spare_alloc = NULL;
+
+  for (i = 0; i < 200; ++i) {
+    if (i % 3 == 0) {
+      ottery_st_prefill(&st1);
+      tt_int_op(st1.spare_status, !=, 0);
+      /* Doing it again is harmless. */
+      ottery_st_prefill(&st1);
+    }
+    if (i % 7 == 6) {
+      /* Rekeying from new seed material must throw the spare block out. */
+      ottery_st_add_seed(&st1, seed, sizeof(seed));
+      ottery_st_add_seed_nolock(&st2, seed, sizeof(seed));
+    }
+    /* Mostly small requests, with a big one now and then that uses up the
+     * block counters out from under the spare block. */
+    n = (i % 11 == 10) ? sizeof(buf1) : (size_t)(i * 37) % 700;
+    ottery_st_rand_bytes(&st1, buf1, n);
+    ottery_st_rand_bytes_nolock(&st2, buf2, n);
+    tt_assert(0 == memcmp(buf1, buf2, n));
+    tt_int_op(ottery_st_rand_uint64(&st1), ==,
+              ottery_st_rand_uint64_nolock(&st2));
+  }
+
+  /* Run exactly to the end of the buffer: that should use the spare. */
+  ottery_st_prefill(&st1);
+  tt_int_op(st1.spare_status, !=, 0);
+  n = st1.prf.output_len - st1.pos;
+  ottery_st_rand_bytes(&st1, buf1, n);
+  ottery_st_rand_bytes_nolock(&st2, buf2, n);
+  tt_assert(0 == memcmp(buf1, buf2, n));
+  tt_int_op(st1.spare_status, ==, 0);
+  tt_int_op(ottery_st_rand_uint64(&st1), ==,
+            ottery_st_rand_uint64_nolock(&st2));
+
+  /* A big request that makes its blocks itself and then rekeys must throw
+   * out the spare block: it was made from the old key. */
+  for (i = 0; i < 4; ++i) {
+    if (i & 1) {
+      ottery_st_prefill(&st1);
+    } else {
+      ottery_st_prefill_nolock(&st1);
+    }
+    tt_int_op(st1.spare_status, !=, 0);
+    n = sizeof(buf1);
+    if (i & 1) {
+      ottery_st_rand_bytes(&st1, buf1, n);
+    } else {
+      ottery_st_rand_bytes_nolock(&st1, buf1, n);
+    }
+    ottery_st_rand_bytes_nolock(&st2, buf2, n);
+    tt_assert(0 == memcmp(buf1, buf2, n));
+    tt_int_op(st1.spare_status, ==, 0);
+    for (n = 0; n < 2048; ++n) {
+      tt_int_op(ottery_st_rand_uint32_nolock(&st1), ==,
+                ottery_st_rand_uint32_nolock(&st2));
+    }
+  }
+
+  /* Without prefill enabled, there's nothing to fill. */
+  ottery_st_prefill_nolock(&st2);
+  tt_int_op(st2.spare_status, ==, 0);
+
+  ottery_st_wipe(&st1);
+  ottery_st_wipe_nolock(&st2);
+  tt_ptr_op(st1.spare_alloc, ==, NULL);
+
+ end:
+  ;
+}
+
+static void
+test_init_from_parent(void *arg)
+{
+  __attribute__((aligned(16))) struct ottery_state_nolock p1;
+  __attribute__((aligned(16))) struct ottery_state_nolock p2;
+  __attribute__((aligned(16))) struct ottery_state_nolock c1;
+  __attribute__((aligned(16))) struct ottery_state_nolock c2;
+  __attribute__((aligned(16))) struct ottery_state lp;
+  __attribute__((aligned(16))) struct ottery_state lc;
+  __attribute__((aligned(16))) uint8_t misaligned[sizeof(c1) + 16];
+  uint8_t buf1[MAX_OUTPUT_LEN*2 + 10], buf2[MAX_OUTPUT_LEN*2 + 10];
+  struct ottery_config cfg;
+  (void)arg;
+
+  tt_int_op(0, ==, ottery_st_init_nolock(&p1, NULL));
+  /* Clone the parent; see test_bulk_alignment. */
+  memcpy(&p2, &p1, sizeof(p1));
+  p2.magic = p1.magic ^ (uint32_t)(uintptr_t)&p1 ^ (uint32_t)(uintptr_t)&p2;
+
+  /* Children of identical parents are identical. */
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&c1, &p1));
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&c2, &p2));
+  tt_str_op(c1.prf.name, ==, p1.prf.name);
+  /* The child doesn't generate anything until somebody asks it to. */
+  tt_int_op(c1.pos, ==, c1.prf.output_len);
+  ottery_st_rand_bytes_nolock(&c1, buf1, 3);
+  ottery_st_rand_bytes_nolock(&c2, buf2, 3);
+  tt_assert(0 == memcmp(buf1, buf2, 3));
+  tt_int_op(ottery_st_rand_uint64_nolock(&c1), ==,
+            ottery_st_rand_uint64_nolock(&c2));
+  /* Start a fresh child with a big request, and one with an integer. */
+  ottery_st_wipe_nolock(&c1);
+  ottery_st_wipe_nolock(&c2);
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&c1, &p1));
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&c2, &p2));
+  ottery_st_rand_bytes_nolock(&c1, buf1, sizeof(buf1));
+  ottery_st_rand_bytes_nolock(&c2, buf2, sizeof(buf2));
+  tt_assert(0 == memcmp(buf1, buf2, sizeof(buf1)));
+  ottery_st_wipe_nolock(&c1);
+  ottery_st_wipe_nolock(&c2);
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&c1, &p1));
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&c2, &p2));
+  tt_int_op(ottery_st_rand_unsigned_nolock(&c1), ==,
+            ottery_st_rand_unsigned_nolock(&c2));
+  ottery_st_rand_bytes_nolock(&c1, buf1, 100);
+  ottery_st_rand_bytes_nolock(&c2, buf2, 100);
+  tt_assert(0 == memcmp(buf1, buf2, 100));
+
+  /* The parents went on in step with each other, and the children's
+   * output isn't the parents'. */
+  ottery_st_rand_bytes_nolock(&p1, buf1, 100);
+  ottery_st_rand_bytes_nolock(&p2, buf2, 100);
+  tt_assert(0 == memcmp(buf1, buf2, 100));
+  ottery_st_rand_bytes_nolock(&c1, buf2, 100);
+  tt_assert(0 != memcmp(buf1, buf2, 100));
+
+  /* Bad arguments. */
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_st_init_from_parent_nolock(&p1, &p1));
+  tt_int_op(OTTERY_ERR_STATE_ALIGNMENT, ==,
+            ottery_st_init_from_parent_nolock(
+                     (struct ottery_state_nolock *)(misaligned + 1), &p1));
+
+  /* Locked states, which pass along their prefill setting. */
+  ottery_config_init(&cfg);
+  ottery_config_enable_prefill(&cfg, 1);
+  tt_int_op(0, ==, ottery_st_init(&lp, &cfg));
+  tt_int_op(0, ==, ottery_st_init_from_parent(&lc, &lp));
+  tt_ptr_op(lc.spare_alloc, !=, NULL);
+  ottery_st_prefill(&lc);
+  ottery_st_rand_bytes(&lc, buf1, sizeof(buf1));
+  ottery_st_rand_bytes(&lp, buf2, sizeof(buf2));
+  tt_assert(0 != memcmp(buf1, buf2, sizeof(buf1)));
+
+  ottery_st_wipe_nolock(&p1);
+  ottery_st_wipe_nolock(&c1);
+  ottery_st_wipe_nolock(&c2);
+  ottery_st_wipe(&lp);
+  ottery_st_wipe(&lc);
+
+ end:
+  ;
+}
+
+static void
+test_max_buffer_len(void *arg)
+{
+  __attribute__((aligned(16))) struct ottery_state st;
+  struct ottery_config cfg;
+  uint8_t buf[MAX_OUTPUT_LEN * 3];
+  __attribute__((aligned(16))) uint8_t big_state[MAX_STATE_LEN];
+  __attribute__((aligned(16))) uint8_t small_state[MAX_STATE_LEN];
+  __attribute__((aligned(16))) uint8_t big_out[MAX_OUTPUT_LEN * 2];
+  __attribute__((aligned(16))) uint8_t small_out[MAX_OUTPUT_LEN * 2];
+  const struct ottery_prf *big = &ottery_prf_chacha20_merged_;
+  const struct ottery_prf *small = &ottery_prf_chacha20_merged_small_;
+  int i;
+  (void)arg;
+
+  /* The fields on the fast path should share the first cache line. */
+  tt_int_op(offsetof(struct ottery_state, bit_reservoir) + 8, <=,
+            OTTERY_CACHE_LINE);
+
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_max_buffer_len(&cfg, 64));
+  tt_int_op(0, ==, ottery_config_set_max_buffer_len(&cfg, 256));
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_str_op(st.prf.name, ==, "CHACHA20");
+  tt_int_op(st.output_len, ==, 256);
+  tt_int_op(st.output_len, ==, st.prf.output_len);
+  for (i = 0; i < 100; ++i) {
+    ottery_st_rand_bytes(&st, buf, (i * 97) % sizeof(buf));
+    ottery_st_rand_uint64(&st);
+    tt_int_op(st.pos, <, st.output_len);
+  }
+  ottery_st_wipe(&st);
+
+  /* A limit between the sizes we have gets the next size down. */
+  tt_int_op(0, ==, ottery_config_set_max_buffer_len(&cfg, 512));
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_int_op(st.output_len, ==, 256);
+  ottery_st_wipe(&st);
+
+  /* The small flavor is the same keystream as the 1024-byte one, just
+   * handed out in smaller pieces. */
+  tt_int_op(small->output_len, ==, 256);
+  tt_int_op(big->output_len, ==, 1024);
+  for (i = 0; i < 40; ++i)
+    buf[i] = (uint8_t)(i * 7 + 1);
+  big->setup(big_state, buf);
+  small->setup(small_state, buf);
+  big->generate(big_state, big_out, 0);
+  big->generate(big_state, big_out + 1024, 1);
+  for (i = 0; i < 8; ++i)
+    small->generate(small_state, small_out + 256 * i, i);
+  tt_assert(0 == memcmp(big_out, small_out, sizeof(big_out)));
+
+  /* If we ask for a PRF by name, we get a flavor of it that fits. */
+  tt_int_op(0, ==, ottery_config_set_max_buffer_len(&cfg, 256));
+  tt_int_op(0, ==, ottery_config_force_implementation(&cfg, "CHACHA8"));
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_str_op(st.prf.name, ==, "CHACHA8");
+  tt_int_op(st.output_len, ==, 256);
+  ottery_st_wipe(&st);
+
+  /* And 0 means no limit. */
+  tt_int_op(0, ==, ottery_config_set_max_buffer_len(&cfg, 0));
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_int_op(st.output_len, ==, cfg.impl->output_len);
+  ottery_st_wipe(&st);
+
+ end:
+  ;
+}
+
+static void
+test_reseed_interval(void *arg)
+{
+  __attribute__((aligned(16))) struct ottery_state st;
+  __attribute__((aligned(16))) struct ottery_state_nolock ns;
+  __attribute__((aligned(16))) struct ottery_state_nolock ns2;
+  __attribute__((aligned(16))) struct ottery_state_nolock child;
+  struct ottery_config cfg;
+  uint8_t buf1[256], buf2[256];
+  uint8_t big[MAX_OUTPUT_LEN * 2];
+  (void)arg;
+
+  /* By default, we never reseed on our own. */
+  ottery_config_init(&cfg);
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  ottery_st_rand_bytes(&st, big, sizeof(big));
+  tt_int_op(st.reseed_status, ==, 0);
+  ottery_st_wipe(&st);
+
+  /* Reseed after every block. Running out of a block marks the state as
+   * due, and the next call reseeds it. */
+  ottery_config_set_reseed_interval(&cfg, 1, 0);
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_int_op(st.reseed_status, ==, 0);
+  ottery_st_rand_bytes(&st, big, sizeof(big));
+  tt_int_op(st.reseed_status, !=, 0);
+  st.last_entropy_flags = 0;
+  ottery_st_rand_unsigned(&st);
+  tt_int_op(st.reseed_status, ==, 0);
+  tt_int_op(st.bytes_since_reseed, ==, 0);
+  tt_int_op(st.last_entropy_flags, !=, 0);
+
+  /* If the OS won't give us entropy, we keep going, and try again after
+   * the next block. */
+  st.entropy_config.disabled_sources = ~0;
+  ottery_st_rand_bytes(&st, big, sizeof(big));
+  ottery_st_rand_unsigned(&st);
+  tt_int_op(st.reseed_status, ==, 0);
+  tt_int_op(st.bytes_since_reseed, >, 0);
+  ottery_st_rand_bytes(&st, big, sizeof(big));
+  tt_int_op(st.reseed_status, !=, 0);
+  st.entropy_config.disabled_sources = 0;
+  ottery_st_rand_unsigned(&st);
+  tt_int_op(st.reseed_status, ==, 0);
+  tt_int_op(st.bytes_since_reseed, ==, 0);
+  ottery_st_wipe(&st);
+
+  /* Reseeding changes the output: compare against a clone that skips it.
+   * See test_bulk_alignment for the cloning trick. */
+  ottery_config_set_reseed_interval(&cfg, 0, 10);
+  tt_int_op(0, ==, ottery_st_init_nolock(&ns, &cfg));
+  ns.last_reseed_time -= 10;
+  ottery_st_rand_bytes_nolock(&ns, big, sizeof(big));
+  tt_int_op(ns.reseed_status, !=, 0);
+  memcpy(&ns2, &ns, sizeof(ns));
+  ns2.magic = ns.magic ^ (uint32_t)(uintptr_t)&ns ^ (uint32_t)(uintptr_t)&ns2;
+  ns2.reseed_after_seconds = 0;
+  ns2.reseed_status = 0;
+  ottery_st_rand_bytes_nolock(&ns, buf1, sizeof(buf1));
+  ottery_st_rand_bytes_nolock(&ns2, buf2, sizeof(buf2));
+  tt_assert(memcmp(buf1, buf2, sizeof(buf1)));
+  tt_int_op(ns.reseed_status, ==, 0);
+  /* Not yet due again. */
+  ottery_st_rand_bytes_nolock(&ns, big, sizeof(big));
+  tt_int_op(ns.reseed_status, ==, 0);
+
+  /* Children keep their parent's policy. */
+  tt_int_op(0, ==, ottery_st_init_from_parent_nolock(&child, &ns));
+  tt_int_op(child.reseed_after_seconds, ==, 10);
+  tt_int_op(child.last_reseed_time, ==, ns.last_reseed_time);
+
+  ottery_st_wipe_nolock(&ns);
+  ottery_st_wipe_nolock(&ns2);
+  ottery_st_wipe_nolock(&child);
+
+ end:
+  ;
+}
+
+/** Wait up to a few seconds for st's helper thread to finish reseeding
+ * it.  Return true iff it did. */
+static int
+wait_for_async_reseed(struct ottery_state *st)
+{
+  int i;
+  for (i = 0; i < 5000; ++i) {
+    if (__sync_fetch_and_add(&st->async_status, 0) != 1)
+      return 1;
+    usleep(1000);
+  }
+  return 0;
+}
+
+static void
+test_reseed_async(void *arg)
+{
+  __attribute__((aligned(16))) struct ottery_state st;
+  __attribute__((aligned(16))) struct ottery_state_nolock ns;
+  __attribute__((aligned(16))) struct ottery_state_nolock ns2;
+  uint8_t buf1[256], buf2[256];
+  uint8_t big[MAX_OUTPUT_LEN * 2];
+  (void)arg;
+
+  /* The entropy shows up at the next block, not before. */
+  tt_int_op(0, ==, ottery_st_init(&st, NULL));
+  ottery_st_rand_unsigned(&st);
+  st.last_entropy_flags = 0;
+  tt_int_op(0, ==, ottery_st_request_reseed_async(&st));
+  tt_assert(wait_for_async_reseed(&st));
+  tt_ptr_op(st.async_seed, !=, NULL);
+  ottery_st_rand_unsigned(&st);
+  tt_int_op(st.last_entropy_flags, ==, 0);
+  ottery_st_rand_bytes(&st, big, sizeof(big));
+  tt_int_op(st.async_status, ==, 0);
+  tt_ptr_op(st.async_seed, ==, NULL);
+  tt_int_op(st.last_entropy_flags, !=, 0);
+
+  /* Wiping the state waits for the helper thread. */
+  tt_int_op(0, ==, ottery_st_request_reseed_async(&st));
+  tt_int_op(0, ==, ottery_st_request_reseed_async(&st));
+  ottery_st_wipe(&st);
+  tt_int_op(st.async_status, ==, 0);
+
+  /* Reseeding changes the output: compare against a clone that never got
+   * the entropy.  See test_bulk_alignment for the cloning trick. */
+  tt_int_op(0, ==, ottery_st_init_nolock(&ns, NULL));
+  tt_int_op(0, ==, ottery_st_request_reseed_async_nolock(&ns));
+  tt_assert(wait_for_async_reseed(&ns));
+  memcpy(&ns2, &ns, sizeof(ns));
+  ns2.magic = ns.magic ^ (uint32_t)(uintptr_t)&ns ^ (uint32_t)(uintptr_t)&ns2;
+  ns2.async_status = 0;
+  ns2.async_seed = NULL;
+  ottery_st_rand_bytes_nolock(&ns, big, sizeof(big));
+  ottery_st_rand_bytes_nolock(&ns2, big, sizeof(big));
+  ottery_st_rand_bytes_nolock(&ns, buf1, sizeof(buf1));
+  ottery_st_rand_bytes_nolock(&ns2, buf2, sizeof(buf2));
+  tt_assert(memcmp(buf1, buf2, sizeof(buf1)));
+
+  /* If the OS won't give us entropy, nothing changes. */
+  ns.entropy_config.disabled_sources = ~0;
+  tt_int_op(0, ==, ottery_st_request_reseed_async_nolock(&ns));
+  tt_assert(wait_for_async_reseed(&ns));
+  tt_int_op(ns.async_status, ==, 0);
+  memcpy(&ns2, &ns, sizeof(ns));
+  ns2.magic = ns.magic ^ (uint32_t)(uintptr_t)&ns ^ (uint32_t)(uintptr_t)&ns2;
+  ottery_st_rand_bytes_nolock(&ns, big, sizeof(big));
+  ottery_st_rand_bytes_nolock(&ns2, big, sizeof(big));
+  ottery_st_rand_bytes_nolock(&ns, buf1, sizeof(buf1));
+  ottery_st_rand_bytes_nolock(&ns2, buf2, sizeof(buf2));
+  tt_assert(0 == memcmp(buf1, buf2, sizeof(buf1)));
+
+  ottery_st_wipe_nolock(&ns);
+  ottery_st_wipe_nolock(&ns2);
+
+ end:
+  ;
+}
+
 static void
 test_rand_uint(void *arg)
 {
@@ -395,6 +1056,379 @@ test_rand_uint(void *arg)
   ;
 }
 
+static int got_fatal_err;
+static void fatal_handler(int err);
+
+static void
+test_rand_bit(void *arg)
+{
+  uint64_t mask[200];
+  int i, n_set;
+  (void)arg;
+
+  n_set = 0;
+  for (i = 0; i < 10000; ++i) {
+    int b = OTTERY_RAND_BIT();
+    tt_assert(b == 0 || b == 1);
+    n_set += b;
+  }
+  tt_int_op(n_set, >, 4700);
+  tt_int_op(n_set, <, 5300);
+
+  n_set = 0;
+  for (i = 0; i < 10000; ++i)
+    n_set += OTTERY_RAND_BERNOULLI(0.25);
+  tt_int_op(n_set, >, 2300);
+  tt_int_op(n_set, <, 2700);
+  for (i = 0; i < 100; ++i) {
+    tt_int_op(OTTERY_RAND_BERNOULLI(0.0), ==, 0);
+    tt_int_op(OTTERY_RAND_BERNOULLI(-1.0), ==, 0);
+    tt_int_op(OTTERY_RAND_BERNOULLI(0.0 / 0.0), ==, 0);
+    tt_int_op(OTTERY_RAND_BERNOULLI(1.0), ==, 1);
+    tt_int_op(OTTERY_RAND_BERNOULLI(2.0), ==, 1);
+  }
+
+  /* Expect 1280 of 12800 bits. */
+  OTTERY_RAND_BERNOULLI_MASK(mask, 200, 0.1);
+  n_set = 0;
+  for (i = 0; i < 200; ++i)
+    n_set += __builtin_popcountll(mask[i]);
+  tt_int_op(n_set, >, 1100);
+  tt_int_op(n_set, <, 1460);
+
+  OTTERY_RAND_BERNOULLI_MASK(mask, 200, 0.5);
+  n_set = 0;
+  for (i = 0; i < 200; ++i)
+    n_set += __builtin_popcountll(mask[i]);
+  tt_int_op(n_set, >, 6100);
+  tt_int_op(n_set, <, 6700);
+
+  OTTERY_RAND_BERNOULLI_MASK(mask, 200, 1.0);
+  for (i = 0; i < 200; ++i)
+    tt_assert(mask[i] == ~(uint64_t)0);
+  OTTERY_RAND_BERNOULLI_MASK(mask, 200, 0.0);
+  for (i = 0; i < 200; ++i)
+    tt_assert(mask[i] == 0);
+
+  /* A length whose size in bytes overflows is an error, even when we
+   * wouldn't need any random bits to fill it. */
+  ottery_set_fatal_handler(fatal_handler);
+  got_fatal_err = 0;
+  OTTERY_RAND_BERNOULLI_MASK(mask, SIZE_MAX / 4, 1.0);
+  tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+
+ end:
+  ottery_set_fatal_handler(NULL);
+}
+
+static void
+test_rand_float(void *arg)
+{
+  double d, dsum = 0.0, dmin = 1.0, dmax = 0.0;
+  float f, fsum = 0.0f, fmin = 1.0f, fmax = 0.0f;
+  double darray[1000];
+  float farray[1000];
+  int i, n_fine = 0;
+  (void)arg;
+
+  for (i = 0; i < 1000; ++i) {
+    d = OTTERY_RAND_DOUBLE();
+    tt_assert(d >= 0.0 && d < 1.0);
+    /* Every result is a multiple of 2^-53. */
+    tt_assert(d * 9007199254740992.0 ==
+              (double)(uint64_t)(d * 9007199254740992.0));
+    dsum += d;
+    if (d < dmin) dmin = d;
+    if (d > dmax) dmax = d;
+
+    f = OTTERY_RAND_FLOAT();
+    tt_assert(f >= 0.0f && f < 1.0f);
+    tt_assert(f * 16777216.0f == (float)(uint32_t)(f * 16777216.0f));
+    fsum += f;
+    if (f < fmin) fmin = f;
+    if (f > fmax) fmax = f;
+
+    d = OTTERY_RAND_DOUBLE_FULL();
+    tt_assert(d >= 0.0 && d < 1.0);
+    if (d * 9007199254740992.0 != (double)(uint64_t)(d * 9007199254740992.0))
+      ++n_fine;
+    f = OTTERY_RAND_FLOAT_FULL();
+    tt_assert(f >= 0.0f && f < 1.0f);
+    if (f * 16777216.0f != (float)(uint32_t)(f * 16777216.0f))
+      ++n_fine;
+  }
+  tt_assert(dsum > 450.0 && dsum < 550.0);
+  tt_assert(fsum > 450.0f && fsum < 550.0f);
+  tt_assert(dmin < 0.05 && dmax > 0.95);
+  tt_assert(fmin < 0.05f && fmax > 0.95f);
+  /* About a quarter of the full-precision results should be too small and
+   * fine-grained for the plain functions to produce. */
+  tt_int_op(n_fine, >, 200);
+
+  OTTERY_RAND_DOUBLE_ARRAY(darray, 1000);
+  OTTERY_RAND_FLOAT_ARRAY(farray, 1000);
+  dsum = 0.0;
+  fsum = 0.0f;
+  for (i = 0; i < 1000; ++i) {
+    tt_assert(darray[i] >= 0.0 && darray[i] < 1.0);
+    tt_assert(farray[i] >= 0.0f && farray[i] < 1.0f);
+    dsum += darray[i];
+    fsum += farray[i];
+  }
+  tt_assert(dsum > 450.0 && dsum < 550.0);
+  tt_assert(fsum > 450.0f && fsum < 550.0f);
+
+  /* A length whose size in bytes overflows is an error, not a short fill. */
+  ottery_set_fatal_handler(fatal_handler);
+  got_fatal_err = 0;
+  OTTERY_RAND_DOUBLE_ARRAY(darray, SIZE_MAX / 4);
+  tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+  got_fatal_err = 0;
+  OTTERY_RAND_FLOAT_ARRAY(farray, SIZE_MAX / 2);
+  tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+
+ end:
+  ottery_set_fatal_handler(NULL);
+}
+
+/** Return true iff the n values in a are a permutation of 0..n-1. */
+static int
+is_permutation(const uint32_t *a, size_t n)
+{
+  uint8_t *seen = calloc(n, 1);
+  size_t i;
+  int ok = 1;
+  if (!seen)
+    return 0;
+  for (i = 0; i < n && ok; ++i) {
+    if (a[i] >= n || seen[a[i]])
+      ok = 0;
+    else
+      seen[a[i]] = 1;
+  }
+  free(seen);
+  return ok;
+}
+
+static void
+test_shuffle(void *arg)
+{
+  struct elt { uint32_t a, b, c; } elts[500];
+  uint32_t small[1000], three[3];
+  uint32_t *big = NULL;
+  uint64_t *big64 = NULL;
+  int perm_count[3][3];
+  size_t i;
+  int n_moved = 0;
+  (void)arg;
+
+  for (i = 0; i < 1000; ++i)
+    small[i] = (uint32_t)i;
+  OTTERY_SHUFFLE(small, 1000, sizeof(uint32_t));
+  tt_assert(is_permutation(small, 1000));
+  for (i = 0; i < 1000; ++i)
+    n_moved += (small[i] != i);
+  tt_int_op(n_moved, >, 900);
+
+  /* Odd-sized elements stay in one piece. */
+  for (i = 0; i < 500; ++i) {
+    elts[i].a = (uint32_t)i;
+    elts[i].b = ~(uint32_t)i;
+    elts[i].c = (uint32_t)i * 7;
+  }
+  OTTERY_SHUFFLE(elts, 500, sizeof(struct elt));
+  for (i = 0; i < 500; ++i) {
+    tt_int_op(elts[i].b, ==, ~elts[i].a);
+    tt_int_op(elts[i].c, ==, elts[i].a * 7);
+    small[i] = elts[i].a;
+  }
+  tt_assert(is_permutation(small, 500));
+
+  /* Every element should be equally likely to end up in every place. */
+  memset(perm_count, 0, sizeof(perm_count));
+  for (i = 0; i < 6000; ++i) {
+    three[0] = 0; three[1] = 1; three[2] = 2;
+    OTTERY_SHUFFLE(three, 3, sizeof(uint32_t));
+    ++perm_count[0][three[0]];
+    ++perm_count[1][three[1]];
+    ++perm_count[2][three[2]];
+  }
+  for (i = 0; i < 9; ++i) {
+    tt_int_op(perm_count[i/3][i%3], >, 1800);
+    tt_int_op(perm_count[i/3][i%3], <, 2200);
+  }
+
+  /* Trivial cases. */
+  OTTERY_SHUFFLE(small, 0, sizeof(uint32_t));
+  OTTERY_SHUFFLE(small, 1, sizeof(uint32_t));
+  OTTERY_RAND_PERMUTATION(small, 1);
+  tt_int_op(small[0], ==, 0);
+  OTTERY_RAND_PERMUTATION(small, 1000);
+  tt_assert(is_permutation(small, 1000));
+
+  /* Big enough to get split into buckets. */
+  big = malloc(300000 * sizeof(uint32_t));
+  big64 = malloc(100000 * sizeof(uint64_t));
+  tt_assert(big && big64);
+  OTTERY_RAND_PERMUTATION(big, 300000);
+  tt_assert(is_permutation(big, 300000));
+  tt_assert(big[0] != 0 || big[1] != 1 || big[299999] != 299999);
+  for (i = 0; i < 100000; ++i)
+    big64[i] = ((uint64_t)i << 32) | i;
+  OTTERY_SHUFFLE(big64, 100000, sizeof(uint64_t));
+  for (i = 0; i < 100000; ++i) {
+    tt_assert((big64[i] >> 32) == (big64[i] & 0xffffffff));
+    big[i] = (uint32_t)big64[i];
+  }
+  tt_assert(is_permutation(big, 100000));
+
+#if SIZE_MAX > UINT32_MAX
+  /* A permutation of more than 2^32 numbers won't fit in uint32_t. */
+  ottery_set_fatal_handler(fatal_handler);
+  got_fatal_err = 0;
+  OTTERY_RAND_PERMUTATION(big, (size_t)UINT32_MAX + 2);
+  tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+#endif
+
+ end:
+  ottery_set_fatal_handler(NULL);
+  free(big);
+  free(big64);
+}
+
+/** Set *mean and *var to the mean and variance of the n values in a, and
+ * return how many of them are less than lim in absolute value. */
+static int
+get_moments(const double *a, int n, double lim, double *mean, double *var)
+{
+  double sum = 0.0, sumsq = 0.0;
+  int i, n_below = 0;
+  for (i = 0; i < n; ++i) {
+    sum += a[i];
+    sumsq += a[i] * a[i];
+    if (a[i] < lim && a[i] > -lim)
+      ++n_below;
+  }
+  *mean = sum / n;
+  *var = sumsq / n - *mean * *mean;
+  return n_below;
+}
+
+static void
+test_rand_normal(void *arg)
+{
+  double *a = NULL;
+  double mean, var;
+  int i, n_below;
+  const int n = 20000;
+  (void)arg;
+
+  a = malloc(n * sizeof(double));
+  tt_assert(a);
+
+  /* About 68.3% of normal variates lie within 1 of the mean. */
+  for (i = 0; i < n; ++i)
+    a[i] = OTTERY_RAND_NORMAL();
+  n_below = get_moments(a, n, 1.0, &mean, &var);
+  tt_assert(mean > -0.05 && mean < 0.05);
+  tt_assert(var > 0.95 && var < 1.05);
+  tt_int_op(n_below, >, 13300);
+  tt_int_op(n_below, <, 14000);
+
+  /* Not a multiple of the batch size. */
+  OTTERY_RAND_NORMAL_ARRAY(a, n - 7);
+  n_below = get_moments(a, n - 7, 1.0, &mean, &var);
+  tt_assert(mean > -0.05 && mean < 0.05);
+  tt_assert(var > 0.95 && var < 1.05);
+  tt_int_op(n_below, >, 13300);
+  tt_int_op(n_below, <, 14000);
+
+  /* The exponential distribution has mean 1 and variance 1, and 63.2% of
+   * its values are less than 1. */
+  for (i = 0; i < n; ++i) {
+    a[i] = OTTERY_RAND_EXPONENTIAL();
+    tt_assert(a[i] >= 0.0);
+  }
+  n_below = get_moments(a, n, 1.0, &mean, &var);
+  tt_assert(mean > 0.95 && mean < 1.05);
+  tt_assert(var > 0.9 && var < 1.1);
+  tt_int_op(n_below, >, 12300);
+  tt_int_op(n_below, <, 13000);
+
+  OTTERY_RAND_EXPONENTIAL_ARRAY(a, n - 7);
+  for (i = 0; i < n - 7; ++i)
+    tt_assert(a[i] >= 0.0);
+  n_below = get_moments(a, n - 7, 1.0, &mean, &var);
+  tt_assert(mean > 0.95 && mean < 1.05);
+  tt_assert(var > 0.9 && var < 1.1);
+  tt_int_op(n_below, >, 12300);
+  tt_int_op(n_below, <, 13000);
+
+  OTTERY_RAND_NORMAL_ARRAY(a, 0);
+
+ end:
+  free(a);
+}
+
+static void
+test_rand_int_array(void *arg)
+{
+  (void)arg;
+  int i, j;
+  uint32_t a32[1031];
+  uint64_t a64[1031];
+  uint32_t acc32, dec32;
+  uint64_t acc64, dec64;
+
+  /* Try a few sizes, with an odd byte in between to keep the buffer
+   * position unaligned, so that we cross block boundaries in different
+   * places. */
+  for (j = 0; j < 4; ++j) {
+    const int n = (j == 0) ? 1 : (j == 1) ? 7 : (j == 2) ? 300 : 1031;
+    uint8_t b;
+    memset(a32, 0, sizeof(a32));
+    memset(a64, 0, sizeof(a64));
+    OTTERY_RAND_UINT32_ARRAY(a32, n);
+    OTTERY_RAND_BYTES(&b, 1);
+    OTTERY_RAND_UINT64_ARRAY(a64, n);
+
+    acc32 = 0; dec32 = (uint32_t)-1;
+    acc64 = 0; dec64 = (uint64_t)-1;
+    for (i = 0; i < n; ++i) {
+      acc32 |= a32[i];
+      dec32 &= a32[i];
+      acc64 |= a64[i];
+      dec64 &= a64[i];
+    }
+    if (n >= 100) {
+      tt_assert(acc32 == (uint32_t)-1);
+      tt_assert(acc64 == (uint64_t)-1);
+      tt_assert(dec32 == 0);
+      tt_assert(dec64 == 0);
+    } else {
+      tt_assert(acc32 != 0);
+      tt_assert(acc64 != 0);
+    }
+    /* Nothing past the end got touched. */
+    for (i = n; i < 1031; ++i) {
+      tt_assert(a32[i] == 0);
+      tt_assert(a64[i] == 0);
+    }
+  }
+
+  /* A length whose size in bytes overflows is an error, not a short fill. */
+  ottery_set_fatal_handler(fatal_handler);
+  got_fatal_err = 0;
+  OTTERY_RAND_UINT32_ARRAY(a32, SIZE_MAX / 2);
+  tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+  got_fatal_err = 0;
+  OTTERY_RAND_UINT64_ARRAY(a64, SIZE_MAX / 4);
+  tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+
+ end:
+  ottery_set_fatal_handler(NULL);
+}
+
 static void
 test_range(void *arg)
 {
@@ -428,8 +1462,122 @@ test_range(void *arg)
   tt_int_op(got_a_big_one, !=, 0);
   tt_int_op(got_a_big_small_one, !=, 0);
 
+  /* Just above a power of two, about half of all raw draws get rejected;
+   * make sure the results still come out in range and spread out. */
+  got_a_big_one = got_a_big_small_one = 0;
+  for (i = 0; i < 1000; ++i) {
+    unsigned r = OTTERY_RAND_RANGE(0x80000000U);
+    uint64_t r64 = OTTERY_RAND_RANGE64(((uint64_t)1)<<63);
+    tt_assert(r <= 0x80000000U);
+    tt_assert(r64 <= ((uint64_t)1)<<63);
+    if (r >= 0x40000000U)
+      ++got_a_big_small_one;
+    if (r64 >= ((uint64_t)1)<<62)
+      ++got_a_big_one;
+  }
+  tt_int_op(got_a_big_one, >, 250);
+  tt_int_op(got_a_big_small_one, >, 250);
+
+  {
+    uint32_t arr[2000];
+    memset(count, 0, sizeof(count));
+    OTTERY_RAND_RANGE_ARRAY(arr, 2000, 5);
+    for (i = 0; i < 2000; ++i) {
+      tt_int_op(arr[i], <=, 5);
+      count[arr[i]] += 1;
+    }
+    for (i = 0; i <= 5; ++i)
+      tt_int_op(count[i], >, 200);
+
+    OTTERY_RAND_RANGE_ARRAY(arr, 2000, 0);
+    for (i = 0; i < 2000; ++i)
+      tt_int_op(arr[i], ==, 0);
+
+    got_a_big_small_one = 0;
+    OTTERY_RAND_RANGE_ARRAY(arr, 2000, 0x80000000U);
+    for (i = 0; i < 2000; ++i) {
+      tt_assert(arr[i] <= 0x80000000U);
+      if (arr[i] >= 0x40000000U)
+        ++got_a_big_small_one;
+    }
+    tt_int_op(got_a_big_small_one, >, 500);
+
+    memset(arr, 0, sizeof(arr));
+    OTTERY_RAND_RANGE_ARRAY(arr, 1999, 0xffffffffU);
+    tt_assert(arr[1999] == 0);
+
+    /* A length whose size in bytes overflows is an error. */
+    ottery_set_fatal_handler(fatal_handler);
+    got_fatal_err = 0;
+    OTTERY_RAND_RANGE_ARRAY(arr, SIZE_MAX / 2, 5);
+    tt_int_op(got_fatal_err, ==, OTTERY_ERR_INVALID_ARGUMENT);
+  }
+
  end:
-  ;
+  ottery_set_fatal_handler(NULL);
+}
+
+static void
+test_weighted(void *arg)
+{
+  const double weights[5] = { 1.0, 2.0, 3.0, 0.0, 4.0 };
+  const double one[1] = { 0.5 };
+  double bad[2] = { 1.0, -1.0 };
+  struct ottery_alias_table *tbl = NULL, *tbl1 = NULL;
+  uint32_t arr[3000];
+  int count[5];
+  int i;
+  (void)arg;
+
+  tt_int_op(ottery_alias_table_new(&tbl, weights, 0), ==,
+            OTTERY_ERR_INVALID_ARGUMENT);
+  tt_int_op(ottery_alias_table_new(&tbl, bad, 2), ==,
+            OTTERY_ERR_INVALID_ARGUMENT);
+  bad[1] = 0.0 / 0.0;
+  tt_int_op(ottery_alias_table_new(&tbl, bad, 2), ==,
+            OTTERY_ERR_INVALID_ARGUMENT);
+  bad[0] = bad[1] = 0.0;
+  tt_int_op(ottery_alias_table_new(&tbl, bad, 2), ==,
+            OTTERY_ERR_INVALID_ARGUMENT);
+  tt_ptr_op(tbl, ==, NULL);
+
+  tt_int_op(ottery_alias_table_new(&tbl, weights, 5), ==, 0);
+  tt_int_op(ottery_alias_table_new(&tbl1, one, 1), ==, 0);
+
+  /* Expect 1000, 2000, 3000, 0, and 4000. */
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < 10000; ++i) {
+    uint32_t r = OTTERY_RAND_WEIGHTED(tbl);
+    tt_int_op(r, <, 5);
+    ++count[r];
+    tt_int_op(OTTERY_RAND_WEIGHTED(tbl1), ==, 0);
+  }
+  tt_int_op(count[0], >, 850); tt_int_op(count[0], <, 1150);
+  tt_int_op(count[1], >, 1800); tt_int_op(count[1], <, 2200);
+  tt_int_op(count[2], >, 2750); tt_int_op(count[2], <, 3250);
+  tt_int_op(count[3], ==, 0);
+  tt_int_op(count[4], >, 3750); tt_int_op(count[4], <, 4250);
+
+  /* Expect 300, 600, 900, 0, and 1200. */
+  memset(count, 0, sizeof(count));
+  OTTERY_RAND_WEIGHTED_ARRAY(tbl, arr, 3000);
+  for (i = 0; i < 3000; ++i) {
+    tt_int_op(arr[i], <, 5);
+    ++count[arr[i]];
+  }
+  tt_int_op(count[0], >, 200); tt_int_op(count[0], <, 400);
+  tt_int_op(count[1], >, 480); tt_int_op(count[1], <, 720);
+  tt_int_op(count[2], >, 760); tt_int_op(count[2], <, 1040);
+  tt_int_op(count[3], ==, 0);
+  tt_int_op(count[4], >, 1050); tt_int_op(count[4], <, 1350);
+
+  OTTERY_RAND_WEIGHTED_ARRAY(tbl1, arr, 300);
+  for (i = 0; i < 300; ++i)
+    tt_int_op(arr[i], ==, 0);
+
+ end:
+  ottery_alias_table_free(tbl);
+  ottery_alias_table_free(tbl1);
 }
 
 void
@@ -476,6 +1624,62 @@ test_fork(void *arg)
 #endif
 }
 
+static void
+test_fork_nested(void *arg)
+{
+  (void) arg;
+#if defined(_WIN32) || defined(OTTERY_NO_PID_CHECK)
+  tt_skip();
+ end:
+  ;
+#else
+  uint8_t buf[3][64];
+  int fd[2] = { -1, -1 };
+  pid_t p;
+  int i;
+
+  if (pipe(fd) < 0)
+    tt_abort_perror("pipe");
+
+  ottery_init(NULL);
+  ottery_rand_bytes(buf[0], sizeof(buf[0]));
+
+  /* A child, and a child of that child, should each get a stream of their
+   * own: the grandchild must not inherit the child's generation. */
+  if ((p = fork()) == 0) {
+    pid_t p2;
+    ottery_rand_bytes(buf[1], sizeof(buf[1]));
+    if ((p2 = fork()) == 0) {
+      ottery_rand_bytes(buf[2], sizeof(buf[2]));
+      if (write(fd[1], buf[2], sizeof(buf[2])) < 0)
+        perror("write");
+      exit(0);
+    }
+    if (p2 > 0)
+      waitpid(p2, NULL, 0);
+    if (write(fd[1], buf[1], sizeof(buf[1])) < 0)
+      perror("write");
+    exit(0);
+  } else if (p == -1) {
+    tt_abort_perror("fork");
+  }
+  ottery_rand_bytes(buf[0], sizeof(buf[0]));
+  for (i = 1; i <= 2; ++i)
+    tt_int_op(sizeof(buf[i]), ==, read(fd[0], buf[i], sizeof(buf[i])));
+  waitpid(p, NULL, 0);
+
+  tt_assert(memcmp(buf[0], buf[1], sizeof(buf[0])));
+  tt_assert(memcmp(buf[0], buf[2], sizeof(buf[0])));
+  tt_assert(memcmp(buf[1], buf[2], sizeof(buf[0])));
+
+ end:
+  if (fd[0] >= 0)
+    close(fd[0]);
+  if (fd[1] >= 0)
+    close(fd[1]);
+#endif
+}
+
 void
 test_bad_init(void *arg)
 {
@@ -510,11 +1714,14 @@ test_bad_init(void *arg)
   tt_int_op(0, ==, OTTERY_INIT(&cfg));
 
   ottery_config_set_urandom_device(&cfg,"/dev/please-dont-add-this-device");
-  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND|
+                                        OTTERY_ENTROPY_SRC_RDSEED);
   tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==, OTTERY_INIT(&cfg));
 
   ottery_config_set_urandom_device(&cfg,"/dev/null");
-  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND|OTTERY_ENTROPY_SRC_EGD);
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND|
+                                        OTTERY_ENTROPY_SRC_RDSEED|
+                                        OTTERY_ENTROPY_SRC_EGD);
   tt_int_op(OTTERY_ERR_ACCESS_STRONG_RNG, ==, OTTERY_INIT(&cfg));
 
   ottery_config_set_urandom_device(&cfg, NULL);
@@ -524,7 +1731,8 @@ test_bad_init(void *arg)
   ottery_config_mark_entropy_sources_weak(&cfg, ~0);
   tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==, OTTERY_INIT(&cfg));
 
-  ottery_config_mark_entropy_sources_weak(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  ottery_config_mark_entropy_sources_weak(&cfg, OTTERY_ENTROPY_SRC_RDRAND|
+                                          OTTERY_ENTROPY_SRC_RDSEED);
   tt_int_op(0, ==, OTTERY_INIT(&cfg));
 
  end:
@@ -609,6 +1817,110 @@ test_misaligned_init(void *arg)
     free(ptr);
 }
 
+#ifdef OTTERY_THREAD_STATES
+#define N_THREADS 4
+#define N_PER_THREAD 8
+static void *
+per_thread_main(void *arg)
+{
+  uint64_t *out = arg;
+  int i;
+  for (i = 0; i < N_PER_THREAD; ++i)
+    out[i] = ottery_rand_uint64();
+  return NULL;
+}
+
+static void
+test_per_thread_global(void *arg)
+{
+  struct ottery_config cfg;
+  pthread_t threads[N_THREADS];
+  uint64_t results[N_THREADS+1][N_PER_THREAD];
+  int i, j, k, l;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_global_state_mode(&cfg, 99));
+  tt_int_op(0, ==, ottery_config_set_global_state_mode(&cfg,
+                                       OTTERY_GLOBAL_STATE_PER_THREAD));
+  tt_int_op(0, ==, ottery_init(&cfg));
+
+  for (i = 0; i < N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_create(&threads[i], NULL, per_thread_main,
+                                    results[i]));
+  per_thread_main(results[N_THREADS]);
+  for (i = 0; i < N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_join(threads[i], NULL));
+
+  /* Every thread was seeded separately, so nobody should have seen the
+   * same stream as anybody else. */
+  for (i = 0; i <= N_THREADS; ++i)
+    for (j = 0; j < N_PER_THREAD; ++j)
+      for (k = i; k <= N_THREADS; ++k)
+        for (l = (k == i) ? j+1 : 0; l < N_PER_THREAD; ++l)
+          tt_assert(results[i][j] != results[k][l]);
+
+  /* Wiping and then using the global API again should work. */
+  ottery_wipe();
+  tt_int_op(0, ==, ottery_init(&cfg));
+  ottery_rand_bytes(results[0], sizeof(results[0]));
+  tt_assert(results[0][0] != results[N_THREADS][0]);
+  ottery_wipe();
+
+ end:
+  ;
+}
+#endif
+
+#if defined(OTTERY_CPU_STATES) && defined(OTTERY_THREAD_STATES)
+static void
+test_per_cpu_global(void *arg)
+{
+  struct ottery_config cfg;
+  pthread_t threads[N_THREADS];
+  uint64_t results[N_THREADS+1][N_PER_THREAD];
+  const uint8_t seed[] = "one per core";
+  int i, j, k, l;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  tt_int_op(0, ==, ottery_config_set_global_state_mode(&cfg,
+                                       OTTERY_GLOBAL_STATE_PER_CPU));
+  tt_int_op(0, ==, ottery_init(&cfg));
+
+  for (i = 0; i < N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_create(&threads[i], NULL, per_thread_main,
+                                    results[i]));
+  per_thread_main(results[N_THREADS]);
+  for (i = 0; i < N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_join(threads[i], NULL));
+
+  /* There are probably more threads than CPUs here, but no two threads
+   * should have seen the same output. */
+  for (i = 0; i <= N_THREADS; ++i)
+    for (j = 0; j < N_PER_THREAD; ++j)
+      for (k = i; k <= N_THREADS; ++k)
+        for (l = (k == i) ? j+1 : 0; l < N_PER_THREAD; ++l)
+          tt_assert(results[i][j] != results[k][l]);
+
+  tt_int_op(0, ==, ottery_add_seed(seed, sizeof(seed)));
+  ottery_prevent_backtracking();
+  ottery_prefill();
+  ottery_rand_bytes(results[0], sizeof(results[0]));
+  tt_assert(results[0][0] != results[N_THREADS][0]);
+
+  /* Going back to a shared state should work. */
+  tt_int_op(0, ==, ottery_init(NULL));
+  ottery_rand_bytes(results[1], sizeof(results[1]));
+  tt_assert(results[0][0] != results[1][0]);
+  ottery_wipe();
+
+ end:
+  ;
+}
+#endif
+
 static int got_fatal_err = 0;
 static void
 fatal_handler(int err)
@@ -649,6 +1961,41 @@ test_select_prf(void *arg)
   tt_ptr_op(cfg.impl, !=, NULL);
   TT_BLATHER(("The default PRF is %s", cfg.impl->flav));
 
+#ifdef HAVE_SIMD_CHACHA_AVX512
+  /* Likewise for AVX-512. */
+  if (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_AVX512) {
+    tt_int_op(0, ==, ottery_config_force_implementation(&cfg,
+                                                     "CHACHA20-SIMD-AVX512"));
+    tt_ptr_op(cfg.impl, ==, &ottery_prf_chacha20_avx512_);
+    tt_int_op(cfg.impl->output_len, <=, MAX_OUTPUT_LEN);
+  }
+  ottery_disable_cpu_capabilities_(OTTERY_CPUCAP_AVX512);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_force_implementation(&cfg, "CHACHA20-SIMD-AVX512"));
+  tt_int_op(0, ==, ottery_config_force_implementation(&cfg, NULL));
+  tt_ptr_op(cfg.impl, !=, &ottery_prf_chacha20_avx512_);
+#endif
+
+#ifdef HAVE_SIMD_CHACHA_AVX2
+  /* If we have AVX2, we should be able to ask for it by flavor, until we
+   * turn it off. */
+  if (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_AVX2) {
+    tt_int_op(0, ==, ottery_config_force_implementation(&cfg,
+                                                     "CHACHA20-SIMD-AVX2"));
+    tt_ptr_op(cfg.impl, ==, &ottery_prf_chacha20_avx2_);
+  }
+  /* Its stores are all unaligned, so big requests can go straight into the
+   * caller's buffer. */
+  tt_assert(ottery_prf_chacha8_avx2_.flags & OTTERY_PRF_FL_UNALIGNED_OUTPUT);
+  tt_assert(ottery_prf_chacha12_avx2_.flags & OTTERY_PRF_FL_UNALIGNED_OUTPUT);
+  tt_assert(ottery_prf_chacha20_avx2_.flags & OTTERY_PRF_FL_UNALIGNED_OUTPUT);
+  ottery_disable_cpu_capabilities_(OTTERY_CPUCAP_AVX2);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_force_implementation(&cfg, "CHACHA20-SIMD-AVX2"));
+  tt_int_op(0, ==, ottery_config_force_implementation(&cfg, NULL));
+  tt_ptr_op(cfg.impl, !=, &ottery_prf_chacha20_avx2_);
+#endif
+
   /* Now turn off our SIMD support and verify that we get a non-SIMD
    * implementation. */
   ottery_disable_cpu_capabilities_(OTTERY_CPUCAP_SIMD);
@@ -660,6 +2007,163 @@ test_select_prf(void *arg)
   ;
 }
 
+/** Helper: decode the hex string in hex into out. */
+static void
+decode_hex(const char *hex, uint8_t *out)
+{
+  unsigned b;
+  while (*hex && sscanf(hex, "%2x", &b) == 1) {
+    *out++ = (uint8_t)b;
+    hex += 2;
+  }
+}
+
+static void
+test_stream(void *arg)
+{
+  /* Deterministic streams are the ChaCha keystream for key=seed,
+   * nonce=stream ID, so we can check them against anybody's ChaCha.  These
+   * came from OpenSSL; the first is also the first ChaCha20 test vector
+   * from RFC 7539. */
+  static const char zero_block0[] =
+    "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7"
+    "da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586";
+  static const char block0[] =
+    "2ef441c1f0220993293056c89fc59053bc3b2743e435c49ce1ef9ecd8170a350"
+    "44d6664395d5a01f84b82f1f0c87701186efd87cfe32136698e81567b54a6e85";
+  static const char block1000000[] =
+    "f987c7b6246d3c3fe9d2dd94239e5de8ab2d240c2b4813e8ef42e7ccb0230c0b"
+    "882cacb61986529e7187bf8632f92b6ada9f41a02045559ed4d191c6e7efc656";
+  static const char last_block[] =
+    "cdcb5d62d8447b8cf9168485918eb26a9ffa962e0ba860d70f14be3648e90760"
+    "c13b2c2a270ce016ea27060b52be488ac96e4a50c0c1a67263525450b0b756bc";
+  static const char *flavors[] = {
+    "CHACHA20-NOSIMD-DEFAULT",
+    "CHACHA20-SIMD-DEFAULT",
+    "CHACHA20-SIMD-SSSE3",
+    "CHACHA20-SIMD-AVX2",
+    "CHACHA20-SIMD-AVX512",
+    NULL
+  };
+  static const size_t chunks[] = { 3, 61, 4096, 1, 5000, 9000, 7, 0 };
+  const uint64_t stream_id = UINT64_C(0x0123456789abcdef);
+  __attribute__((aligned(16))) struct ottery_stream s1;
+  __attribute__((aligned(16))) struct ottery_stream s2;
+  __attribute__((aligned(16))) struct ottery_stream child;
+  uint8_t seed[OTTERY_STREAM_SEED_LEN];
+  uint8_t expected[64], buf[64];
+  uint8_t bulk[20000], pieces[20000], first_bulk[20000];
+  struct ottery_config cfg;
+  int i, j, n_tested = 0;
+  size_t off;
+  (void)arg;
+
+  memset(seed, 0, sizeof(seed));
+  tt_int_op(0, ==, ottery_stream_init(&s1, NULL, seed, 0));
+  decode_hex(zero_block0, expected);
+  ottery_stream_bytes(&s1, buf, 64);
+  tt_assert(0 == memcmp(buf, expected, 64));
+
+  for (i = 0; i < OTTERY_STREAM_SEED_LEN; ++i)
+    seed[i] = (uint8_t)i;
+
+  for (i = 0; flavors[i]; ++i) {
+    ottery_config_init(&cfg);
+    if (ottery_config_force_implementation(&cfg, flavors[i]))
+      continue;
+    TT_BLATHER(("Testing streams with %s", flavors[i]));
+    tt_int_op(0, ==, ottery_stream_init(&s1, &cfg, seed, stream_id));
+
+    decode_hex(block0, expected);
+    ottery_stream_bytes(&s1, buf, 64);
+    tt_assert(0 == memcmp(buf, expected, 64));
+    tt_int_op(ottery_stream_tell(&s1), ==, 64);
+
+    tt_int_op(0, ==, ottery_stream_seek(&s1, 1000000));
+    decode_hex(block1000000, expected);
+    ottery_stream_bytes(&s1, buf, 64);
+    tt_assert(0 == memcmp(buf, expected, 64));
+
+    /* Integers are little-endian, whatever the platform. */
+    tt_int_op(0, ==, ottery_stream_seek(&s1, 0));
+    tt_int_op(ottery_stream_uint32(&s1), ==, 0xc141f42e);
+    tt_assert(ottery_stream_uint64(&s1) == UINT64_C(0xc8563029930922f0));
+    tt_int_op(0, ==, ottery_stream_seek(&s1, 0));
+    tt_int_op(ottery_stream_range(&s1, 999), ==, 754);
+    tt_int_op(ottery_stream_range(&s1, 999), ==, 574);
+    tt_int_op(ottery_stream_range(&s1, 999), ==, 782);
+    tt_int_op(ottery_stream_tell(&s1), ==, 12);
+
+    /* Jumping keeps our place within the block. */
+    tt_int_op(0, ==, ottery_stream_jump(&s1, 1000000 - 1));
+    tt_int_op(ottery_stream_tell(&s1), ==, 1000000 * 64 - 52);
+    ottery_stream_bytes(&s1, buf, 64);
+    decode_hex(block1000000, expected);
+    tt_assert(0 == memcmp(buf + 52, expected, 12));
+
+    /* Reading in pieces gives the same bytes as reading all at once,
+     * from any starting point. */
+    tt_int_op(0, ==, ottery_stream_seek(&s1, 77));
+    ottery_stream_bytes(&s1, bulk + 5, sizeof(bulk) - 5);
+    tt_int_op(0, ==, ottery_stream_seek(&s1, 77));
+    for (off = 5, j = 0; off < sizeof(pieces); ++j) {
+      size_t n = chunks[j % 7];
+      if (n > sizeof(pieces) - off)
+        n = sizeof(pieces) - off;
+      ottery_stream_bytes(&s1, pieces + off, n);
+      off += n;
+    }
+    tt_assert(0 == memcmp(bulk + 5, pieces + 5, sizeof(bulk) - 5));
+    if (n_tested == 0)
+      memcpy(first_bulk, bulk, sizeof(bulk));
+    else
+      tt_assert(0 == memcmp(first_bulk + 5, bulk + 5, sizeof(bulk) - 5));
+
+    /* The end of the stream. */
+    tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+              ottery_stream_seek(&s1, OTTERY_STREAM_MAX_BLOCKS));
+    tt_int_op(0, ==, ottery_stream_seek(&s1, OTTERY_STREAM_MAX_BLOCKS - 1));
+    tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==, ottery_stream_jump(&s1, 2));
+    decode_hex(last_block, expected);
+    ottery_stream_bytes(&s1, buf, 64);
+    tt_assert(0 == memcmp(buf, expected, 64));
+    ottery_set_fatal_handler(fatal_handler);
+    got_fatal_err = 0;
+    tt_int_op(ottery_stream_range(&s1, 10), ==, 0);
+    tt_int_op(got_fatal_err, ==, OTTERY_ERR_STREAM_EXHAUSTED);
+    ottery_set_fatal_handler(NULL);
+
+    ottery_stream_wipe(&s1);
+    ++n_tested;
+  }
+  tt_int_op(n_tested, >, 0);
+
+  /* Splitting is deterministic, and takes its seed from the parent. */
+  tt_int_op(0, ==, ottery_stream_init(&s1, NULL, seed, stream_id));
+  tt_int_op(0, ==, ottery_stream_init(&s2, NULL, seed, stream_id));
+  tt_int_op(0, ==, ottery_stream_split(&s1, &child));
+  tt_int_op(ottery_stream_tell(&s1), ==, OTTERY_STREAM_SEED_LEN + 8);
+  tt_int_op(ottery_stream_tell(&child), ==, 0);
+  ottery_stream_bytes(&s2, bulk, OTTERY_STREAM_SEED_LEN + 8);
+  tt_int_op(0, ==, ottery_stream_init(&s2, NULL, bulk,
+                                      ((uint64_t)bulk[32]) |
+                                      (((uint64_t)bulk[39]) << 56) |
+                                      (((uint64_t)bulk[38]) << 48) |
+                                      (((uint64_t)bulk[37]) << 40) |
+                                      (((uint64_t)bulk[36]) << 32) |
+                                      (((uint64_t)bulk[35]) << 24) |
+                                      (((uint64_t)bulk[34]) << 16) |
+                                      (((uint64_t)bulk[33]) << 8)));
+  ottery_stream_bytes(&child, buf, 64);
+  ottery_stream_bytes(&s2, expected, 64);
+  tt_assert(0 == memcmp(buf, expected, 64));
+  ottery_stream_bytes(&s1, expected, 64);
+  tt_assert(0 != memcmp(buf, expected, 64));
+
+ end:
+  ottery_set_fatal_handler(NULL);
+}
+
 static void
 test_fatal(void *arg)
 {
@@ -724,7 +2228,7 @@ test_fatal(void *arg)
   got_fatal_err = 0;
   tt_int_op(0, ==, ottery_st_init(&st, NULL));
   ottery_st_rand_unsigned(&st);
-  st.pid = getpid() + 100; /* force a postfork reseed. */
+  st.fork_generation = 0; /* force a postfork reseed. */
   st.entropy_config.urandom_fname = "/dev/null"; /* make reseed impossible */
   st.entropy_config.disabled_sources = ALL_ENTROPY_BUT(RANDOMDEV);
   tt_int_op(got_fatal_err, ==, 0);
@@ -735,7 +2239,7 @@ test_fatal(void *arg)
   got_fatal_err = 0;
   tt_int_op(0, ==, ottery_st_init_nolock(&st_nl, NULL));
   ottery_st_rand_unsigned_nolock(&st_nl);
-  st_nl.pid = getpid() + 100; /* force a postfork reseed. */
+  st_nl.fork_generation = 0; /* force a postfork reseed. */
   st_nl.entropy_config.urandom_fname = "/dev/null"; /* make reseed impossible */
   st_nl.entropy_config.disabled_sources = ALL_ENTROPY_BUT(RANDOMDEV);
   tt_int_op(got_fatal_err, ==, 0);
@@ -804,6 +2308,21 @@ test_versions(void *arg)
 struct testcase_t misc_tests[] = {
   { "osrandom", test_osrandom, TT_FORK, NULL, NULL },
   { "get_sizeof", test_get_sizeof, 0, NULL, NULL },
+  { "user_entropy", test_user_entropy, TT_FORK, NULL, NULL },
+  { "bulk_alignment", test_bulk_alignment, TT_FORK, NULL, NULL },
+  { "prefill", test_prefill, TT_FORK, NULL, NULL },
+  { "init_from_parent", test_init_from_parent, TT_FORK, NULL, NULL },
+  { "max_buffer_len", test_max_buffer_len, TT_FORK, NULL, NULL },
+  { "reseed_interval", test_reseed_interval, TT_FORK, NULL, NULL },
+  { "reseed_async", test_reseed_async, TT_FORK, NULL, NULL },
+  { "stream", test_stream, TT_FORK, NULL, NULL },
+  { "fork_nested", test_fork_nested, TT_FORK, NULL, NULL },
+#ifdef OTTERY_THREAD_STATES
+  { "per_thread_global", test_per_thread_global, TT_FORK, NULL, NULL },
+#endif
+#if defined(OTTERY_CPU_STATES) && defined(OTTERY_THREAD_STATES)
+  { "per_cpu_global", test_per_cpu_global, TT_FORK, NULL, NULL },
+#endif
   { "select_prf", test_select_prf, TT_FORK, 0, NULL },
   { "fatal", test_fatal, TT_FORK, NULL, NULL },
   { "build_flags", test_build_flags, 0, NULL, NULL },
@@ -813,7 +2332,13 @@ struct testcase_t misc_tests[] = {
 
 #define COMMON_TESTS(flags)                                            \
   { "range", test_range, TT_FORK|flags, &setup, NULL },                \
+  { "weighted", test_weighted, TT_FORK|flags, &setup, NULL },          \
   { "unsigned", test_rand_uint, TT_FORK|flags, &setup, NULL },         \
+  { "bit", test_rand_bit, TT_FORK|flags, &setup, NULL },              \
+  { "float", test_rand_float, TT_FORK|flags, &setup, NULL },          \
+  { "shuffle", test_shuffle, TT_FORK|flags, &setup, NULL },           \
+  { "normal", test_rand_normal, TT_FORK|flags, &setup, NULL },        \
+  { "int_array", test_rand_int_array, TT_FORK|flags, &setup, NULL },   \
   { "little_buf", test_rand_little_buf, TT_FORK|flags, &setup, NULL }, \
   { "big_buf", test_rand_big_buf, TT_FORK|flags, &setup, NULL },       \
   { "fork", test_fork, TT_FORK|flags, &setup, NULL },                  \
@@ -836,11 +2361,21 @@ struct testcase_t global_tests[] = {
   END_OF_TESTCASES,
 };
 
+#ifdef OTTERY_THREAD_STATES
+struct testcase_t per_thread_tests[] = {
+  COMMON_TESTS(OT_ENABLE_PER_THREAD),
+  END_OF_TESTCASES,
+};
+#endif
+
 struct testgroup_t groups[] = {
   { "misc/", misc_tests },
   { "state/", stateful_tests },
   { "nolock/", nolock_tests },
   { "global/", global_tests },
+#ifdef OTTERY_THREAD_STATES
+  { "per_thread/", per_thread_tests },
+#endif
   END_OF_GROUPS
 };
 
@@ -92,6 +92,24 @@ const struct ottery_prf *prfs_best[] = {
 #define prfs_best prfs_midrange
 #endif
 
+#ifdef HAVE_SIMD_CHACHA_AVX2
+const struct ottery_prf *prfs_avx2[] = {
+  &ottery_prf_chacha8_avx2_,
+  &ottery_prf_chacha12_avx2_,
+  &ottery_prf_chacha20_avx2_,
+  NULL
+};
+#endif
+
+#ifdef HAVE_SIMD_CHACHA_AVX512
+const struct ottery_prf *prfs_avx512[] = {
+  &ottery_prf_chacha8_avx512_,
+  &ottery_prf_chacha12_avx512_,
+  &ottery_prf_chacha20_avx512_,
+  NULL
+};
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -100,6 +118,18 @@ main(int argc, char **argv)
     prfs = prfs_no_simd;
   if (argc > 1 && !strcmp(argv[1], "midrange"))
     prfs = prfs_midrange;
+#ifdef HAVE_SIMD_CHACHA_AVX2
+  /* Only try AVX2 if this CPU can run it; otherwise, fall back to the
+   * best implementation we have. */
+  if (argc > 1 && !strcmp(argv[1], "avx2") &&
+      (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_AVX2))
+    prfs = prfs_avx2;
+#endif
+#ifdef HAVE_SIMD_CHACHA_AVX512
+  if (argc > 1 && !strcmp(argv[1], "avx512") &&
+      (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_AVX512))
+    prfs = prfs_avx512;
+#endif
 
   X("helloworld!helloworld!helloworld", "!hellowo", 0);
   X("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",